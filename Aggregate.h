@@ -0,0 +1,287 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <MessageCodec.h>
+#include <PayloadSerializer.h>
+
+/*
+* Windowed summaries of the sample stream, published instead of (or next to)
+* every raw packet. Each node and field has a window of its own, from the
+* first sample in it until window_ms later; the window length comes from the
+* first AggRule matching the node and field, or the default. Per sample the
+* accumulator only adds: count, sum and sum of squares in integers, min, max
+* and the last value, so the mean and standard deviation come out exact when
+* the window closes, whatever its length.
+*
+* A summary carries every window of one node that is due, in the payload
+* format of the raw batches:
+*
+* Binary, little endian:
+*   summary: 0xE3, version (u8), src (u16), windows (u8), window...
+*   window:  field (u8), scale (i16), ms (varint), n (varint), min, max, last (i16),
+*            mean, sd (i32, AGG_EXTRA_SCALE times finer than the field)
+*
+* JSON:
+*   {"src":2,"summary":[{"f":0,"ms":60000,"n":208,"min":21.0,"max":21.4,"mean":21.21,"sd":0.08,"last":21.3},...]}
+*
+* Windows close on the receiver's clock when a sample comes in or
+* agg_write() is called, agg_next_ms() says when the next one is due.
+*/
+
+#define AGG_MODE_RAW 1 // every packet, as before
+#define AGG_MODE_SUMMARY 2
+#define AGG_MODE_BOTH (AGG_MODE_RAW | AGG_MODE_SUMMARY)
+
+#define AGG_MAGIC 0xE3
+#define AGG_VERSION 1
+#define AGG_ANY_NODE 0xFFFF
+#define AGG_ANY_FIELD 0xFF
+#define AGG_EXTRA_SCALE 10 // mean and sd get one more decimal than the samples
+#define AGG_FIELDS_MAX CODEC_MAX_FIELDS
+
+#ifndef AGG_NODES_MAX
+  #define AGG_NODES_MAX 16 // nodes with windows open at once, one more flushes the oldest early
+#endif
+
+#define AGG_SUMMARY_MAX_B (24 + AGG_FIELDS_MAX * 120) // JSON worst case, binary needs 5 + 27 per window
+
+typedef struct _agg_rule{
+  uint16_t src; // or AGG_ANY_NODE
+  uint8_t field; // or AGG_ANY_FIELD
+  uint32_t window_ms;
+}AggRule;
+
+typedef struct _agg_stat{
+  uint32_t n; // 0 while no window is open
+  uint32_t start; // ms, first sample
+  uint32_t window_ms;
+  int64_t sum;
+  int64_t sum_squares;
+  int16_t min;
+  int16_t max;
+  int16_t last;
+}AggStat;
+
+typedef struct _agg_node{
+  uint16_t src;
+  uint8_t open; // windows with samples in them
+  uint32_t first; // ms, oldest open window
+  AggStat stats[AGG_FIELDS_MAX];
+}AggNode;
+
+typedef struct _aggregator{
+  AggNode nodes[AGG_NODES_MAX];
+  uint8_t nfields;
+  const int16_t *scales;
+  const AggRule *rules;
+  uint8_t nrules;
+  uint32_t window_ms; // when no rule matches
+  uint32_t samples;
+  uint32_t summaries;
+  uint32_t windows;
+  uint32_t early; // windows closed before their time to make room for a node
+}Aggregator;
+
+inline void agg_init(Aggregator *a, uint8_t nfields, const int16_t *scales, const AggRule *rules, uint8_t nrules, uint32_t window_ms){
+  memset((void *)a, 0, sizeof(Aggregator));
+  a->nfields = nfields;
+  a->scales = scales;
+  a->rules = rules;
+  a->nrules = nrules;
+  a->window_ms = window_ms;
+}
+
+inline uint32_t agg_window_ms(const Aggregator *a, uint16_t src, uint8_t field){
+  for(uint8_t i = 0; i < a->nrules; i++)
+    if((a->rules[i].src == AGG_ANY_NODE || a->rules[i].src == src) && (a->rules[i].field == AGG_ANY_FIELD || a->rules[i].field == field))
+      return a->rules[i].window_ms;
+  return a->window_ms;
+}
+
+inline void agg_sample(AggStat *s, int16_t value, uint32_t now){
+  if(!s->n){
+    s->start = now;
+    s->sum = s->sum_squares = 0;
+    s->min = s->max = value;
+  }
+  s->n++;
+  s->sum += value;
+  s->sum_squares += (int32_t)value * value;
+  if(value < s->min) s->min = value;
+  if(value > s->max) s->max = value;
+  s->last = value;
+}
+
+// the node's entry, or a free one, NULL when every entry has windows open
+inline AggNode *agg_node_for(Aggregator *a, uint16_t src){
+  AggNode *free_node = NULL;
+
+  for(uint8_t i = 0; i < AGG_NODES_MAX; i++){
+    AggNode *node = &a->nodes[i];
+
+    if(node->open && node->src == src)
+      return node;
+    if(!node->open && !free_node)
+      free_node = node;
+  }
+  if(free_node)
+    free_node->src = src;
+  return free_node;
+}
+
+// the node whose oldest window opened first, to close early when the table is full
+inline AggNode *agg_oldest(Aggregator *a){
+  AggNode *oldest = NULL;
+
+  for(uint8_t i = 0; i < AGG_NODES_MAX; i++)
+    if(a->nodes[i].open && (!oldest || a->nodes[i].first - oldest->first >= 0x80000000UL))
+      oldest = &a->nodes[i];
+  return oldest;
+}
+
+/**
+* Adds one packet's samples, fields holds messages * nfields values. Returns
+* 0 when there is no entry for the node, write out agg_oldest() with force
+* and try again.
+*/
+inline uint8_t agg_add_packet(Aggregator *a, uint16_t src, const int16_t *fields, uint8_t messages, uint32_t now){
+  AggNode *node = agg_node_for(a, src);
+
+  if(!node)
+    return 0;
+  if(!messages)
+    return 1;
+
+  for(uint8_t f = 0; f < a->nfields; f++){
+    AggStat *s = &node->stats[f];
+
+    if(!s->n){
+      s->window_ms = agg_window_ms(a, src, f);
+      if(!node->open++) node->first = now;
+    }
+    for(uint8_t m = 0; m < messages; m++)
+      agg_sample(s, fields[m * a->nfields + f], now);
+  }
+  a->samples += messages;
+  return 1;
+}
+
+inline uint8_t agg_due(const AggStat *s, uint32_t now){ return s->n && now - s->start >= s->window_ms; }
+
+/**
+* Writes the windows of node that are due, all open ones with force, as one
+* summary over w's buffer and closes them; w only lends its buffer and
+* format. Returns the payload length, 0 when nothing was due.
+*/
+inline size_t agg_write(Aggregator *a, AggNode *node, uint32_t now, uint8_t force, PayloadWriter *w){
+  uint8_t due = 0, written = 0;
+
+  for(uint8_t f = 0; f < a->nfields; f++)
+    due += force ? node->stats[f].n > 0 : agg_due(&node->stats[f], now);
+  if(!due)
+    return 0;
+
+  w->length = 0;
+  if(w->format == PAYLOAD_FORMAT_JSON){
+    payload_put_str(w, "{\"src\":"); payload_put_uint(w, node->src);
+    payload_put_str(w, ",\"summary\":[");
+  }
+  else{
+    payload_put(w, AGG_MAGIC);
+    payload_put(w, AGG_VERSION);
+    payload_put_u16(w, node->src);
+    payload_put(w, due);
+  }
+
+  for(uint8_t f = 0; f < a->nfields; f++){
+    AggStat *s = &node->stats[f];
+    double mean, variance;
+    int32_t mean_fixed, sd_fixed;
+
+    if(!(force ? s->n > 0 : agg_due(s, now)))
+      continue;
+    if(!agg_due(s, now))
+      a->early++;
+
+    mean = (double)s->sum / s->n;
+    variance = ((double)s->sum_squares - (double)s->sum * mean) / s->n;
+    mean_fixed = (int32_t)lround(mean * AGG_EXTRA_SCALE);
+    sd_fixed = (int32_t)lround(sqrt(variance > 0 ? variance : 0) * AGG_EXTRA_SCALE);
+
+    if(w->format == PAYLOAD_FORMAT_JSON){
+      int32_t scale = a->scales[f];
+
+      if(written) payload_put(w, ',');
+      payload_put_str(w, "{\"f\":"); payload_put_uint(w, f);
+      payload_put_str(w, ",\"ms\":"); payload_put_uint(w, now - s->start);
+      payload_put_str(w, ",\"n\":"); payload_put_uint(w, s->n);
+      payload_put_str(w, ",\"min\":"); payload_put_fixed(w, s->min, scale);
+      payload_put_str(w, ",\"max\":"); payload_put_fixed(w, s->max, scale);
+      payload_put_str(w, ",\"mean\":"); payload_put_fixed(w, mean_fixed, scale * AGG_EXTRA_SCALE);
+      payload_put_str(w, ",\"sd\":"); payload_put_fixed(w, sd_fixed, scale * AGG_EXTRA_SCALE);
+      payload_put_str(w, ",\"last\":"); payload_put_fixed(w, s->last, scale);
+      payload_put(w, '}');
+    }
+    else{
+      payload_put(w, f);
+      payload_put_u16(w, (uint16_t)a->scales[f]);
+      payload_put_varint(w, now - s->start);
+      payload_put_varint(w, s->n);
+      payload_put_u16(w, (uint16_t)s->min);
+      payload_put_u16(w, (uint16_t)s->max);
+      payload_put_u16(w, (uint16_t)s->last);
+      payload_put_u16(w, (uint16_t)mean_fixed);
+      payload_put_u16(w, (uint16_t)((uint32_t)mean_fixed >> 16));
+      payload_put_u16(w, (uint16_t)sd_fixed);
+      payload_put_u16(w, (uint16_t)((uint32_t)sd_fixed >> 16));
+    }
+
+    s->n = 0;
+    node->open--;
+    written++;
+  }
+
+  if(w->format == PAYLOAD_FORMAT_JSON)
+    payload_put_str(w, "]}");
+
+  // the oldest window left open, for agg_oldest()
+  written = 0;
+  for(uint8_t f = 0; f < a->nfields; f++)
+    if(node->stats[f].n && (!written++ || node->stats[f].start - node->first >= 0x80000000UL))
+      node->first = node->stats[f].start;
+
+  a->windows += due;
+  a->summaries++;
+  return w->length;
+}
+
+// ms until the next window is due, 0 when one already is, -1 with none open
+inline long agg_next_ms(const Aggregator *a, uint32_t now){
+  long next = -1;
+
+  for(uint8_t i = 0; i < AGG_NODES_MAX; i++){
+    if(!a->nodes[i].open)
+      continue;
+    for(uint8_t f = 0; f < a->nfields; f++){
+      const AggStat *s = &a->nodes[i].stats[f];
+      long left;
+
+      if(!s->n)
+        continue;
+      left = now - s->start >= s->window_ms ? 0 : (long)(s->window_ms - (now - s->start));
+      if(next < 0 || left < next) next = left;
+    }
+  }
+  return next;
+}
+
+// whether a stored payload is a summary rather than a raw batch
+inline uint8_t agg_is_summary(const uint8_t *payload, size_t length){
+  return length > 2 && (payload[0] == AGG_MAGIC || (payload[0] == '{' && payload[2] == 's'));
+}
+
+#endif
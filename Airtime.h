@@ -0,0 +1,72 @@
+#ifndef AIRTIME_H
+#define AIRTIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* LoRa time on air for the E22's air data rates, after the SX126x datasheet:
+*
+*   T_sym = 2^SF / BW
+*   N_sym = N_pre + 4.25 + 8 + ceil(max(8 PL + 16 CRC - 4 SF + 8 + 20 H, 0) / (4 (SF - 2 DE))) (CR + 4)
+*
+* with an explicit header (H = 1), CRC on and DE, the low data rate
+* optimisation, on for symbols of 16 ms and more. SF5 and SF6 take 6.25
+* instead of 4.25 and leave out the + 8.
+*
+* EByte does not say which spreading factor and bandwidth stand behind an air
+* data rate, so airtime_rates takes the setting whose bit rate,
+* SF BW / 2^SF 4/5, comes closest to the nominal one, with coding rate 4/5 and
+* an AIRTIME_PREAMBLE symbol preamble. The module sends what it is given in
+* sub-packets of OPTION.subPacketSetting bytes, each a LoRa packet of its own;
+* whatever header it adds to them is not known and not counted here.
+*/
+
+#define AIRTIME_PREAMBLE 8 // symbols
+#define AIRTIME_CR 1 // 4/5
+#define AIRTIME_DE_SYMBOL_US 16000 // low data rate optimisation from this symbol time up
+
+typedef struct _airtime_rate{
+  uint8_t sf;
+  uint16_t bw_khz;
+}AirtimeRate;
+
+// per SPED.airDataRate, 0.3k to 62.5k
+static const AirtimeRate airtime_rates[8] = { { 12, 125 }, { 12, 500 }, { 11, 500 }, { 7, 125 }, { 6, 125 }, { 6, 250 }, { 6, 500 }, { 5, 500 } };
+// per OPTION.subPacketSetting
+static const uint16_t airtime_sub_packet_b[4] = { 240, 128, 64, 32 };
+
+inline uint32_t airtime_symbol_us(uint8_t sf, uint16_t bw_khz){ return ((uint32_t)1000 << sf) / bw_khz; }
+
+// one LoRa packet of payload_b bytes
+inline uint32_t airtime_packet_us(uint8_t sf, uint16_t bw_khz, uint16_t payload_b){
+  uint32_t symbol_us = airtime_symbol_us(sf, bw_khz);
+  uint8_t de = symbol_us >= AIRTIME_DE_SYMBOL_US;
+  int32_t bits = 8 * (int32_t)payload_b + 16 - 4 * sf + 20 + (sf >= 7 ? 8 : 0);
+  uint32_t divisor = 4 * (sf - 2 * de);
+  uint32_t payload_symbols = bits > 0 ? (bits + divisor - 1) / divisor * (AIRTIME_CR + 4) : 0;
+  uint32_t quarter_symbols = 4 * (AIRTIME_PREAMBLE + 8 + payload_symbols) + (sf >= 7 ? 17 : 25);
+
+  return quarter_symbols * symbol_us / 4;
+}
+
+// bytes written to the module, split into sub-packets of sub_packet_b
+inline uint32_t airtime_us(uint16_t bytes, uint8_t rate, uint16_t sub_packet_b){
+  const AirtimeRate *r = &airtime_rates[rate & 0x07];
+  uint32_t total = 0;
+
+  while(bytes > sub_packet_b){
+    total += airtime_packet_us(r->sf, r->bw_khz, sub_packet_b);
+    bytes -= sub_packet_b;
+  }
+  return total + (bytes ? airtime_packet_us(r->sf, r->bw_khz, bytes) : 0);
+}
+
+// nominal bit rate of the LoRa setting behind rate, bits/s
+inline uint32_t airtime_bps(uint8_t rate){
+  const AirtimeRate *r = &airtime_rates[rate & 0x07];
+
+  return (uint32_t)r->sf * r->bw_khz * 1000 * 4 / 5 >> r->sf;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef DHT22_H
+#define DHT22_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef DHT22_NO_DRIVER
+  #include <Arduino.h>
+  #include <driver/rmt.h>
+#endif
+
+/*
+* DHT22 (AM2302) read without bit-banging. After a start pulse from the host
+* the sensor sends a train of low/high pulses:
+*
+*   ~80 us low, ~80 us high                         response
+*   ~50 us low, ~26 us high (0) or ~70 us high (1)  per bit, 40 bits MSB first
+*   ~50 us low                                      end
+*
+* The bits are humidity (u16, 0.1 %), temperature (u16, 0.1 C, bit 15 is the
+* sign) and the low byte of their sum. The usual library times that train in
+* a loop with interrupts off for ~5 ms, long enough to lose E22 bytes on the
+* UART. Here the RMT peripheral records the pulse widths while the CPU does
+* something else, and dht_decode() turns them into a reading: a pure function
+* of the widths, it runs the same on the host. DHT22_NO_DRIVER leaves out the
+* RMT part.
+*
+* The driver is the legacy RMT API (driver/rmt.h, ESP32 Arduino core 2.x).
+* The start pulse is the only part that waits, the task sleeps through it.
+* dht_poll() is called once per sample without ever waiting on the sensor:
+* it picks up the capture an earlier call started and starts the next one
+* when DHT_MIN_INTERVAL_MS is up, the sensor reads no faster than that.
+* Polled more often it returns the last reading again, d->reads tells a new
+* one from a repeat.
+*/
+
+#define DHT_BITS 40
+#define DHT_RESPONSE_MIN_US 40 // each half of the response
+#define DHT_RESPONSE_MAX_US 120
+#define DHT_BIT_LOW_MIN_US 30
+#define DHT_BIT_LOW_MAX_US 90
+#define DHT_BIT_HIGH_MIN_US 10
+#define DHT_BIT_ONE_US 48 // a high at least this long is a 1
+#define DHT_BIT_HIGH_MAX_US 100
+#define DHT_PULSES_MAX 96 // the response, the bits and what the line did before them
+#define DHT_HUMIDITY_MAX 1000 // 0.1 %
+#define DHT_TEMPERATURE_MIN -400 // 0.1 C
+#define DHT_TEMPERATURE_MAX 800
+
+typedef enum _dht_status{
+  DHT_OK,
+  DHT_ERR_NO_RESPONSE, // no capture, or no response pulses in it
+  DHT_ERR_SHORT, // fewer than DHT_BITS bits after the response
+  DHT_ERR_TIMING, // a pulse out of range
+  DHT_ERR_CHECKSUM,
+  DHT_ERR_RANGE // checks out but outside what the sensor can measure
+}DhtStatus;
+
+typedef struct _dht_pulse{
+  uint8_t level;
+  uint16_t us;
+}DhtPulse;
+
+typedef struct _dht_reading{
+  int16_t temperature; // 0.1 C
+  int16_t humidity; // 0.1 %
+}DhtReading;
+
+inline uint8_t dht_in(uint16_t us, uint16_t min, uint16_t max){ return us >= min && us <= max; }
+
+/**
+* Decodes a pulse train, levels alternating, into out. Whatever came before
+* the response is skipped. Returns a DhtStatus, out is only written on DHT_OK.
+*/
+inline uint8_t dht_decode(const DhtPulse *pulses, size_t count, DhtReading *out){
+  uint8_t bytes[DHT_BITS / 8] = { 0 }, sum = 0;
+  uint16_t raw;
+  size_t i;
+
+  for(i = 0; i + 1 < count; i++)
+    if(!pulses[i].level && pulses[i + 1].level
+       && dht_in(pulses[i].us, DHT_RESPONSE_MIN_US, DHT_RESPONSE_MAX_US) && dht_in(pulses[i + 1].us, DHT_RESPONSE_MIN_US, DHT_RESPONSE_MAX_US))
+      break;
+  if(i + 1 >= count)
+    return DHT_ERR_NO_RESPONSE;
+  i += 2;
+
+  if(count - i < 2 * DHT_BITS)
+    return DHT_ERR_SHORT;
+
+  for(uint8_t b = 0; b < DHT_BITS; b++, i += 2){
+    const DhtPulse *low = &pulses[i], *high = &pulses[i + 1];
+
+    if(low->level || !high->level || !dht_in(low->us, DHT_BIT_LOW_MIN_US, DHT_BIT_LOW_MAX_US)
+       || !dht_in(high->us, DHT_BIT_HIGH_MIN_US, DHT_BIT_HIGH_MAX_US))
+      return DHT_ERR_TIMING;
+    bytes[b >> 3] = (bytes[b >> 3] << 1) | (high->us >= DHT_BIT_ONE_US);
+  }
+
+  for(uint8_t k = 0; k < 4; k++)
+    sum += bytes[k];
+  if(sum != bytes[4])
+    return DHT_ERR_CHECKSUM;
+
+  raw = (bytes[2] << 8) | bytes[3];
+  int16_t humidity = (bytes[0] << 8) | bytes[1], temperature = raw & 0x8000 ? -(int16_t)(raw & 0x7FFF) : (int16_t)raw;
+  if(humidity < 0 || humidity > DHT_HUMIDITY_MAX || temperature < DHT_TEMPERATURE_MIN || temperature > DHT_TEMPERATURE_MAX)
+    return DHT_ERR_RANGE;
+
+  out->temperature = temperature;
+  out->humidity = humidity;
+  return DHT_OK;
+}
+
+#ifndef DHT22_NO_DRIVER
+
+#define DHT_RMT_CLK_DIV 80 // 1 us ticks off the 80 MHz APB clock
+#define DHT_RMT_IDLE_US 200 // the capture ends once the line has been high this long
+#define DHT_RMT_FILTER_TICKS 80 // APB ticks, glitches under 1 us are ignored
+#define DHT_RMT_BUFFER_B 1024
+#define DHT_START_LOW_MS 2 // at least 1 ms, the first tick may come right away
+const long DHT_MIN_INTERVAL_MS = 2000; // the sensor does not measure more often
+const long DHT_CAPTURE_MS = 20; // the train is ~5 ms, nothing by then means no sensor
+
+typedef struct _dht{
+  uint8_t pin;
+  rmt_channel_t channel;
+  RingbufHandle_t ring;
+  uint8_t capturing;
+  uint8_t valid; // reading holds a good read
+  unsigned long started; // last start pulse
+  DhtReading reading;
+  uint32_t reads;
+  uint32_t errors;
+  uint8_t status; // of the last read, DhtStatus
+}Dht;
+
+// RMT items are two pulses each, a zero duration ends the capture
+inline size_t dht_pulses_from_rmt(const rmt_item32_t *items, size_t count, DhtPulse *pulses, size_t max){
+  size_t n = 0;
+
+  for(size_t i = 0; i < count; i++){
+    uint16_t durations[2] = { (uint16_t)items[i].duration0, (uint16_t)items[i].duration1 };
+    uint8_t levels[2] = { (uint8_t)items[i].level0, (uint8_t)items[i].level1 };
+
+    for(uint8_t h = 0; h < 2; h++){
+      if(!durations[h])
+        return n;
+      if(n && pulses[n - 1].level == levels[h])
+        pulses[n - 1].us += durations[h];
+      else if(n < max)
+        pulses[n++] = { levels[h], durations[h] };
+      else
+        return n;
+    }
+  }
+  return n;
+}
+
+inline uint8_t dht_begin(Dht *d, uint8_t pin, rmt_channel_t channel){
+  rmt_config_t config = RMT_DEFAULT_CONFIG_RX((gpio_num_t)pin, channel);
+
+  memset((void *)d, 0, sizeof(Dht));
+  d->pin = pin;
+  d->channel = channel;
+
+  config.clk_div = DHT_RMT_CLK_DIV;
+  config.rx_config.filter_en = true;
+  config.rx_config.filter_ticks_thresh = DHT_RMT_FILTER_TICKS;
+  config.rx_config.idle_threshold = DHT_RMT_IDLE_US;
+  pinMode(pin, INPUT_PULLUP);
+
+  return rmt_config(&config) == ESP_OK && rmt_driver_install(channel, DHT_RMT_BUFFER_B, 0) == ESP_OK
+         && rmt_get_ringbuf_handle(channel, &d->ring) == ESP_OK;
+}
+
+// the start pulse, then the line is released and the RMT records the answer
+inline void dht_start(Dht *d){
+  pinMode(d->pin, OUTPUT_OPEN_DRAIN);
+  digitalWrite(d->pin, LOW);
+  vTaskDelay(pdMS_TO_TICKS(DHT_START_LOW_MS));
+  pinMode(d->pin, INPUT_PULLUP);
+  rmt_rx_start(d->channel, true);
+  d->capturing = 1;
+  d->started = millis();
+}
+
+// decodes what the ring buffer holds, waiting at most ticks for it
+inline uint8_t dht_finish(Dht *d, TickType_t ticks){
+  DhtPulse pulses[DHT_PULSES_MAX];
+  size_t size = 0, n = 0;
+  rmt_item32_t *items = (rmt_item32_t *)xRingbufferReceive(d->ring, &size, ticks);
+
+  if(!items && ticks == 0 && millis() - d->started < (unsigned long)DHT_CAPTURE_MS)
+    return 0; // still coming in
+  if(items){
+    n = dht_pulses_from_rmt(items, size / sizeof(rmt_item32_t), pulses, DHT_PULSES_MAX);
+    vRingbufferReturnItem(d->ring, (void *)items);
+  }
+  rmt_rx_stop(d->channel);
+  d->capturing = 0;
+
+  d->status = n ? dht_decode(pulses, n, &d->reading) : (uint8_t)DHT_ERR_NO_RESPONSE;
+  if(d->status == DHT_OK){
+    d->valid = 1;
+    d->reads++;
+  }
+  else
+    d->errors++;
+  return 1;
+}
+
+/**
+* One step per sample, never waits on the sensor. Returns 1 once there is a
+* good reading in d->reading, the latest one.
+*/
+inline uint8_t dht_poll(Dht *d){
+  if(d->capturing)
+    dht_finish(d, 0);
+  if(!d->capturing && (!d->started || millis() - d->started >= (unsigned long)DHT_MIN_INTERVAL_MS))
+    dht_start(d);
+  return d->valid;
+}
+
+/**
+* Starts a read and sleeps until it is in, for a node that is not awake long
+* enough to pick it up later. Returns the DhtStatus.
+*/
+inline uint8_t dht_read(Dht *d){
+  dht_start(d);
+  dht_finish(d, pdMS_TO_TICKS(DHT_CAPTURE_MS));
+  return d->status;
+}
+
+#endif // DHT22_NO_DRIVER
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef E22_CONFIG_H
+#define E22_CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <Log.h>
+#include <LoRa_E22.h>
+
+/*
+* Boot time configuration of the E22. Every config command costs a mode
+* switch and a 9600 baud round trip, and WRITE_CFG_PWR_DWN_SAVE also a write
+* to the module's flash, so e22_config_sync() reads the config once, lets
+* the sketch fill in what it wants on top of it, and only writes what
+* differs:
+*
+*   E22_CONFIG_SAME   nothing written, the usual boot
+*   E22_CONFIG_LINK   only air rate or power differ, which is what an
+*                     adaptive switch (temporary write) leaves behind while
+*                     the module keeps power; written temporarily, the flash
+*                     already holds the rest
+*   E22_CONFIG_DIFF   anything else, written and saved to flash
+*
+* After a power-on reset the module has just powered up too and runs what its
+* flash holds, so a different rate or power there is no leftover: it is saved
+* like any other difference, or every cold boot would write it again.
+*
+* The module answers a write with the config it took, so nothing is read
+* back afterwards.
+*
+* The module only takes commands at 9600 baud, whatever its UART is set to
+* for data. With E22_UART_FAST the data rate is 115200: the ESP32's UART
+* drops to 9600 around every config command (e22_uart_config()) and comes
+* back to the rate the module runs with after it (e22_uart_data()). A
+* frame then spends ~20 ms on the UART each way instead of ~250 ms.
+*/
+
+#ifndef E22_UART_FAST
+  #define E22_UART_FAST 0
+#endif
+#define E22_UART_CONFIG_BPS 9600
+#define E22_UART_BPS (E22_UART_FAST ? 115200 : 9600) // data, TDMA slots are sized for it on both ends
+#define E22_UART_BPS_TYPE (E22_UART_FAST ? UART_BPS_115200 : UART_BPS_9600)
+#define E22_UART_TX_BUFFER_B 1024 // a frame write is a copy into the driver, not a wait on the FIFO
+#define E22_UART_RX_TIMEOUT_SYMBOLS 4 // line idle this many bytes' time ends a frame
+
+#define E22_CONFIG_SAME 0
+#define E22_CONFIG_LINK 1
+#define E22_CONFIG_DIFF 2
+
+// ADDH up to TRANSMISSION_MODE, the bytes the module stores; the header is per command and the key reads back as 0
+#define E22_CONFIG_FIELDS_B (offsetof(Configuration, TRANSMISSION_MODE) + sizeof(((Configuration *)0)->TRANSMISSION_MODE) - offsetof(Configuration, ADDH))
+
+static const uint32_t e22_uart_bps[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 }; // by UART_BPS_TYPE
+
+inline void e22_uart_rate(HardwareSerial *serial, uint32_t bps){
+  if(serial->baudRate() == bps)
+    return;
+  serial->flush(); // what is still going out leaves at the old rate
+  serial->updateBaudRate(bps);
+}
+
+inline void e22_uart_config(HardwareSerial *serial){ e22_uart_rate(serial, E22_UART_CONFIG_BPS); }
+
+// back to the rate the module runs with, config is what it took last
+inline void e22_uart_data(HardwareSerial *serial, const Configuration *config){ e22_uart_rate(serial, e22_uart_bps[config->SPED.uartBaudRate & 0x07]); }
+
+inline uint8_t e22_config_diff(const Configuration *have, const Configuration *want){
+  Configuration linked = *have;
+
+  if(!memcmp(&have->ADDH, &want->ADDH, E22_CONFIG_FIELDS_B))
+    return E22_CONFIG_SAME;
+
+  linked.SPED.airDataRate = want->SPED.airDataRate;
+  linked.OPTION.transmissionPower = want->OPTION.transmissionPower;
+  return memcmp(&linked.ADDH, &want->ADDH, E22_CONFIG_FIELDS_B) ? E22_CONFIG_DIFF : E22_CONFIG_LINK;
+}
+
+inline void e22_config_print(Configuration *config){
+  LOG_DEBUG("----------------------------------------");
+  LOG_DEBUG("AddH : %X", config->ADDH);
+  LOG_DEBUG("AddL : %X", config->ADDL);
+  LOG_DEBUG("NetID : %X", config->NETID);
+  LOG_DEBUG("Chan : %u -> %s", config->CHAN, config->getChannelDescription());
+  LOG_DEBUG("SpeedParityBit     : %u -> %s", config->SPED.uartParity, config->SPED.getUARTParityDescription());
+  LOG_DEBUG("SpeedUARTDatte     : %u -> %s", config->SPED.uartBaudRate, config->SPED.getUARTBaudRateDescription());
+  LOG_DEBUG("SpeedAirDataRate   : %u -> %s", config->SPED.airDataRate, config->SPED.getAirDataRateDescription());
+  LOG_DEBUG("OptionSubPacketSett: %u -> %s", config->OPTION.subPacketSetting, config->OPTION.getSubPacketSetting());
+  LOG_DEBUG("OptionTranPower    : %u -> %s", config->OPTION.transmissionPower, config->OPTION.getTransmissionPowerDescription());
+  LOG_DEBUG("OptionRSSIAmbientNo: %u -> %s", config->OPTION.RSSIAmbientNoise, config->OPTION.getRSSIAmbientNoiseEnable());
+  LOG_DEBUG("TransModeWORPeriod : %u -> %s", config->TRANSMISSION_MODE.WORPeriod, config->TRANSMISSION_MODE.getWORPeriodByParamsDescription());
+  LOG_DEBUG("TransModeTransContr: %u -> %s", config->TRANSMISSION_MODE.WORTransceiverControl, config->TRANSMISSION_MODE.getWORTransceiverControlDescription());
+  LOG_DEBUG("TransModeEnableLBT : %u -> %s", config->TRANSMISSION_MODE.enableLBT, config->TRANSMISSION_MODE.getLBTEnableByteDescription());
+  LOG_DEBUG("TransModeEnableRSSI: %u -> %s", config->TRANSMISSION_MODE.enableRSSI, config->TRANSMISSION_MODE.getRSSIEnableByteDescription());
+  LOG_DEBUG("TransModeEnabRepeat: %u -> %s", config->TRANSMISSION_MODE.enableRepeater, config->TRANSMISSION_MODE.getRepeaterModeEnableByteDescription());
+  LOG_DEBUG("TransModeFixedTrans: %u -> %s", config->TRANSMISSION_MODE.fixedTransmission, config->TRANSMISSION_MODE.getFixedTransmissionDescription());
+  LOG_DEBUG("----------------------------------------");
+}
+
+/**
+* Reads the module's config, passes a copy to desired() to set the fields the
+* sketch cares about, and writes it if it differs. applied gets the config
+* the module runs with, and serial is left at its UART rate. Returns 1 on
+* success.
+*/
+inline uint8_t e22_config_sync(LoRa_E22 *e22, HardwareSerial *serial, void (*desired)(Configuration *), Configuration *applied){
+  ResponseStructContainer read;
+  ResponseStatus written;
+  Configuration have, want;
+  uint8_t diff;
+
+  e22_uart_config(serial);
+  read = e22->getConfiguration();
+  if(read.status.code != E22_SUCCESS){
+    LOG_ERROR("E22 config read failed: %s", read.status.getResponseDescription());
+    read.close();
+    return 0;
+  }
+
+  have = *(Configuration *)read.data;
+  read.close(); // the library mallocs every config read
+  want = have;
+  desired(&want);
+
+  diff = e22_config_diff(&have, &want);
+  if(diff == E22_CONFIG_LINK && esp_reset_reason() == ESP_RST_POWERON)
+    diff = E22_CONFIG_DIFF;
+  if(diff == E22_CONFIG_SAME){
+    LOG_INFO("E22 config unchanged, nothing written");
+    *applied = want;
+    e22_uart_data(serial, applied);
+    e22_config_print(applied);
+    return 1;
+  }
+
+  written = e22->setConfiguration(want, diff == E22_CONFIG_DIFF ? WRITE_CFG_PWR_DWN_SAVE : WRITE_CFG_PWR_DWN_LOSE);
+  if(written.code != E22_SUCCESS){
+    LOG_ERROR("E22 config write failed: %s", written.getResponseDescription());
+    *applied = have;
+    e22_uart_data(serial, applied);
+    return 0;
+  }
+
+  LOG_INFO("E22 config written, %s", diff == E22_CONFIG_DIFF ? "saved" : "link only");
+  *applied = want;
+  e22_uart_data(serial, applied);
+  e22_config_print(applied);
+  return 1;
+}
+
+#endif
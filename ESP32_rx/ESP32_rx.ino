@@ -1,44 +1,33 @@
 #include <Arduino.h>
 #include "Helper.h"
 
-extern Packet rx_packet;
-int rssi = 0;
-
 void setup() {
   
   Serial.begin(115200);
   while(!Serial) { }; // wait for serial monitor to connect
+  setupLog();
 
-  DEBUG_PRINTLN("Started Serial & debug");
+  LOG_INFO("Started Serial & debug");
 
-  DEBUG_PRINTLN("Trying E22 setup");
+  LOG_INFO("Trying E22 setup");
   setupE22();
 
-  DEBUG_PRINTLN("Trying Wifi setup");
-  setupWiFi();
+  LOG_INFO("Starting uplink");
+  setupUplink();
+
+  LOG_INFO("Trying store setup");
+  setupStore();
 
-  DEBUG_PRINTLN("Trying MQTT setup");
-  setupMqtt();
+  LOG_INFO("Starting rx task");
+  setupTasks();
 
 }
 
 void loop() {
-  vTaskDelay(1000);
-  // put your main code here, to run repeatedly
-  rssi = receive_packet(&rx_packet);
-  
-  if(rssi < 0 || rx_packet.packetData._msg_index > 0){
-    DEBUG_PRINTLN("Failed to receive a packet");
-    return;
-  }
-  else{
-    DEBUG_PRINTLN("GOT DATA");
-    
-    packet_printer(rx_packet);
-    mqttPublishData(&rx_packet, (uint8_t)rssi);
-    clear_packet_messages(&rx_packet);
-  }
-
-
-
-}
\ No newline at end of file
+  // reception runs in rx_task_code, woken by AUX, this task only reports
+  LOG_INFO("Packets: %u Errors: %u Dropped: %u Gaps: %u Duplicates: %u Recovered: %u", rx_count, rx_errors, rx_dropped, rx_gaps, rx_duplicates, rx_recovered);
+  LOG_INFO("Corrupt: %u Corrected: %u Corrected bytes: %u", rx_corrupt, rx_corrected, rx_corrected_bytes);
+  LOG_INFO("Nodes: %u Rate: %u Switches: %u Beacons: %u Slots: %u", nodes.count, link_rate, link_switches, tdma_beacons, tdma_slots);
+  LOG_INFO("Backlog: %u Lost: %u Uplink: %s Reconnects: %u", store_ready ? sf_pending(&store) : 0, mqtt_lost, uplink_up() ? "up" : "down", uplink.reconnects);
+  vTaskDelay(STATS_INTERVAL);
+}
@@ -1,14 +1,28 @@
 #ifndef HELPER_H
 #define HELPER_H
 
-#define LoRa_E22_DEBUG
 #define INCLUDE_eTaskGetState
 
 #include <Arduino.h>
 #include <DHT.h>
+#include <Log.h>
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+  #define LoRa_E22_DEBUG // the library prints straight to Serial
+#endif
 #include <LoRa_E22.h>
 
 #include <creds.h>
+#include <MessageCodec.h>
+#include <PacketSchema.h>
+#include <E22Config.h>
+#include <LinkLayer.h>
+#include <Fragment.h>
+#include <NodeTable.h>
+#include <PayloadSerializer.h>
+#include <Aggregate.h>
+#include <StoreForward.h>
+#include <Metrics.h>
+#include <LittleFS.h>
 #include <WiFi.h>
 #include <ArduinoMqttClient.h>
 
@@ -17,7 +31,6 @@
   #define TRANSMITTER
 #endif
 
-#define MAX_PACKET_SIZE_B 235
 
 #define E22_AUX 18 
 #define E22_M0 21
@@ -31,186 +44,988 @@
 #define E22_DEST_ADDL 0x03
 
 #define E22_CONFIG_ADDH 0x00
-#define E22_CONFIG_ADDL_TX 0x02 // if we are tx
+#ifndef E22_CONFIG_ADDL_TX
+  #define E22_CONFIG_ADDL_TX 0x02 // if we are tx, give every node its own with -DE22_CONFIG_ADDL_TX=
+#endif
 #define E22_CONFIG_ADDL_RX E22_DEST_ADDL // if we are rx
 #define E22_CONFIG_NETID 0x00
 #define E22_CONFIG_CHAN 0x04
+#define E22_AIR_RATE_BASE AIR_DATA_RATE_010_24 // boot rate, and the fallback when an adaptive switch is lost
+#define E22_POWER_BASE POWER_22 // acks always go out at full power
 
-typedef struct _Message{
-	float temperature;
-	float humidity;
-	//uint8_t whatever;
-}Message;
-
-typedef struct _packet_data{
-	uint32_t count;
-	uint8_t _msg_index;
-}PacketData;
-
-#define MAX_PACKET_SIZE_B 235
-#define MESSAGE_SIZE_B sizeof(Message)
-#define PACKETDATA_SIZE_B sizeof(PacketData)
-#define MESSAGE_COUNT ((MAX_PACKET_SIZE_B - PACKETDATA_SIZE_B) / MESSAGE_SIZE_B) // (240 - 8) / 8 = 19 messages // ceil so that we always round down and don't try and store data we can't send
-#define PACKET_MSG_SIZE_B (MESSAGE_SIZE_B * (MESSAGE_COUNT))
-#define PADD_SIZE_B (MAX_PACKET_SIZE_B - PACKET_MSG_SIZE_B - PACKETDATA_SIZE_B)
+#ifndef E22_WOR
+  #define E22_WOR 0 // 1: listen duty cycled as a WOR receiver, only packets sent with the WOR preamble wake it
+#endif
+#define E22_WOR_PERIOD WOR_2000_011 // listen cycle, the nodes' preamble has to be as long
+#define E22_LISTEN_MODE (E22_WOR ? MODE_2_WOR_RECEIVER : MODE_0_NORMAL)
+
+typedef struct _packet_slot{
+	Packet packet;
+	uint8_t rssi;
+	uint32_t arrived_us; // AUX edge, metrics_now_us()
+	uint32_t read_us; // off the UART
+}PacketSlot;
+
+#ifndef MQTT_PAYLOAD_FORMAT
+  #define MQTT_PAYLOAD_FORMAT PAYLOAD_FORMAT_BINARY // or PAYLOAD_FORMAT_JSON
+#endif
 
-typedef struct _Packet{
-	PacketData packetData;
-	Message messages[MESSAGE_COUNT];
-	uint8_t padding[PADD_SIZE_B];
-}Packet;
+#ifndef AGG_MODE
+  #define AGG_MODE AGG_MODE_RAW // AGG_MODE_SUMMARY publishes windowed summaries instead of every packet, AGG_MODE_BOTH both
+#endif
 
-#define PACKET_SIZE_B sizeof(Packet)
-#define BUFFER_SIZE PACKET_SIZE_B * 10
+#define MQTT_BATCH_MAX_B 4096 // at least one full packet in JSON
+#define MQTT_BATCH_MAX_PACKETS 16
+#define MQTT_BATCH_WRITERS 4 // nodes with a batch open at once, a fifth flushes the oldest
+#define MQTT_TOPIC_MAX_B 48 // base topic, "/" and four hex digits of the node address
+#define STORE_PREFIX_B 2 // node address stored in front of each batch
 
-const long TX_INTERVAL = 1000 * 60; // 1000 ms * 60s * 2m = 2m in ms 
-const long SENSOR_INTERVAL = TX_INTERVAL / MESSAGE_COUNT; 
+#ifdef HOST_SIM
+  #define STORE_ROOT "."
+#else
+  #define STORE_ROOT "/littlefs" // LittleFS VFS mount point
+#endif
+#define STORE_PATH STORE_ROOT "/mqtt_backlog.log"
+#define STORE_INDEX_PATH STORE_ROOT "/mqtt_backlog.idx"
+#define STORE_CAPACITY_B (512 * 1024) // ~10 days of one node at a batch per minute
+#define STORE_DRAIN_BATCH 8 // records published back to back per drain round
+
+const long RX_WAKE_TIMEOUT = 5000; // ms, fallback wake if an AUX edge is missed
+const long STATS_INTERVAL = 1000 * 60; // serial report and the stats topic
+const long LINK_SILENCE_MS = TX_INTERVAL * 5 / 2; // nothing heard on a switched rate for this long, go back to the boot rate
+const long LINK_JOIN_INTERVAL = 1000L * 60; // on a switched rate, a beacon on the boot rate this often for nodes that boot later
+const long NODE_EXPIRE_MS = 1000L * 60 * 60; // a silent node can be evicted for a new one after this long
+const long MQTT_BATCH_MAX_MS = 5000; // oldest packet in a batch waits at most this long
+const long AGG_WINDOW_MS = 1000L * 60; // summary window for anything agg_rules does not match
+const AggRule agg_rules[] = { // first match wins
+  { AGG_ANY_NODE, 1, 1000L * 60 * 5 }, // humidity moves slowly
+};
+const long WIFI_CONNECT_TIMEOUT = 15000; // ms to associate before starting over
+const long MQTT_CONNECT_TIMEOUT = 5000; // ms the broker TCP connect may block the uplink task
+const long MQTT_KEEPALIVE = 30000;
+const long UPLINK_POLL_MS = 100; // how often the uplink task services the client
+const long UPLINK_BACKOFF_MIN = 1000; // ms, doubles per failed attempt
+const long UPLINK_BACKOFF_MAX = 60000;
+const long UPLINK_LOCK_WAIT = 200; // ms a publish waits for the client before treating the uplink as down
+const long STORE_DRAIN_INTERVAL = 1000; // ms between drain rounds, leaves the broker and this task room for live data
+
+const long RX_SLOT_WAIT = 100; // ms the rx task waits for a slot before dropping a frame
+
+#ifndef LINK_ADAPTIVE
+  #define LINK_ADAPTIVE 1 // 0 keeps every node on the boot rate and power
+#endif
+#ifndef TDMA_ENABLED
+  #define TDMA_ENABLED (!E22_WOR) // 0 sends no beacons, nodes transmit whenever a packet is ready; WOR nodes sleep through them
+#endif
+#define RX_POOL_SLOTS 8 // frames that can be waiting on MQTT before any is dropped
+#define RX_UART_BUFFER_B 1024 // holds a burst the size of the E22's own buffer
+
+#define RX_TASK_STACK_B 4096
+#define RX_TASK_CORE 1 // WiFi lives on core 0
+#define RX_TASK_PRIORITY 3
+#define PUBLISH_TASK_STACK_B 8192
+#define STATS_MAX_B (576 + 5 * METRICS_HIST_MAX_B) // counters plus the five histograms
+#define PUBLISH_TASK_CORE 0
+#define PUBLISH_TASK_PRIORITY 2
+#define UPLINK_TASK_STACK_B 4096
+#define UPLINK_TASK_CORE 0
+#define UPLINK_TASK_PRIORITY 1 // connects may block, below the publish task
 
 const char mqtt_broker[] = "test.mosquitto.org";
 int        mqtt_port     = 1883;
 const char mqtt_topic[]  = "EPIC_E22/Rx_Packet";
-
+const char mqtt_stats_topic[] = "EPIC_E22/Rx_Stats"; // counters and stage latencies, see Metrics.h
+const char mqtt_diag_topic[] = "EPIC_E22/Tx_Diag"; // a node's own diagnostics, reassembled from fragments
+const char mqtt_summary_topic[] = "EPIC_E22/Rx_Summary"; // windowed summaries, see Aggregate.h
+
+
+typedef enum _uplink_state{
+  UPLINK_WIFI_START,
+  UPLINK_WIFI_WAIT,
+  UPLINK_MQTT_CONNECT,
+  UPLINK_BACKOFF,
+  UPLINK_UP
+}UplinkState;
+
+typedef struct _uplink{
+  volatile UplinkState state;
+  UplinkState resume; // where UPLINK_BACKOFF goes once it expires
+  unsigned long since; // entered the current state
+  unsigned long backoff;
+  uint8_t failures;
+  uint32_t reconnects;
+}Uplink;
 
 WiFiClient wifiClient;
 MqttClient mqttClient(wifiClient);
-TaskHandle_t  sensorTask = NULL, txTask = NULL;
+Uplink uplink;
+SemaphoreHandle_t uplinkLock = NULL; // mqttClient is shared by the uplink and publish tasks
+
+TaskHandle_t rxTask = NULL, publishTask = NULL, uplinkTask = NULL;
+QueueHandle_t freeQueue = NULL, readyQueue = NULL; // empty slots to the rx task, filled slots to the publish task
 
 LoRa_E22 e22ttl(&Serial2, E22_AUX, E22_M0, E22_M1, UART_BPS_RATE_9600 );
 
 ResponseStructContainer rsc;
 ResponseContainer rc;
-Configuration *config;
 ResponseStatus rs;
+Configuration e22_config; // last config written, link switches change it without reading the module back
 
-Packet rx_packet;
+PacketSlot rx_pool[RX_POOL_SLOTS];
 Packet tx_packet;
+uint32_t rx_count = 0;
+uint32_t rx_errors = 0;
+uint32_t rx_dropped = 0;
+uint32_t rx_gaps = 0;
+uint32_t rx_duplicates = 0;
+uint32_t rx_recovered = 0;
+uint32_t rx_corrupt = 0; // failed the CRC, after FEC
+uint32_t rx_corrected = 0; // frames FEC repaired
+uint32_t rx_corrected_bytes = 0;
+NodeTable nodes; // only touched by the rx task
+Reassembler reassembler; // only touched by the publish task
+uint8_t link_rate = E22_AIR_RATE_BASE; // the whole network shares the gateway's air rate
+unsigned long link_last_heard = 0;
+unsigned long link_join_at = 0; // last beacon on the boot rate
+uint32_t link_switches = 0;
+unsigned long tdma_next_beacon = 0;
+uint8_t tdma_slots = 0; // advertised in the last beacon
+uint32_t tdma_beacons = 0;
+uint32_t mqtt_lost = 0;
+uint32_t rx_bytes = 0;
+uint32_t mqtt_published = 0;
+uint32_t mqtt_published_bytes = 0;
+volatile uint32_t aux_fall_us = 0;
+LatencyHist lat_uart; // AUX edge to the frame read off the UART
+LatencyHist lat_queue; // read to picked up by the publish task
+LatencyHist lat_decode; // codec unpack of one packet
+LatencyHist lat_publish; // one MQTT publish call
+LatencyHist lat_e2e; // AUX edge of a batch's first packet to the batch published
+#define STATS_HISTS 5
+const LatencyHist *stats_hists[STATS_HISTS] = { &lat_uart, &lat_queue, &lat_decode, &lat_publish, &lat_e2e };
+const char *stats_hist_names[STATS_HISTS] = { "uart_us", "queue_us", "decode_us", "publish_us", "e2e_us" };
+char stats_buffer[STATS_MAX_B];
 Message new_message;
-char buffer[BUFFER_SIZE];
+int16_t rx_fields[MESSAGE_COUNT * MESSAGE_FIELDS];
+
+typedef struct _mqtt_batch{
+  PayloadWriter writer;
+  uint16_t src;
+  unsigned long start; // when the first packet went in
+  uint32_t first_us; // AUX edge of the first packet
+  uint8_t record[STORE_PREFIX_B + MQTT_BATCH_MAX_B]; // node address for the store, then the payload
+}MqttBatch;
+
+MqttBatch mqtt_batches[MQTT_BATCH_WRITERS];
+Aggregator aggregator; // only touched by the publish task
+PayloadWriter agg_writer;
+uint8_t agg_record[STORE_PREFIX_B + AGG_SUMMARY_MAX_B]; // node address for the store, then the summary
+uint8_t store_batch[STORE_PREFIX_B + MQTT_BATCH_MAX_B];
+StoreForward store;
+uint8_t store_ready = 0;
 
 
 void buffer_dump(uint8_t *buffer, uint8_t length){
-  DEBUG_PRINTLN("---- dump ----");
-  for(int i = 0; i < length; i++){
-    if(!(i%8))
-      DEBUG_PRINTLN(" ");
-      
-    DEBUG_PRINT(buffer[i], HEX); 
-    DEBUG_PRINT(" , ");
-    
+  char row[8 * 3 + 1];
+
+  LOG_DEBUG("---- dump ----");
+  for(int i = 0; i < length; i += 8){
+    for(int j = 0; j < 8 && i + j < length; j++)
+      sprintf(row + j * 3, "%02X ", buffer[i + j]);
+    LOG_DEBUG("%s", row);
   }
-  DEBUG_PRINTLN(" ");
 }
 
 /**
 *
 */
-void packet_printer(Packet packet){
-  DEBUG_PRINTLN("---- Message printer ----");
+void packet_printer(Packet *packet){
+  LOG_DEBUG("---- Message printer ----");
   /*for(int i = 0; i < length; i++){
-    DEBUG_PRINT(i); DEBUG_PRINT(" C: "); DEBUG_PRINT(msgs[i].count); DEBUG_PRINT(" T: "); DEBUG_PRINTLN(msgs[i].temperature);
+    LOG_DEBUG("%u C: %u T: %.1f", i, msgs[i].count, msgs[i].temperature);
   }
-  DEBUG_PRINTLN(" ");*/
-}
-
-void append_packet_message(Packet *packet, Message msg){
-  memcpy((void *)&packet->messages[packet->packetData._msg_index], (const void*) &msg, MESSAGE_SIZE_B);
-  packet->packetData._msg_index++;
-  
-}
-
-uint8_t packet_full(Packet packet){ return packet.packetData._msg_index >= MESSAGE_COUNT; }
-
-void clear_packet_messages(Packet *packet){
-  memset((void *)&packet->messages, 0, PACKET_MSG_SIZE_B );
-  packet->packetData._msg_index = 0;
+  LOG_DEBUG(" ");*/
 }
 
 void send_packet(Packet *packet){
   rs = e22ttl.sendFixedMessage(E22_DEST_ADDH, E22_CONFIG_ADDL_TX, E22_CONFIG_CHAN, (const void*)packet, PACKET_SIZE_B);
   
   if(rs.code != E22_SUCCESS){
-    DEBUG_PRINTLN("E22 failed to send message");
-    DEBUG_PRINTLN(rs.getResponseDescription());
+    LOG_ERROR("E22 failed to send message: %s", rs.getResponseDescription());
     return;
   }
   else
 
   
-  DEBUG_PRINTLN("All data sent correctly");
+  LOG_DEBUG("All data sent correctly");
   
 }
 
+/**
+* Reads one frame (packet + RSSI byte) straight from the E22's UART into packet.
+* Called once AUX has dropped, so the bytes are already on their way. The CRC
+* is checked and a few bad bytes corrected in place, so the frame gets acked
+* instead of resent; beyond that only the header is checked here, decoding
+* happens in the publish task.
+*/
 int receive_packet(Packet *packet){
-  rsc = e22ttl.receiveMessageComplete(PACKET_SIZE_B, true);
+  uint8_t rssi = 0;
+  size_t len = Serial2.readBytes((uint8_t *)packet, PACKET_SIZE_B);
+  int corrected;
 
-  DEBUG_PRINT("code: "); DEBUG_PRINT(rsc.status.code); DEBUG_PRINT(" RSSI: "); DEBUG_PRINTLN(rsc.rssi);
+  if(len != PACKET_SIZE_B || (E22_RSSI && Serial2.readBytes(&rssi, 1) != 1)){
+    LOG_ERROR("E22 failed to receive message, got bytes: %u", len);
+    while(Serial2.available()) Serial2.read(); // resync on the next frame
+    return -1;
+  }
 
-  
-  if(rsc.status.code != E22_SUCCESS){
-    DEBUG_PRINTLN("E22 failed to receive message");
-    DEBUG_PRINTLN(rsc.status.getResponseDescription());
+  LOG_DEBUG("RSSI: %u", rssi);
+
+  corrected = packet_check(packet);
+  if(corrected < 0){
+    rx_corrupt++;
+    LOG_WARN("E22 received a corrupt frame, RSSI: %u", rssi);
+    return -1;
+  }
+  if(corrected){
+    rx_corrected++;
+    rx_corrected_bytes += corrected;
+    LOG_DEBUG("Corrected bytes: %u", corrected);
+  }
+
+  if(!packet_valid(packet) && !fragment_valid(packet)){
+    LOG_ERROR("E22 received a malformed packet or schema: %u", packet->packetData.schema);
     return -1;
   }
 
-  memcpy((void *)packet, (const void *)&rsc.data, PACKET_SIZE_B);
+  return rssi;
+}
+
+// temporary config write, the module comes back on the boot rate after a power loss
+uint8_t e22_write_rate(uint8_t rate){
+  e22_config.SPED.airDataRate = rate;
+  e22_uart_config(&Serial2);
+  rs = e22ttl.setConfiguration(e22_config, WRITE_CFG_PWR_DWN_LOSE);
+  e22_uart_data(&Serial2, &e22_config);
+
+  if(rs.code != E22_SUCCESS){
+    LOG_ERROR("E22 failed to switch rate: %s", rs.getResponseDescription());
+    e22_config.SPED.airDataRate = link_rate;
+    return 0;
+  }
+  return 1;
+}
+
+uint8_t e22_set_rate(uint8_t rate){
+  if(rate == link_rate)
+    return 1;
+  if(!e22_write_rate(rate))
+    return 0;
+
+  LOG_INFO("Gateway rate now: %u", rate);
+  link_rate = rate;
+  link_switches++;
+  return 1;
+}
+
+/**
+* Feeds the packet into its sender's link average and fills the ack's
+* LINK_ARG_* when the sender should change rate or power. The air rate is
+* shared by every node, so it only adapts while there is a single one.
+* Returns the rate the gateway has to move to once the ack is out.
+*/
+uint8_t link_adapt_packet(LinkAdapt *la, PacketData *pd, uint8_t rssi, uint8_t lost, ControlFrame *ack){
+  uint8_t rate = link_rate, power = LINK_FLAG_POWER(pd->flags);
+
+  link_adapt_sample(la, rssi, power, lost);
+
+  if(LINK_ADAPTIVE && link_adapt_choose(la, &rate, &power, nodes.count == 1)){
+    LOG_INFO("Link switch for: %u rate: %u power: %u margin: %d", pd->src, rate, power, link_margin_db(la, rate, power));
+  }
+
+  // repeated until the node reports the power, a rate change only gets the one ack
+  if(rate != link_rate || la->want_power != LINK_FLAG_POWER(pd->flags)){
+    ack->args[LINK_ARG_RATE] = LINK_ARG_SET | rate;
+    ack->args[LINK_ARG_POWER] = LINK_ARG_SET | la->want_power;
+  }
 
-  return rsc.rssi;
+  return rate;
 }
 
-void mqttPublishData(Packet *packet, uint8_t rssi){
-  memset((void *)&buffer, 0, BUFFER_SIZE);
+/**
+* The node's TDMA slot, handing out the lowest free one on first contact.
+* Slots of evicted nodes free up with them; a node past TDMA_MAX_SLOTS gets
+* TDMA_JOIN_SLOT and asks again with every packet.
+*/
+uint8_t tdma_assign(NodeState *node){
+  uint64_t used = 0;
+  uint8_t i;
 
-  sprintf((char *)&buffer, "Packet Count: %ld , RSSI: %d\n", packet->packetData.count, rssi);
+  if(node->slot)
+    return node->slot - 1;
 
-  for(int i = 0; i < packet->packetData._msg_index; i++)
-    sprintf((char *)&buffer, "  c: %d, T: %f \n", i, packet->messages[i].temperature);
+  for(uint16_t j = 0; j < NODE_TABLE_SLOTS; j++) // only on a node's first ack
+    if(nodes.slots[j].addr != NODE_ADDR_EMPTY && nodes.slots[j].slot)
+      used |= 1ULL << (nodes.slots[j].slot - 1);
 
-  mqttClient.beginMessage(mqtt_topic);
-  mqttClient.print(buffer);
-  mqttClient.endMessage();
+  for(i = 0; i < TDMA_MAX_SLOTS && (used & (1ULL << i)); i++);
+  if(i == TDMA_MAX_SLOTS)
+    return TDMA_JOIN_SLOT;
 
-  DEBUG_PRINTLN("MQTT Data Publishers: ")
-  DEBUG_PRINT(buffer);
+  LOG_INFO("Slot %u for: %u", i, node->addr);
+  node->slot = i + 1;
+  return i;
+}
 
+/**
+* Broadcasts the beacon that starts a superframe, sized for the highest slot
+* in use at the current air rate. The superframe is timed from the end of the
+* transmission, the moment the nodes see AUX fall.
+*/
+void tdma_send_beacon(){
+  ControlFrame beacon;
+  uint16_t slot_ms = tdma_slot_ms(PACKET_SIZE_B, link_rate, E22_UART_BPS);
+  uint32_t beacon_ms = tdma_beacon_ms(link_rate, E22_UART_BPS), frame_ms;
+
+  tdma_slots = 0;
+  for(uint16_t i = 0; i < NODE_TABLE_SLOTS; i++)
+    if(nodes.slots[i].addr != NODE_ADDR_EMPTY && nodes.slots[i].slot > tdma_slots)
+      tdma_slots = nodes.slots[i].slot;
+  frame_ms = tdma_frame_ms(slot_ms, tdma_slots, beacon_ms);
+
+  memset((void *)&beacon, 0, CONTROL_FRAME_SIZE_B);
+  beacon.magic = CTRL_MAGIC;
+  beacon.type = CTRL_BEACON;
+  beacon.src = (E22_CONFIG_ADDH << 8) | E22_CONFIG_ADDL_RX;
+  beacon.seq = frame_ms;
+  beacon.bitmap = TDMA_BEACON_BITMAP(slot_ms, tdma_slots);
+  beacon.args[0] = link_rate;
+
+  rs = e22ttl.sendBroadcastFixedMessage(E22_CONFIG_CHAN, (const void *)&beacon, CONTROL_FRAME_SIZE_B);
+  if(rs.code != E22_SUCCESS){
+    LOG_ERROR("E22 failed to send beacon: %s", rs.getResponseDescription());
+  }
+  tdma_next_beacon = millis() + frame_ms - beacon_ms; // so the next one ends frame_ms after this one
+  tdma_beacons++;
+  ulTaskNotifyTake(pdTRUE, 0); // our own AUX edge
 }
 
-void setupWiFi(){
-  DEBUG_PRINTLN("Starting WiFi with:");
-  DEBUG_PRINT("SSID: "); DEBUG_PRINT(wifi_ssid); DEBUG_PRINT(" PASS: "); DEBUG_PRINTLN(wifi_password);
- 
-  WiFi.begin(wifi_ssid, wifi_password);
+/**
+* A beacon on the boot rate whose args[0] is the rate the gateway is on. A
+* node that booted after the switch only hears the boot rate, it moves to the
+* one in the beacon and syncs on the next regular beacon. There is no
+* superframe in it for nodes that would not follow.
+*/
+void link_send_join(){
+  ControlFrame beacon;
+
+  memset((void *)&beacon, 0, CONTROL_FRAME_SIZE_B);
+  beacon.magic = CTRL_MAGIC;
+  beacon.type = CTRL_BEACON;
+  beacon.src = (E22_CONFIG_ADDH << 8) | E22_CONFIG_ADDL_RX;
+  beacon.args[0] = link_rate;
 
-  do{
-    DEBUG_PRINTLN("Could not connect to WiFi, trying again in 5s");
-    delay(5000);
-  }while(WiFi.status() != WL_CONNECTED);
- 
-  DEBUG_PRINTLN("WiFi Connected! ");
- 
+  link_join_at = millis();
+  if(!e22_write_rate(E22_AIR_RATE_BASE))
+    return;
+  rs = e22ttl.sendBroadcastFixedMessage(E22_CONFIG_CHAN, (const void *)&beacon, CONTROL_FRAME_SIZE_B);
+  if(rs.code != E22_SUCCESS){
+    LOG_ERROR("E22 failed to send join beacon: %s", rs.getResponseDescription());
+  }
+  e22_write_rate(link_rate);
+  ulTaskNotifyTake(pdTRUE, 0); // our own AUX edge
 }
 
-void setupMqtt(){
-  DEBUG_PRINTLN("Starting MQTT Client");
-  DEBUG_PRINT("BROKER: "); DEBUG_PRINT(mqtt_broker); DEBUG_PRINT(" PORT: "); DEBUG_PRINT(mqtt_port); DEBUG_PRINT(" TOPIC: "); DEBUG_PRINTLN(mqtt_topic);
+// ms the rx task may sleep before the next beacon is due
+long tdma_wait_ms(){
+  long left = (long)(tdma_next_beacon - millis());
+
+  if(!TDMA_ENABLED || left > RX_WAKE_TIMEOUT) return RX_WAKE_TIMEOUT;
+  return left > 0 ? left : 0;
+}
 
-  while(!mqttClient.connect(mqtt_broker, mqtt_port)){
-    DEBUG_PRINTLN("Could not connect to broker, trying again in 5s");
-    DEBUG_PRINTLN(mqttClient.connectError());
-    delay(5000);
+/**
+* Runs the packet through its sender's entry in the node table and acks it if
+* asked. Returns LINK_RX_DUPLICATE for a packet that was already passed on.
+*/
+uint8_t link_receive(Packet *packet, uint8_t rssi){
+  PacketData *pd = &packet->packetData;
+  NodeState *node = node_get(&nodes, pd->src, millis(), NODE_EXPIRE_MS);
+  LinkRxState *st;
+  uint32_t gaps, duplicates, recovered;
+  ControlFrame ack;
+  uint8_t result, rate;
+
+  if(node == NULL)
+    return LINK_RX_NEW; // table full, pass everything on, and no acks so it stays on the boot rate
+
+  st = &node->link;
+  node->last_seen = millis();
+  node_rssi_push(node, rssi);
+
+  gaps = st->gaps; duplicates = st->duplicates; recovered = st->recovered;
+  result = link_rx_accept(st, pd->count, pd->session, pd->flags);
+  rx_gaps += st->gaps - gaps;
+  rx_duplicates += st->duplicates - duplicates;
+  rx_recovered += st->recovered - recovered;
+
+  link_last_heard = millis();
+  if(result == LINK_RX_NEW) node->packets++;
+
+  // inside a burst the node is still sending, the ack for the last packet covers this one
+  if((pd->flags & LINK_FLAG_ACK_REQ) && !(pd->flags & LINK_FLAG_MORE)){
+    link_make_ack(st, &ack, (E22_CONFIG_ADDH << 8) | E22_CONFIG_ADDL_RX);
+    rate = link_adapt_packet(&node->adapt, pd, rssi, ((pd->flags & LINK_FLAG_RETX) ? 1 : 0) + (st->gaps - gaps), &ack);
+    if(TDMA_ENABLED) ack.args[LINK_ARG_SLOT] = LINK_ARG_SET | tdma_assign(node);
+
+    if(E22_WOR) e22ttl.setMode(MODE_0_NORMAL); // a WOR receiver can't send, the node waits for the ack awake
+    rs = e22ttl.sendFixedMessage(pd->src >> 8, pd->src & 0xFF, E22_CONFIG_CHAN, (const void *)&ack, CONTROL_FRAME_SIZE_B);
+    if(rs.code != E22_SUCCESS){
+      LOG_ERROR("E22 failed to send ack: %s", rs.getResponseDescription());
+    }
+    if(E22_WOR) e22ttl.setMode(E22_LISTEN_MODE);
+    e22_set_rate(rate);
+    ulTaskNotifyTake(pdTRUE, 0); // AUX also falls for our own transmission
   }
 
-  DEBUG_PRINTLN("Mqtt Broker connected! ");
+  return result;
 }
 
+// reads and throws away one frame when every slot is busy
+void discard_frame(){
+  uint8_t scratch[32];
+  size_t left = PACKET_SIZE_B + (E22_RSSI ? 1 : 0);
 
+  while(left){
+    size_t len = Serial2.readBytes(scratch, left < sizeof(scratch) ? left : sizeof(scratch));
+    if(!len) break;
+    left -= len;
+  }
+}
 
-uint8_t setupE22(){
-  Serial2.begin(9600, SERIAL_8N1, E22_RX_PIN, E22_TX_PIN);
-  e22ttl.begin(); // begin the e22
+uint8_t uplink_up(){ return uplink.state == UPLINK_UP; }
+
+/**
+* Publishes one MQTT message. Returns 0 without waiting on the network when
+* the uplink is down or busy reconnecting.
+*/
+uint8_t mqttPublishTopic(const char *topic, const uint8_t *payload, size_t length){
+  uint32_t started = metrics_cycles();
+  uint8_t ok = 0;
+
+  if(!uplink_up() || xSemaphoreTake(uplinkLock, pdMS_TO_TICKS(UPLINK_LOCK_WAIT)) != pdTRUE)
+    return 0;
+
+  if(uplink_up() && mqttClient.beginMessage(topic, (unsigned long)length)){
+    mqttClient.write(payload, length);
+    ok = mqttClient.endMessage();
+  }
+
+  xSemaphoreGive(uplinkLock);
+
+  if(ok){
+    hist_record(&lat_publish, metrics_cycles_us(started));
+    mqtt_published++;
+    mqtt_published_bytes += length;
+  }
+  return ok;
+}
+
+uint8_t mqttPublishBuffer(uint16_t src, const uint8_t *payload, size_t length){
+  char topic[MQTT_TOPIC_MAX_B];
+
+  snprintf(topic, sizeof(topic), "%s/%04X", agg_is_summary(payload, length) ? mqtt_summary_topic : mqtt_topic, src); // one topic per node
+  return mqttPublishTopic(topic, payload, length);
+}
+
+/**
+* Publishes the batch as one MQTT message on its node's topic and starts a
+* new one. While the uplink is down the batch goes to the store instead.
+*/
+void mqttPublishData(MqttBatch *batch){
+  PayloadWriter *writer = &batch->writer;
+  size_t length = payload_finish(writer);
+
+  batch->record[0] = batch->src & 0xFF; // the store keeps the node address in front of the payload
+  batch->record[1] = batch->src >> 8;
+
+  if(mqttPublishBuffer(batch->src, writer->buffer, length)){
+    hist_record(&lat_e2e, metrics_now_us() - batch->first_us);
+    LOG_DEBUG("MQTT published node: %u packets: %u bytes: %u", batch->src, writer->packets, length);
+  }
+  else if(store_ready && sf_append(&store, batch->record, STORE_PREFIX_B + length)){
+    LOG_WARN("Uplink down, stored batch, backlog: %u", sf_pending(&store));
+  }
+  else{
+    mqtt_lost++;
+    LOG_WARN("Uplink down and store failed, batch lost");
+  }
+
+  payload_reset(writer);
+}
+
+/**
+* Publishes the node's summary of the windows that are due, all of its open
+* ones with force. Stored like a batch while the uplink is down.
+*/
+void mqttPublishSummary(AggNode *node, uint8_t force){
+  size_t length = agg_write(&aggregator, node, millis(), force, &agg_writer);
+
+  if(!length)
+    return;
+
+  agg_record[0] = node->src & 0xFF;
+  agg_record[1] = node->src >> 8;
+
+  if(mqttPublishBuffer(node->src, agg_writer.buffer, length)){
+    LOG_DEBUG("MQTT published summary node: %u bytes: %u", node->src, length);
+  }
+  else if(store_ready && sf_append(&store, agg_record, STORE_PREFIX_B + length)){
+    LOG_WARN("Uplink down, stored summary, backlog: %u", sf_pending(&store));
+  }
+  else{
+    mqtt_lost++;
+    LOG_WARN("Uplink down and store failed, summary lost");
+  }
+}
+
+/**
+* Publishes the counters and stage histograms on mqtt_stats_topic. Only
+* live, a snapshot that misses the uplink is not stored.
+*/
+void metrics_publish(){
+  size_t length;
+  int n;
+
+  n = snprintf(stats_buffer, sizeof(stats_buffer),
+               "{\"uptime_ms\":%lu,\"packets\":%lu,\"bytes\":%lu,\"errors\":%lu,\"dropped\":%lu,\"gaps\":%lu,\"duplicates\":%lu,\"recovered\":%lu,"
+               "\"nodes\":%u,\"published\":%lu,\"published_bytes\":%lu,\"lost\":%lu,\"backlog\":%lu,\"heap_free\":%lu,\"heap_min\":%lu,"
+               "\"fragments\":%lu,\"reassembled\":%lu,\"reassembly_expired\":%lu,\"corrupt\":%lu,\"corrected\":%lu,\"corrected_bytes\":%lu,"
+               "\"summaries\":%lu,\"windows\":%lu,\"windows_early\":%lu,",
+               millis(), (unsigned long)rx_count, (unsigned long)rx_bytes, (unsigned long)rx_errors, (unsigned long)rx_dropped,
+               (unsigned long)rx_gaps, (unsigned long)rx_duplicates, (unsigned long)rx_recovered, nodes.count,
+               (unsigned long)mqtt_published, (unsigned long)mqtt_published_bytes, (unsigned long)mqtt_lost,
+               (unsigned long)(store_ready ? sf_pending(&store) : 0), (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+               (unsigned long)reassembler.fragments, (unsigned long)reassembler.completed, (unsigned long)reassembler.expired,
+               (unsigned long)rx_corrupt, (unsigned long)rx_corrected, (unsigned long)rx_corrected_bytes,
+               (unsigned long)aggregator.summaries, (unsigned long)aggregator.windows, (unsigned long)aggregator.early);
+  if(n < 0 || (size_t)n >= sizeof(stats_buffer)) return;
+  length = n;
+
+  for(uint8_t i = 0; i < STATS_HISTS; i++){
+    length = hist_format(stats_hists[i], stats_hist_names[i], stats_buffer, length, sizeof(stats_buffer) - 1); // room for the separator
+    if(!length){
+      LOG_WARN("Stats do not fit STATS_MAX_B");
+      return;
+    }
+    stats_buffer[length++] = i + 1 < STATS_HISTS ? ',' : '}';
+  }
+
+  if(!mqttPublishTopic(mqtt_stats_topic, (const uint8_t *)stats_buffer, length)){
+    LOG_WARN("Uplink down, stats skipped");
+  }
+}
+
+/**
+* Publishes up to STORE_DRAIN_BATCH stored batches, oldest first, and
+* persists the new read position once for the whole round.
+*/
+void store_drain(){
+  uint8_t sent = 0;
+  int32_t length;
+
+  while(sent < STORE_DRAIN_BATCH && !sf_empty(&store)){
+    length = sf_peek(&store, store_batch, sizeof(store_batch));
+
+    if(length < STORE_PREFIX_B){
+      LOG_WARN("Store record unreadable, skipping");
+      sf_skip(&store);
+      continue;
+    }
+    if(!mqttPublishBuffer(store_batch[0] | (store_batch[1] << 8), store_batch + STORE_PREFIX_B, length - STORE_PREFIX_B))
+      break;
+
+    sf_consume(&store);
+    sent++;
+  }
+
+  if(sent){
+    sf_commit(&store);
+    LOG_INFO("Drained stored batches: %u left: %u", sent, sf_pending(&store));
+  }
+}
+
+void uplink_enter(UplinkState state){
+  uplink.state = state;
+  uplink.since = millis();
+}
+
+// waits out an exponential backoff with jitter, so a gateway fleet does not reconnect in lockstep
+void uplink_fail(UplinkState resume){
+  unsigned long backoff = UPLINK_BACKOFF_MIN << (uplink.failures < 6 ? uplink.failures : 6);
+
+  if(backoff > UPLINK_BACKOFF_MAX) backoff = UPLINK_BACKOFF_MAX;
+  if(uplink.failures < 255) uplink.failures++;
+
+  uplink.backoff = backoff / 2 + random(backoff / 2 + 1);
+  uplink.resume = resume;
+  uplink_enter(UPLINK_BACKOFF);
+  LOG_INFO("Uplink retry in ms: %u", uplink.backoff);
+}
+
+/**
+* One step of the connection state machine, called with uplinkLock held.
+* Only the broker connect blocks, for at most MQTT_CONNECT_TIMEOUT.
+*/
+void uplink_step(){
+  unsigned long in_state = millis() - uplink.since;
+  uint8_t wifi_up = WiFi.status() == WL_CONNECTED;
+
+  switch(uplink.state){
+    case UPLINK_WIFI_START:
+      LOG_INFO("WiFi connecting to SSID: %s", wifi_ssid);
+      WiFi.disconnect();
+      WiFi.begin(wifi_ssid, wifi_password);
+      uplink_enter(UPLINK_WIFI_WAIT);
+      break;
+
+    case UPLINK_WIFI_WAIT:
+      if(wifi_up){
+        LOG_INFO("WiFi Connected!");
+        uplink_enter(UPLINK_MQTT_CONNECT);
+      }
+      else if(in_state >= WIFI_CONNECT_TIMEOUT){
+        LOG_WARN("Could not connect to WiFi");
+        uplink_fail(UPLINK_WIFI_START);
+      }
+      break;
+
+    case UPLINK_MQTT_CONNECT:
+      if(!wifi_up){
+        uplink_enter(UPLINK_WIFI_START);
+      }
+      else if(mqttClient.connect(mqtt_broker, mqtt_port)){
+        LOG_INFO("Mqtt Broker connected!");
+        uplink.failures = 0;
+        uplink.reconnects++;
+        uplink_enter(UPLINK_UP);
+      }
+      else{
+        LOG_WARN("Could not connect to broker, error: %d", mqttClient.connectError());
+        uplink_fail(UPLINK_MQTT_CONNECT);
+      }
+      break;
+
+    case UPLINK_BACKOFF:
+      if(in_state >= uplink.backoff)
+        uplink_enter(uplink.resume == UPLINK_MQTT_CONNECT && !wifi_up ? UPLINK_WIFI_START : uplink.resume);
+      break;
+
+    case UPLINK_UP:
+      mqttClient.poll(); // keepalive pings and their responses
+
+      if(!wifi_up || !mqttClient.connected()){
+        LOG_WARN("%s connection lost", wifi_up ? "Mqtt Broker" : "WiFi");
+        mqttClient.stop();
+        uplink_enter(wifi_up ? UPLINK_MQTT_CONNECT : UPLINK_WIFI_START);
+      }
+      break;
+  }
+}
+
+void uplink_task_code(void *params){
+  (void)params;
+  for(;;){
+    xSemaphoreTake(uplinkLock, portMAX_DELAY);
+    uplink_step();
+    xSemaphoreGive(uplinkLock);
+
+    vTaskDelay(pdMS_TO_TICKS(UPLINK_POLL_MS));
+  }
+}
+
+void setupStore(){
+  if(!LittleFS.begin(true) || !sf_open(&store, STORE_PATH, STORE_INDEX_PATH, STORE_CAPACITY_B)){
+    LOG_WARN("Store unavailable, batches will be lost during outages");
+    return;
+  }
+
+  store_ready = 1;
+  LOG_INFO("Store backlog: %u", sf_pending(&store));
+}
+
+// AUX goes low just before the E22 starts clocking a received frame out
+void IRAM_ATTR aux_isr(){
+  BaseType_t woken = pdFALSE;
+
+  aux_fall_us = metrics_now_us();
+  if(E22_UART_FAST) return; // uart_rx_event() wakes the task once the frame is in
+  vTaskNotifyGiveFromISR(rxTask, &woken);
+  if(woken) portYIELD_FROM_ISR();
+}
+
+// the UART driver's event task, the line has gone idle after a frame
+void uart_rx_event(){
+  xTaskNotifyGive(rxTask);
+}
+
+/**
+* Sleeps until the AUX interrupt says a frame is arriving, then reads it
+* straight into a free pool slot and passes the slot on. With E22_UART_FAST
+* the UART driver's rx timeout event wakes it instead, once the whole frame
+* is in its buffer, so the read is a single copy. Beacons go out between
+* frames, the timeout otherwise only catches a missed edge.
+*/
+void rx_task_code(void *params){
+  PacketSlot *slot = NULL;
+  int rssi;
+
+  (void)params;
+  for(;;){
+    // a beacon waits for a frame that is still arriving, the nodes' slots stay aligned to when it goes out
+    if(!Serial2.available() && digitalRead(E22_AUX) == HIGH && (!TDMA_ENABLED || !tdma_wait_ms())){
+      if(link_rate != E22_AIR_RATE_BASE && millis() - link_join_at >= LINK_JOIN_INTERVAL)
+        link_send_join(); // ahead of the superframe, the slots after it are the nodes'
+      if(TDMA_ENABLED)
+        tdma_send_beacon();
+    }
+
+    // always take the notification, a frame already in the UART must not leave a stale wake behind
+    if(!ulTaskNotifyTake(pdTRUE, Serial2.available() ? 0 : pdMS_TO_TICKS(tdma_wait_ms())) && !Serial2.available()){
+      if(link_rate != E22_AIR_RATE_BASE && millis() - link_last_heard > LINK_SILENCE_MS){
+        LOG_WARN("Nothing heard on the switched rate, back to the boot rate");
+        if(e22_set_rate(E22_AIR_RATE_BASE))
+          for(uint16_t i = 0; i < NODE_TABLE_SLOTS; i++)
+            if(nodes.slots[i].addr != NODE_ADDR_EMPTY)
+              link_adapt_reset(&nodes.slots[i].adapt, E22_POWER_BASE); // nodes fall back to full power with it
+      }
+      continue;
+    }
+
+    if(slot == NULL && xQueueReceive(freeQueue, &slot, pdMS_TO_TICKS(RX_SLOT_WAIT)) != pdTRUE){
+      slot = NULL;
+      rx_dropped++;
+      LOG_WARN("No free packet slot, dropping frame");
+      discard_frame();
+      continue;
+    }
+
+    rssi = receive_packet(&slot->packet);
+
+    if(rssi < 0){
+      rx_errors++;
+      LOG_ERROR("Failed to receive a packet");
+      continue; // keep the slot for the next frame
+    }
+    slot->arrived_us = aux_fall_us; // before the ack, which makes its own edge
+    slot->read_us = metrics_now_us();
+    hist_record(&lat_uart, slot->read_us - slot->arrived_us);
+    rx_bytes += PACKET_SIZE_B;
+
+    if(link_receive(&slot->packet, (uint8_t)rssi) == LINK_RX_DUPLICATE){
+      LOG_DEBUG("Duplicate packet: %u", slot->packet.packetData.count);
+      continue;
+    }
+
+    rx_count++;
+    slot->rssi = (uint8_t)rssi;
+    xQueueSend(readyQueue, &slot, 0); // can't be full, there are only RX_POOL_SLOTS slots
+    slot = NULL;
+  }
+}
+
+/**
+* Adds a fragment to its payload and publishes the payload on its node's
+* diagnostics topic once complete. Live only like the stats, a payload that
+* misses the uplink is not stored.
+*/
+void fragment_receive(PacketSlot *slot){
+  Reassembly *done = reasm_add(&reassembler, &slot->packet, millis());
+  char topic[MQTT_TOPIC_MAX_B];
+
+  if(done == NULL)
+    return;
+
+  LOG_DEBUG("Reassembled node: %u type: %u bytes: %u", done->src, done->type, done->total);
+  if(done->type != FRAGMENT_TYPE_DIAG){
+    LOG_WARN("Reassembled payload of unknown type: %u", done->type);
+    return;
+  }
+
+  snprintf(topic, sizeof(topic), "%s/%04X", mqtt_diag_topic, done->src);
+  if(!mqttPublishTopic(topic, done->data, done->total)){
+    LOG_WARN("Uplink down, diagnostics skipped");
+  }
+}
+
+// the open batch for src, or a free one, or the oldest after flushing it
+MqttBatch *mqtt_batch_for(uint16_t src){
+  MqttBatch *free_batch = NULL, *oldest = NULL;
 
-  rsc = e22ttl.getConfiguration(); // get the current config from the E22
-  config = (Configuration*)rsc.data; // extract the config data
+  for(uint8_t i = 0; i < MQTT_BATCH_WRITERS; i++){
+    MqttBatch *batch = &mqtt_batches[i];
+
+    if(!batch->writer.packets){
+      if(!free_batch) free_batch = batch;
+    }
+    else if(batch->src == src)
+      return batch;
+    else if(!oldest || batch->start - oldest->start >= 0x80000000UL)
+      oldest = batch;
+  }
+
+  if(!free_batch){
+    mqttPublishData(oldest);
+    free_batch = oldest;
+  }
+
+  free_batch->src = src;
+  return free_batch;
+}
 
+/**
+* Decodes filled slots in arrival order straight into their node's MQTT
+* batch and returns them to the pool. A batch goes out when the next packet
+* might not fit, after MQTT_BATCH_MAX_PACKETS, once its oldest packet has
+* waited MQTT_BATCH_MAX_MS, or when its writer is needed for another node.
+* Stored batches drain in between while the uplink is up, and the stats go
+* out every STATS_INTERVAL. Fragments go to their payload's reassembly
+* buffer instead of a batch. With AGG_MODE_SUMMARY the samples go into
+* their node's summary windows instead, or as well with AGG_MODE_BOTH.
+*/
+void publish_task_code(void *params){
+  PacketSlot *slot;
+  MqttBatch *batch;
+  unsigned long last_drain = 0, last_stats = millis();
+  long next;
+  uint8_t n;
+
+  (void)params;
+  for(uint8_t i = 0; i < MQTT_BATCH_WRITERS; i++)
+    payload_begin(&mqtt_batches[i].writer, mqtt_batches[i].record + STORE_PREFIX_B, MQTT_BATCH_MAX_B, MQTT_PAYLOAD_FORMAT, MESSAGE_FIELDS, message_scales);
+  payload_begin(&agg_writer, agg_record + STORE_PREFIX_B, AGG_SUMMARY_MAX_B, MQTT_PAYLOAD_FORMAT, MESSAGE_FIELDS, message_scales);
+  agg_init(&aggregator, MESSAGE_FIELDS, message_scales, agg_rules, sizeof(agg_rules) / sizeof(AggRule), AGG_WINDOW_MS);
+
+  for(;;){
+    TickType_t wait = portMAX_DELAY;
+
+    for(uint8_t i = 0; i < MQTT_BATCH_WRITERS; i++){
+      if(!mqtt_batches[i].writer.packets)
+        continue;
+
+      unsigned long waited = millis() - mqtt_batches[i].start;
+      TickType_t left = waited < MQTT_BATCH_MAX_MS ? pdMS_TO_TICKS(MQTT_BATCH_MAX_MS - waited) : 0;
+      if(left < wait) wait = left;
+    }
+    if(store_ready && !sf_empty(&store))
+      wait = wait < pdMS_TO_TICKS(STORE_DRAIN_INTERVAL) ? wait : pdMS_TO_TICKS(STORE_DRAIN_INTERVAL);
+    if(millis() - last_stats < (unsigned long)STATS_INTERVAL && pdMS_TO_TICKS(STATS_INTERVAL - (millis() - last_stats)) < wait)
+      wait = pdMS_TO_TICKS(STATS_INTERVAL - (millis() - last_stats));
+    if((next = agg_next_ms(&aggregator, millis())) >= 0 && pdMS_TO_TICKS(next) < wait)
+      wait = pdMS_TO_TICKS(next);
+
+    if(xQueueReceive(readyQueue, &slot, wait) == pdTRUE){
+      uint32_t started = metrics_cycles();
+
+      hist_record(&lat_queue, metrics_now_us() - slot->read_us);
+      if(slot->packet.packetData.schema == FRAGMENT_SCHEMA)
+        fragment_receive(slot);
+      else{
+        n = unpack_packet_fields(&slot->packet, rx_fields, MESSAGE_COUNT);
+        hist_record(&lat_decode, metrics_cycles_us(started));
+
+        if(n != slot->packet.packetData._msg_index){
+          rx_errors++;
+          LOG_ERROR("E22 received a packet that does not decode");
+        }
+        else{
+          LOG_DEBUG("GOT DATA");
+          packet_printer(&slot->packet);
+
+          if(AGG_MODE & AGG_MODE_RAW){
+            batch = mqtt_batch_for(slot->packet.packetData.src);
+            if(!payload_fits(&batch->writer, n))
+              mqttPublishData(batch);
+            if(!batch->writer.packets){
+              batch->start = millis();
+              batch->first_us = slot->arrived_us;
+            }
+
+            payload_append_packet(&batch->writer, slot->packet.packetData.count, slot->rssi, slot->packet.packetData.src, rx_fields, n);
+          }
+          if(AGG_MODE & AGG_MODE_SUMMARY){
+            if(!agg_add_packet(&aggregator, slot->packet.packetData.src, rx_fields, n, millis())){
+              mqttPublishSummary(agg_oldest(&aggregator), 1);
+              agg_add_packet(&aggregator, slot->packet.packetData.src, rx_fields, n, millis());
+            }
+          }
+        }
+      }
+
+      xQueueSend(freeQueue, &slot, 0);
+    }
+
+    for(uint8_t i = 0; i < MQTT_BATCH_WRITERS; i++){
+      batch = &mqtt_batches[i];
+      if(batch->writer.packets && (batch->writer.packets >= MQTT_BATCH_MAX_PACKETS || millis() - batch->start >= MQTT_BATCH_MAX_MS))
+        mqttPublishData(batch);
+    }
+    if(agg_next_ms(&aggregator, millis()) == 0){
+      for(uint8_t i = 0; i < AGG_NODES_MAX; i++)
+        mqttPublishSummary(&aggregator.nodes[i], 0);
+    }
+
+    if(store_ready && !sf_empty(&store) && uplink_up() && millis() - last_drain >= STORE_DRAIN_INTERVAL){
+      last_drain = millis();
+      store_drain();
+    }
+
+    if(millis() - last_stats >= (unsigned long)STATS_INTERVAL){
+      last_stats = millis();
+      reasm_expire(&reassembler, last_stats);
+      metrics_publish();
+    }
+  }
+}
+
+void setupTasks(){
+  node_table_init(&nodes);
+  freeQueue = xQueueCreate(RX_POOL_SLOTS, sizeof(PacketSlot *));
+  readyQueue = xQueueCreate(RX_POOL_SLOTS, sizeof(PacketSlot *));
+
+  for(int i = 0; i < RX_POOL_SLOTS; i++){
+    PacketSlot *slot = &rx_pool[i];
+    xQueueSend(freeQueue, &slot, 0);
+  }
+
+  xTaskCreatePinnedToCore(publish_task_code, "publish", PUBLISH_TASK_STACK_B, NULL, PUBLISH_TASK_PRIORITY, &publishTask, PUBLISH_TASK_CORE);
+  xTaskCreatePinnedToCore(rx_task_code, "rx", RX_TASK_STACK_B, NULL, RX_TASK_PRIORITY, &rxTask, RX_TASK_CORE);
+  attachInterrupt(digitalPinToInterrupt(E22_AUX), aux_isr, FALLING);
+  if(E22_UART_FAST){
+    Serial2.setRxTimeout(E22_UART_RX_TIMEOUT_SYMBOLS);
+    Serial2.onReceive(uart_rx_event, true); // only on the timeout, not every FIFO fill
+  }
+}
+
+/**
+* Starts the uplink task, WiFi and the broker connect in the background so a
+* missing network never holds up boot or radio reception.
+*/
+void setupUplink(){
+  LOG_INFO("SSID: %s PASS: %s", wifi_ssid, wifi_password);
+  LOG_INFO("BROKER: %s PORT: %u TOPIC: %s", mqtt_broker, mqtt_port, mqtt_topic);
+
+  WiFi.setAutoReconnect(false); // the state machine owns reconnects
+  mqttClient.setConnectionTimeout(MQTT_CONNECT_TIMEOUT);
+  mqttClient.setKeepAliveInterval(MQTT_KEEPALIVE);
+
+  uplinkLock = xSemaphoreCreateMutex();
+  uplink_enter(UPLINK_WIFI_START);
+  xTaskCreatePinnedToCore(uplink_task_code, "uplink", UPLINK_TASK_STACK_B, NULL, UPLINK_TASK_PRIORITY, &uplinkTask, UPLINK_TASK_CORE);
+}
+
+// what the sketch needs from the module, set on top of the config read from it
+void e22_desired_config(Configuration *config){
   config->ADDH = E22_CONFIG_ADDH;
 #ifdef TRANSMITTER
   config->ADDL = E22_CONFIG_ADDL_TX; // transmitter
@@ -221,13 +1036,13 @@ uint8_t setupE22(){
   config->NETID = E22_CONFIG_NETID;
   config->CHAN = E22_CONFIG_CHAN;
 
-  config->SPED.uartBaudRate = UART_BPS_9600;
-  config->SPED.airDataRate = AIR_DATA_RATE_010_24;
+  config->SPED.uartBaudRate = E22_UART_BPS_TYPE;
+  config->SPED.airDataRate = E22_AIR_RATE_BASE;
   config->SPED.uartParity = MODE_00_8N1;
 
   config->OPTION.subPacketSetting = SPS_240_00;
   config->OPTION.RSSIAmbientNoise = RSSI_AMBIENT_NOISE_DISABLED;
-  config->OPTION.transmissionPower = POWER_22;
+  config->OPTION.transmissionPower = E22_POWER_BASE;
 
   config->TRANSMISSION_MODE.enableRSSI = RSSI_ENABLED;
   config->TRANSMISSION_MODE.fixedTransmission = FT_FIXED_TRANSMISSION;
@@ -241,52 +1056,20 @@ uint8_t setupE22(){
   config->TRANSMISSION_MODE.WORTransceiverControl = WOR_RECEIVER;
 #endif
   
-  config->TRANSMISSION_MODE.WORPeriod = WOR_2000_011;
-
-  e22ttl.setConfiguration(*config, WRITE_CFG_PWR_DWN_SAVE);
-
-  DEBUG_PRINTLN(rsc.status.getResponseDescription());
-  DEBUG_PRINTLN(rsc.status.code);
+  config->TRANSMISSION_MODE.WORPeriod = E22_WOR_PERIOD;
+}
 
-  // read the config we just wrote
-  rsc = e22ttl.getConfiguration(); // get the current config from the E22
-  config = (Configuration*)rsc.data; // extract the config data
+uint8_t setupE22(){
+  uint8_t synced;
 
-  DEBUG_PRINTLN("Re read the config from device");
-  DEBUG_PRINTLN(rsc.status.getResponseDescription());
-  DEBUG_PRINTLN(rsc.status.code);
-  
-  DEBUG_PRINTLN("----------------------------------------");
-
-  DEBUG_PRINT(F("HEAD : "));  DEBUG_PRINT(config->COMMAND, HEX);DEBUG_PRINT(" ");DEBUG_PRINT(config->STARTING_ADDRESS, HEX);DEBUG_PRINT(" ");DEBUG_PRINTLN(config->LENGHT, HEX);
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("AddH : "));  DEBUG_PRINTLN(config->ADDH, HEX);
-  DEBUG_PRINT(F("AddL : "));  DEBUG_PRINTLN(config->ADDL, HEX);
-  DEBUG_PRINT(F("NetID : "));  DEBUG_PRINTLN(config->NETID, HEX);
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("Chan : "));  DEBUG_PRINT(config->CHAN, DEC); DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->getChannelDescription());
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("SpeedParityBit     : "));  DEBUG_PRINT(config->SPED.uartParity, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->SPED.getUARTParityDescription());
-  DEBUG_PRINT(F("SpeedUARTDatte     : "));  DEBUG_PRINT(config->SPED.uartBaudRate, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->SPED.getUARTBaudRateDescription());
-  DEBUG_PRINT(F("SpeedAirDataRate   : "));  DEBUG_PRINT(config->SPED.airDataRate, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->SPED.getAirDataRateDescription());
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("OptionSubPacketSett: "));  DEBUG_PRINT(config->OPTION.subPacketSetting, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->OPTION.getSubPacketSetting());
-  DEBUG_PRINT(F("OptionTranPower    : "));  DEBUG_PRINT(config->OPTION.transmissionPower, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->OPTION.getTransmissionPowerDescription());
-  DEBUG_PRINT(F("OptionRSSIAmbientNo: "));  DEBUG_PRINT(config->OPTION.RSSIAmbientNoise, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->OPTION.getRSSIAmbientNoiseEnable());
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("TransModeWORPeriod : "));  DEBUG_PRINT(config->TRANSMISSION_MODE.WORPeriod, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getWORPeriodByParamsDescription());
-  DEBUG_PRINT(F("TransModeTransContr: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.WORTransceiverControl, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getWORTransceiverControlDescription());
-  DEBUG_PRINT(F("TransModeEnableLBT : "));  DEBUG_PRINT(config->TRANSMISSION_MODE.enableLBT, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getLBTEnableByteDescription());
-  DEBUG_PRINT(F("TransModeEnableRSSI: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.enableRSSI, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getRSSIEnableByteDescription());
-  DEBUG_PRINT(F("TransModeEnabRepeat: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.enableRepeater, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getRepeaterModeEnableByteDescription());
-  DEBUG_PRINT(F("TransModeFixedTrans: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.fixedTransmission, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getFixedTransmissionDescription());
-
-  DEBUG_PRINTLN("----------------------------------------");
-
-  rsc.close();
-
-  return rsc.status.code != 1?0:1;
+  Serial2.setRxBufferSize(RX_UART_BUFFER_B);
+  Serial2.setTxBufferSize(E22_UART_TX_BUFFER_B);
+  Serial2.begin(E22_UART_CONFIG_BPS, SERIAL_8N1, E22_RX_PIN, E22_TX_PIN);
+  e22ttl.begin(); // begin the e22
 
+  synced = e22_config_sync(&e22ttl, &Serial2, e22_desired_config, &e22_config);
+  if(E22_WOR) e22ttl.setMode(E22_LISTEN_MODE);
+  return synced;
 }
 
 #endif
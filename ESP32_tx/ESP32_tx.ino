@@ -4,26 +4,34 @@
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);
+#if TX_DEEP_SLEEP
+  sleep_cycle(); // samples, sends once the packet is full and deep sleeps, the next wake boots into setup() again
+#endif
   while(!Serial) { }; // wait for serial monitor to connect
+  setupLog();
 
-  DEBUG_PRINTLN("Started Serial & debug");
+  LOG_INFO("Started Serial & debug");
 
-  DEBUG_PRINTLN("Trying E22 setup");
+  LOG_INFO("Trying E22 setup");
   setupE22();
 
-  DEBUG_PRINT("Packet Msgs: "); DEBUG_PRINT(PACKET_MSG_SIZE_B); DEBUG_PRINT(" Message: "); DEBUG_PRINT(MESSAGE_SIZE_B); DEBUG_PRINT(" PackData: "); DEBUG_PRINTLN(PACKETDATA_SIZE_B);
-  DEBUG_PRINT("Msg Count: "); DEBUG_PRINT(MESSAGE_COUNT); DEBUG_PRINT(" Padd: "); DEBUG_PRINTLN(PADD_SIZE_B);
-  DEBUG_PRINT("Packet: "); DEBUG_PRINTLN(sizeof(Packet));
-  DEBUG_PRINT("TX INT: "); DEBUG_PRINT(TX_INTERVAL); DEBUG_PRINT(" Sensor Int: "); DEBUG_PRINTLN(SENSOR_INTERVAL);
+  LOG_INFO("Packet Payload: %u Message: %u PackData: %u", PACKET_PAYLOAD_SIZE_B, MESSAGE_SIZE_B, PACKETDATA_SIZE_B);
+  LOG_INFO("Msg Count: %u Raw: %u Codec: %u", MESSAGE_COUNT, RAW_MESSAGE_COUNT, MESSAGE_CODEC);
+  LOG_INFO("Packet: %u", sizeof(Packet));
+  LOG_INFO("TX INT: %u Sensor Int: %u", TX_INTERVAL, SENSOR_INTERVAL);
+
+  LOG_INFO("Starting sensor and tx tasks");
+  setupTasks();
 
 }
 
 void loop() {
-  if(!sensor_task_code()){
-    tx_task_code();
-    DEBUG_PRINTLN("I am not stuck");
-  }
-  DEBUG_PRINT("Delaying: "); DEBUG_PRINTLN(SENSOR_INTERVAL);
-  vTaskDelay(SENSOR_INTERVAL);
+  // sampling and tx run in their own tasks, this one only reports on them
+  LOG_INFO("Packets: %u Dropped samples: %u Acked: %u Retransmits: %u Given up: %u", tx_count, sample_overruns, arq_acked, arq_retransmits, arq_given_up);
+  LOG_INFO("Rate: %u Power: %u Switches: %u Bytes: %u Heap min: %u", link_rate, link_power, link_switches, tx_bytes, ESP.getMinFreeHeap());
+  print_hist("Fill", &lat_fill); print_hist("Queue", &lat_queue); print_hist("Send", &lat_send); print_hist("Ack", &lat_ack);
+  LOG_INFO("Fragments: %u Bursts: %u", tx_fragments, tx_bursts);
+  diag_poll();
+  vTaskDelay(TX_INTERVAL);
 }
 
@@ -1,14 +1,23 @@
 #ifndef HELPER_H
 #define HELPER_H
 
-#define LoRa_E22_DEBUG
 #define INCLUDE_eTaskGetState
 
 #include <Arduino.h>
-#include <DHT.h>
+#include <Dht22.h>
+#include <Log.h>
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+  #define LoRa_E22_DEBUG // the library prints straight to Serial
+#endif
 #include <LoRa_E22.h>
 
 #include <creds.h>
+#include <MessageCodec.h>
+#include <PacketSchema.h>
+#include <E22Config.h>
+#include <LinkLayer.h>
+#include <Fragment.h>
+#include <Metrics.h>
 #include <WiFi.h>
 #include <ArduinoMqttClient.h>
 
@@ -17,7 +26,6 @@
   #define TRANSMITTER
 #endif
 
-#define MAX_PACKET_SIZE_B 239
 
 #define E22_AUX 18 
 #define E22_M0 21
@@ -26,45 +34,70 @@
 #define E22_RX_PIN 16
 
 #define E22_RSSI true
+#define E22_BUFFER_B 1000 // the module takes this much from the UART while it is still sending
+const long E22_IDLE_TIMEOUT = 5000; // ms to wait for the module to finish sending before writing anyway
 
 #define E22_DEST_ADDH 0x00
 #define E22_DEST_ADDL 0x03
 
 #define E22_CONFIG_ADDH 0x00
-#define E22_CONFIG_ADDL_TX 0x02 // if we are tx
+#ifndef E22_CONFIG_ADDL_TX
+  #define E22_CONFIG_ADDL_TX 0x02 // if we are tx, give every node its own with -DE22_CONFIG_ADDL_TX=
+#endif
 #define E22_CONFIG_ADDL_RX E22_DEST_ADDL // if we are rx
 #define E22_CONFIG_NETID 0x00
 #define E22_CONFIG_CHAN 0x04
+#define E22_AIR_RATE_BASE AIR_DATA_RATE_010_24 // boot rate, and the fallback when an adaptive switch is lost
+#define E22_POWER_BASE POWER_22
+
+#ifndef E22_WOR
+  #define E22_WOR 0 // 1: the gateway listens duty cycled as a WOR receiver, every packet gets the WOR preamble
+#endif
+#define E22_WOR_PERIOD WOR_2000_011
+#define E22_WOR_PREAMBLE_MS ((E22_WOR_PERIOD + 1) * 500) // in front of every packet sent in WOR mode
+#define E22_SEND_MODE (E22_WOR ? MODE_1_WOR_TRANSMITTER : MODE_0_NORMAL) // both receive the acks
+
+#ifndef TX_DEEP_SLEEP
+  #define TX_DEEP_SLEEP 0 // 1: no tasks, the node deep sleeps between samples, see sleep_cycle()
+#endif
+#define RTC_STATE_MAGIC 0xE22D5EE9
+
+#ifndef SENSOR_DHT
+  #define SENSOR_DHT 1 // 0 sends made up readings, for a bench without a sensor
+#endif
+#define DHT_PIN 4
+#define DHT_RMT_CHANNEL RMT_CHANNEL_0
 
-typedef struct _Message{
-	float temperature;
-	float humidity;
-	//uint8_t whatever;
-}Message;
-
-typedef struct _packet_data{
-	uint32_t count;
-	uint8_t _msg_index;
-}PacketData;
-
-#define MAX_PACKET_SIZE_B 235
-#define MESSAGE_SIZE_B sizeof(Message)
-#define PACKETDATA_SIZE_B sizeof(PacketData)
-#define MESSAGE_COUNT ((MAX_PACKET_SIZE_B - PACKETDATA_SIZE_B) / MESSAGE_SIZE_B) // (240 - 8) / 8 = 19 messages // ceil so that we always round down and don't try and store data we can't send
-#define PACKET_MSG_SIZE_B (MESSAGE_SIZE_B * (MESSAGE_COUNT))
-#define PADD_SIZE_B (MAX_PACKET_SIZE_B - PACKET_MSG_SIZE_B - PACKETDATA_SIZE_B)
-
-typedef struct _Packet{
-	PacketData packetData;
-	Message messages[MESSAGE_COUNT];
-	uint8_t padding[PADD_SIZE_B];
-}Packet;
-
-#define PACKET_SIZE_B sizeof(Packet)
 #define BUFFER_SIZE PACKET_SIZE_B * 10
 
-const long TX_INTERVAL = 1000 * 30; // 1000 ms * 60s * 2m = 2m in ms 
-const long SENSOR_INTERVAL = TX_INTERVAL / MESSAGE_COUNT; 
+#ifndef ARQ_RELIABLE
+  #define ARQ_RELIABLE 1 // 0 sends fire and forget
+#endif
+#define ARQ_WINDOW LINK_SEND_WINDOW // sequence numbers from the oldest unacked packet to the next one sent
+#define ARQ_MAX_TRIES 4 // sends per packet before giving up on it
+const long ARQ_ACK_SLACK = 2000; // ms on top of the packet and ack airtime, both UARTs and the receiver's turnaround
+const long ARQ_NACK_HOLDOFF = 1000; // ms, a NACK does not resend a packet sent more recently than this
+#define LINK_FALLBACK_TIMEOUTS 2 // ack timeouts in a row before going back to the boot rate and power
+
+#ifndef TDMA_ENABLED
+  #define TDMA_ENABLED 1 // 0 ignores beacons and sends as soon as a packet is ready
+#endif
+const long TDMA_LISTEN_MS = TDMA_FRAME_MIN_MS * 2; // after boot, wait this long for a beacon before sending unscheduled
+
+#define PACKET_BUFFERS (2 + ARQ_WINDOW) // one being filled, one queued, the rest awaiting acks
+#define FRAGMENT_SPARE_PACKETS 2 // fragments only take a buffer while the sampler has this many free
+const long FRAGMENT_POLL_MS = 200; // waiting for a buffer
+const long DIAG_INTERVAL = 1000L * 60 * 5; // diagnostics sent to the gateway
+#define DIAG_MAX_B (320 + 4 * METRICS_HIST_MAX_B) // counters plus the four histograms
+
+static_assert(ARQ_WINDOW * (3 + PACKET_SIZE_B) <= E22_BUFFER_B, "a burst has to fit the module's buffer");
+static_assert(DIAG_MAX_B <= FRAGMENT_MAX_B, "diagnostics do not fit a fragmented payload");
+static_assert(!SENSOR_DHT || SENSOR_INTERVAL > DHT_MIN_INTERVAL_MS, "samples would repeat the DHT22's last reading");
+#define TASK_STACK_B 4096
+#define SENSOR_TASK_CORE 1
+#define SENSOR_TASK_PRIORITY 2
+#define TX_TASK_CORE 0
+#define TX_TASK_PRIORITY 1
 
 const char mqtt_broker[] = "test.mosquitto.org";
 int        mqtt_port     = 1883;
@@ -74,80 +107,225 @@ const char mqtt_topic[]  = "EPIC_E22/Rx_Packet";
 WiFiClient wifiClient;
 MqttClient mqttClient(wifiClient);
 
+TaskHandle_t  sensorTask = NULL, txTask = NULL;
+QueueHandle_t txQueue = NULL, freeQueue = NULL; // full packets to the radio task, sent packets back to the sampler
+
 LoRa_E22 e22ttl(&Serial2, E22_AUX, E22_M0, E22_M1, UART_BPS_RATE_9600 );
 
 ResponseStructContainer rsc;
 ResponseContainer rc;
-Configuration *config;
 ResponseStatus rs;
+Configuration e22_config; // last config written, link switches change it without reading the module back
+
+typedef struct _arq_entry{
+  Packet *packet;
+  unsigned long sent_at;
+  unsigned long timeout;
+  unsigned long base; // timeout of the first send, retries back off from it
+  uint8_t tries;
+}ArqEntry;
 
 Packet rx_packet;
-Packet tx_packet;
-Message new_message;
+Packet tx_packets[PACKET_BUFFERS];
+uint32_t tx_captured_us[PACKET_BUFFERS]; // first sample of each buffer, metrics_now_us()
+uint32_t tx_ready_us[PACKET_BUFFERS]; // handed to the tx task
+ArqEntry arq_window[ARQ_WINDOW];
+uint8_t arq_inflight = 0;
+uint32_t arq_next_seq = 0; // count of the next packet to go out
+uint8_t tx_session = 0;
+uint32_t tx_count = 0;
+uint32_t sample_overruns = 0;
+uint32_t tx_bytes = 0; // on air, retransmissions included
+uint32_t tx_fragments = 0;
+uint32_t tx_bursts = 0; // packets written while the one before was still on air
+uint8_t e22_burst = 0; // the last frame written has LINK_FLAG_MORE, the next one does not wait for it
+unsigned long e22_air_end = 0; // when the module is done with everything written to it, estimated
+Fragmenter tx_fragmenter;
+char diag_buffer[DIAG_MAX_B];
+LatencyHist lat_fill; // first sample to the packet handed over
+LatencyHist lat_queue; // handed over to its first send, slot waits included
+LatencyHist lat_send; // send_packet, waiting for the module and the UART; the airtime overlaps the next send in a burst
+LatencyHist lat_ack; // first send to its ack, packets that needed a retransmission are left out
+uint32_t arq_acked = 0;
+uint32_t arq_retransmits = 0;
+uint32_t arq_given_up = 0;
+uint8_t link_rate = E22_AIR_RATE_BASE;
+uint8_t link_power = E22_POWER_BASE;
+uint8_t link_timeouts = 0; // ack timeouts since the last control frame
+uint32_t link_switches = 0;
+
+// schedule from the last beacon heard, see LinkLayer.h
+typedef struct _tdma_sync{
+  uint8_t synced;
+  unsigned long t0; // end of the beacon on air, local clock
+  uint32_t frame_ms;
+  uint16_t slot_ms;
+  uint8_t slots;
+  uint8_t slot; // ours, TDMA_JOIN_SLOT until the gateway hands one out
+  unsigned long next_tx; // start of the next slot we may send in
+}TdmaSync;
+
+TdmaSync tdma = { 0, 0, 0, 0, 0, TDMA_JOIN_SLOT, 0 };
+uint32_t tdma_beacons = 0;
+volatile unsigned long aux_fall_ms = 0; // last AUX falling edge, a received frame starts coming out of the module
+Message rx_messages[MESSAGE_COUNT];
+CodecState tx_codec_state;
 char buffer[BUFFER_SIZE];
+Dht dht;
+
+// what a deep sleeping node keeps between wakes, RTC slow memory survives deep sleep but not a power loss
+typedef struct _rtc_state{
+  uint32_t magic; // RTC_STATE_MAGIC once set up, anything after a power on
+  Packet packet; // being filled
+  CodecState codec;
+  uint8_t e22_config[sizeof(Configuration)]; // as bytes, a Configuration member would get constructed again at every boot
+  uint32_t tx_count;
+  uint32_t tx_bytes;
+  uint32_t acked;
+  uint32_t retransmits;
+  uint32_t given_up;
+  uint32_t wakes;
+  uint32_t awake_ms;
+  uint8_t session;
+  uint8_t link_rate;
+  uint8_t link_power;
+  uint32_t dht_reads;
+  uint32_t dht_errors;
+}RtcState;
+
+RTC_DATA_ATTR RtcState rtc_state;
 
 
 void buffer_dump(uint8_t *buffer, uint8_t length){
-  DEBUG_PRINTLN("---- dump ----");
-  for(int i = 0; i < length; i++){
-    if(!(i%8))
-      DEBUG_PRINTLN(" ");
-      
-    DEBUG_PRINT(buffer[i], HEX); 
-    DEBUG_PRINT(" , ");
-    
+  char row[8 * 3 + 1];
+
+  LOG_DEBUG("---- dump ----");
+  for(int i = 0; i < length; i += 8){
+    for(int j = 0; j < 8 && i + j < length; j++)
+      sprintf(row + j * 3, "%02X ", buffer[i + j]);
+    LOG_DEBUG("%s", row);
   }
-  DEBUG_PRINTLN(" ");
 }
 
 /**
 *
 */
 void packet_printer(Packet packet){
-  DEBUG_PRINTLN("---- Message printer ----");
+  LOG_DEBUG("---- Message printer ----");
   /*for(int i = 0; i < length; i++){
-    DEBUG_PRINT(i); DEBUG_PRINT(" C: "); DEBUG_PRINT(msgs[i].count); DEBUG_PRINT(" T: "); DEBUG_PRINTLN(msgs[i].temperature);
+    LOG_DEBUG("%u C: %u T: %.1f", i, msgs[i].count, msgs[i].temperature);
   }
-  DEBUG_PRINTLN(" ");*/
+  LOG_DEBUG(" ");*/
 }
 
-void append_packet_message(Packet *packet, Message msg){
-  memcpy((void *)&packet->messages[packet->packetData._msg_index], (const void*) &msg, MESSAGE_SIZE_B);
-  packet->packetData._msg_index++;
-  
+// AUX is high once the module has sent everything written to it
+void e22_wait_idle(){
+  unsigned long start = millis();
+
+  Serial2.flush(); // what is still in the driver's tx buffer reaches the module first
+  while(digitalRead(E22_AUX) == LOW && millis() - start < (unsigned long)E22_IDLE_TIMEOUT)
+    vTaskDelay(pdMS_TO_TICKS(5));
 }
 
-uint8_t packet_full(Packet packet){ return packet.packetData._msg_index >= MESSAGE_COUNT; }
+/**
+* Fixed transmission written straight to the UART: address, channel and the
+* frame in one go. Unlike sendFixedMessage() it returns once the bytes are
+* out of the UART rather than off the air, the module sends from its buffer.
+*/
+uint8_t e22_write_fixed(uint8_t addh, uint8_t addl, uint8_t chan, const void *data, uint8_t size){
+  uint8_t frame[3 + PACKET_SIZE_B];
 
-void clear_packet_messages(Packet *packet){
-  memset((void *)&packet->messages, 0, PACKET_MSG_SIZE_B );
-  packet->packetData._msg_index = 0;
+  if(size > PACKET_SIZE_B)
+    return 0;
+
+  frame[0] = addh;
+  frame[1] = addl;
+  frame[2] = chan;
+  memcpy(frame + 3, data, size);
+  return Serial2.write(frame, 3 + size) == (size_t)(3 + size);
 }
 
-void send_packet(Packet *packet){
-  DEBUG_PRINT("tx'ing to: "); DEBUG_PRINTLN(E22_CONFIG_ADDL_RX);
-  rs = e22ttl.sendFixedMessage(E22_DEST_ADDH, E22_CONFIG_ADDL_RX, E22_CONFIG_CHAN, (const void*)packet, PACKET_SIZE_B);
-  
+/**
+* Switches air rate and power with a temporary config write, the module goes
+* back to what is in its flash on power loss.
+*/
+uint8_t e22_set_link(uint8_t rate, uint8_t power){
+  if(rate == link_rate && power == link_power)
+    return 1;
+
+  e22_wait_idle(); // a mode switch would cut off what the module is still sending
+  e22_config.SPED.airDataRate = rate;
+  e22_config.OPTION.transmissionPower = power;
+  e22_uart_config(&Serial2);
+  rs = e22ttl.setConfiguration(e22_config, WRITE_CFG_PWR_DWN_LOSE);
+  e22_uart_data(&Serial2, &e22_config);
+
   if(rs.code != E22_SUCCESS){
-    DEBUG_PRINTLN("E22 failed to send message");
-    DEBUG_PRINTLN(rs.getResponseDescription());
+    LOG_ERROR("E22 failed to switch link: %s", rs.getResponseDescription());
+    e22_config.SPED.airDataRate = link_rate;
+    e22_config.OPTION.transmissionPower = link_power;
+    return 0;
+  }
+
+  LOG_INFO("Link now rate: %u power: %u", rate, power);
+  link_rate = rate;
+  link_power = power;
+  link_switches++;
+  return 1;
+}
+
+/**
+* Writes the packet to the module. Inside a burst it goes in behind the one
+* still on air, otherwise it waits for the module to finish first so an ack
+* can come back in between.
+*/
+void send_packet(Packet *packet){
+  uint32_t started = metrics_cycles();
+  unsigned long now;
+
+  LOG_DEBUG("tx'ing to: %u", E22_CONFIG_ADDL_RX);
+  packet->packetData.flags = (packet->packetData.flags & (LINK_FLAG_ACK_REQ | LINK_FLAG_RETX | LINK_FLAG_MORE)) | LINK_FLAGS_LINK(link_rate, link_power);
+  packet_seal(packet);
+
+  if(e22_burst)
+    tx_bursts++;
+  else
+    e22_wait_idle();
+
+  if(!e22_write_fixed(E22_DEST_ADDH, E22_CONFIG_ADDL_RX, E22_CONFIG_CHAN, (const void*)packet, PACKET_SIZE_B)){
+    LOG_ERROR("E22 failed to send message");
+    e22_burst = 0;
     return;
   }
+  hist_record(&lat_send, metrics_cycles_us(started));
+  tx_bytes += PACKET_SIZE_B;
+  e22_burst = (packet->packetData.flags & LINK_FLAG_MORE) ? 1 : 0;
 
-  DEBUG_PRINTLN("All data sent correctly");
-  
+  now = millis();
+  e22_air_end = ((long)(e22_air_end - now) > 0 ? e22_air_end : now) + link_airtime_ms(PACKET_SIZE_B + TDMA_FRAME_OVERHEAD_B, link_rate)
+              + (E22_WOR ? E22_WOR_PREAMBLE_MS : 0);
+
+  LOG_DEBUG("All data sent correctly");
 }
 
 int receive_packet(Packet *packet){
   rsc = e22ttl.receiveMessageComplete(PACKET_SIZE_B, true);
   
   if(rsc.status.code != E22_SUCCESS){
-    DEBUG_PRINTLN("E22 failed to receive message");
-    DEBUG_PRINTLN(rsc.status.getResponseDescription());
+    LOG_ERROR("E22 failed to receive message: %s", rsc.status.getResponseDescription());
     return -1;
   }
 
-  memcpy((void *)packet, (const void *)&rsc.data, PACKET_SIZE_B);
+  memcpy((void *)packet, (const void *)rsc.data, PACKET_SIZE_B);
+
+  if(packet_check(packet) < 0){
+    LOG_ERROR("E22 received a corrupt packet");
+    return -1;
+  }
+  if(unpack_packet_messages(packet, rx_messages, MESSAGE_COUNT) != packet->packetData._msg_index){
+    LOG_ERROR("E22 received a packet that does not decode");
+    return -1;
+  }
 
   return rsc.rssi;
 }
@@ -158,81 +336,528 @@ void mqttPublishData(Packet *packet, uint8_t rssi){
   sprintf((char *)&buffer, "Packet Count: %ld , RSSI: %d\n", packet->packetData.count, rssi);
 
   for(int i = 0; i < packet->packetData._msg_index; i++)
-    sprintf((char *)&buffer, "  c: %d, T: %f \n", i, packet->messages[i].temperature);
+    sprintf((char *)&buffer, "  c: %d, T: %f \n", i, rx_messages[i].temperature);
 
   mqttClient.beginMessage(mqtt_topic);
   mqttClient.print(buffer);
   mqttClient.endMessage();
 
-  DEBUG_PRINTLN("MQTT Data Publishers: ")
-  DEBUG_PRINT(buffer);
+  LOG_DEBUG("MQTT Data Publishers: %s", buffer);
 
 }
 
-uint8_t sensor_task_code(){
+/**
+* The sensor's reading into msg, without waiting on the sensor: the read the
+* previous call started. Returns 0 when no new reading came in, a failed read
+* leaves a gap in the packet rather than a repeat of the last one.
+*/
+uint8_t sensor_read(Message *msg){
+#if SENSOR_DHT
+  uint32_t reads = dht.reads, errors = dht.errors;
 
-  if(packet_full(tx_packet)){
-    DEBUG_PRINTLN("Messages are maxed out");
+  dht_poll(&dht);
+  if(dht.reads == reads){
+    if(dht.errors != errors) LOG_WARN("DHT read failed, sample skipped: %u", dht.status);
     return 0;
   }
-  
-  new_message.temperature = (float)random(0, 40);
-  new_message.humidity = (float)random(0, 100);
-  DEBUG_PRINT("T: "); DEBUG_PRINT(new_message.temperature); DEBUG_PRINT("H: "); DEBUG_PRINTLN(new_message.humidity);
-  
-  DEBUG_PRINTLN("Appending packet")
-  append_packet_message(&tx_packet, new_message);
+  msg->temperature = dht.reading.temperature / 10.0f;
+  msg->humidity = dht.reading.humidity / 10.0f;
+#else
+  msg->temperature = (float)random(0, 40);
+  msg->humidity = (float)random(0, 100);
+#endif
+  return 1;
+}
+
+/**
+* Sampling side of the pipeline. Runs every SENSOR_INTERVAL off the tick count
+* so the cadence does not depend on how long the radio takes, and hands full
+* packets to the radio task without ever blocking on it.
+*/
+void sensor_task_code(void *params){
+  TickType_t last_wake = xTaskGetTickCount();
+  Packet *packet = NULL;
+  Message new_message;
+  uint8_t behind = 0; // drops in a row, warned at the first and every 256th
+
+  (void)params;
+  for(;;){
+    vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(SENSOR_INTERVAL));
+
+    if(packet == NULL){
+      if(xQueueReceive(freeQueue, &packet, 0) != pdTRUE){
+        sample_overruns++;
+        if(!behind++) LOG_WARN("No free packet, radio is behind, dropping samples: %u", sample_overruns);
+        continue;
+      }
+      behind = 0;
+      clear_packet_messages(packet, &tx_codec_state);
+      tx_captured_us[packet - tx_packets] = metrics_now_us();
+    }
+
+    if(!sensor_read(&new_message))
+      continue;
+    LOG_DEBUG("T: %.1f H: %.1f", new_message.temperature, new_message.humidity);
+
+    append_packet_message(packet, &tx_codec_state, new_message);
+
+    if(packet_full(packet)){
+      LOG_DEBUG("Messages are maxed out, handing packet to radio");
+      packet->packetData.flags = ARQ_RELIABLE ? LINK_FLAG_ACK_REQ : 0;
+      tx_ready_us[packet - tx_packets] = metrics_now_us();
+      hist_record(&lat_fill, tx_ready_us[packet - tx_packets] - tx_captured_us[packet - tx_packets]);
+      xQueueSend(txQueue, &packet, 0); // can't be full, there are only PACKET_BUFFERS packets
+      xTaskNotifyGive(txTask);
+      packet = NULL;
+    }
+  }
+}
+
+// whether next_tx lies in the superframe of the last beacon heard
+uint8_t tdma_slot_heard(){
+  return tdma.next_tx - tdma.t0 < tdma.frame_ms;
+}
+
+// whether the last beacon is recent enough to send by its schedule
+uint8_t tdma_synced(){
+  if(tdma.synced && millis() - tdma.t0 >= TDMA_SYNC_FRAMES * tdma.frame_ms){
+    LOG_WARN("Beacons stopped, sending unscheduled");
+    tdma.synced = 0;
+  }
+  return tdma.synced;
+}
+
+// holding packets back at boot in case there is a beacon to sync to
+uint8_t tdma_listening(){
+  return TDMA_ENABLED && !tdma_beacons && millis() < (unsigned long)TDMA_LISTEN_MS;
+}
+
+/**
+* Finds the start of our next slot from the last beacon. Without a slot, or
+* with one past what the beacon advertised, that is the join slot, which is
+* skipped every other superframe on average so joining nodes spread out.
+*/
+void tdma_plan(){
+  uint8_t slot = tdma.slot < tdma.slots ? tdma.slot : TDMA_JOIN_SLOT;
+  unsigned long at = tdma.t0 + tdma_slot_offset_ms(tdma.slot_ms, slot);
+
+  while((long)(millis() - at) > 0)
+    at += tdma.frame_ms;
+  if(slot == TDMA_JOIN_SLOT && random(2))
+    at += tdma.frame_ms;
+
+  tdma.next_tx = at;
+}
+
+// last is 0 when more frames wait in the UART, aux_fall_ms then belongs to one of them
+void tdma_beacon(const ControlFrame *beacon, uint8_t last){
+  if(beacon->args[0] != link_rate){ // heard on ours, the gateway is on another: its join beacon on the boot rate
+    tdma.synced = 0;
+    e22_set_link(beacon->args[0] & 0x07, link_power);
+    return;
+  }
+  tdma.frame_ms = beacon->seq;
+  tdma.slot_ms = TDMA_BEACON_SLOT_MS(beacon->bitmap);
+  tdma.slots = TDMA_BEACON_SLOTS(beacon->bitmap);
+  tdma_beacons++;
+
+  if(!last || !TDMA_ENABLED || !tdma.frame_ms)
+    return;
+
+  if(!tdma.synced){
+    LOG_INFO("Synced to beacon, slots: %u slot ms: %u", tdma.slots, tdma.slot_ms);
+  }
+  tdma.t0 = aux_fall_ms;
+  tdma.synced = 1;
+  tdma_plan();
+}
+
+// the longest an ack is waited for, however often the packet was sent
+unsigned long arq_timeout_cap(const ArqEntry *entry){
+  return ((unsigned long)ARQ_ACK_SLACK << ARQ_MAX_TRIES) + entry->base;
+}
+
+void arq_send(ArqEntry *entry){
+  unsigned long deadline;
+
+  if(entry->tries){
+    entry->packet->packetData.flags = (entry->packet->packetData.flags | LINK_FLAG_RETX) & ~LINK_FLAG_MORE; // resent on its own, acked at once
+    arq_retransmits++;
+  }
+
+  send_packet(entry->packet);
+  entry->sent_at = millis();
+
+  if(tdma_synced())
+    entry->timeout = entry->base = tdma.slot_ms; // the ack comes back within the slot, a miss waits for the next one
+  else if(entry->tries){
+    entry->timeout = (entry->base << entry->tries) + random(ARQ_ACK_SLACK); // jitter, nodes that collided once must not collide again
+    if(entry->timeout > arq_timeout_cap(entry)) entry->timeout = arq_timeout_cap(entry);
+  }
+  else
+    entry->timeout = entry->base = ARQ_ACK_SLACK + (e22_air_end - entry->sent_at) + link_airtime_ms(CONTROL_FRAME_SIZE_B, link_rate); // behind whatever is still on air
+  entry->tries++;
+
+  // acks held for the burst come after this packet; the burst ends with the
+  // first one sent without LINK_FLAG_MORE, a retry included
+  deadline = entry->sent_at + entry->timeout;
+  for(uint8_t i = 0; i < arq_inflight; i++){
+    ArqEntry *held = &arq_window[i];
+    if(held == entry || !(held->packet->packetData.flags & LINK_FLAG_MORE))
+      continue;
+    if(entry->tries == 1 && held->tries == 1 && (long)(deadline - (held->sent_at + held->timeout)) > 0){
+      held->timeout = deadline - held->sent_at;
+      if(held->timeout > arq_timeout_cap(held)) held->timeout = arq_timeout_cap(held);
+    }
+    if(!(entry->packet->packetData.flags & LINK_FLAG_MORE))
+      held->packet->packetData.flags &= ~LINK_FLAG_MORE;
+  }
+}
+
+// gives the packet in window slot i back to the sampler
+void arq_release(uint8_t i){
+  xQueueSend(freeQueue, &arq_window[i].packet, 0);
+  arq_window[i] = arq_window[--arq_inflight];
+}
+
+// the receiver has already moved to the rate in the ack, follow before anything else goes out
+void link_follow(const ControlFrame *ack){
+  link_timeouts = 0;
+
+  if((ack->args[LINK_ARG_RATE] | ack->args[LINK_ARG_POWER]) & LINK_ARG_SET)
+    e22_set_link(ack->args[LINK_ARG_RATE] & LINK_ARG_SET ? ack->args[LINK_ARG_RATE] & 0x07 : link_rate,
+                 ack->args[LINK_ARG_POWER] & LINK_ARG_SET ? ack->args[LINK_ARG_POWER] & 0x03 : link_power);
+}
+
+// applies an ACK/NACK to the window, acked packets are freed and holes resent
+void arq_apply_ack(const ControlFrame *ack){
+  unsigned long now;
+
+  LOG_DEBUG("%s%u bitmap: %X", ack->type == CTRL_NACK ? "NACK seq: " : "ACK seq: ", ack->seq, ack->bitmap);
+  link_follow(ack);
+
+  if((ack->args[LINK_ARG_SLOT] & LINK_ARG_SET) && (ack->args[LINK_ARG_SLOT] & ~LINK_ARG_SET) != tdma.slot){
+    tdma.slot = ack->args[LINK_ARG_SLOT] & ~LINK_ARG_SET;
+    LOG_INFO("TDMA slot: %u", tdma.slot);
+    if(tdma_synced()) tdma_plan();
+  }
+
+  now = millis();
+  for(uint8_t i = 0; i < arq_inflight;){
+    ArqEntry *entry = &arq_window[i];
+
+    if(link_acked(ack, entry->packet->packetData.count)){
+      if(entry->tries == 1) hist_record(&lat_ack, (now - entry->sent_at) * 1000);
+      arq_acked++;
+      arq_release(i);
+      continue;
+    }
+    if(ack->type == CTRL_NACK && link_missing(ack, entry->packet->packetData.count) && now - entry->sent_at >= ARQ_NACK_HOLDOFF){
+      if(tdma_synced()) entry->timeout = 0; // goes out in our next slot
+      else arq_send(entry);
+    }
+    i++;
+  }
+}
 
+/**
+* Reads every control frame waiting on the UART, acks for this session and
+* beacons from the gateway.
+*/
+void poll_control(){
+  ControlFrame frame;
+  uint8_t rssi;
+
+  while(Serial2.available() >= (int)(CONTROL_FRAME_SIZE_B + (E22_RSSI ? 1 : 0))){
+    if(Serial2.readBytes((uint8_t *)&frame, CONTROL_FRAME_SIZE_B) != CONTROL_FRAME_SIZE_B || (E22_RSSI && Serial2.readBytes(&rssi, 1) != 1)
+       || frame.magic != CTRL_MAGIC){
+      LOG_ERROR("E22 received a bad control frame");
+      while(Serial2.available()) Serial2.read(); // resync on the next frame
+      return;
+    }
+
+    if(frame.type == CTRL_BEACON)
+      tdma_beacon(&frame, !Serial2.available());
+    else if(frame.session == tx_session)
+      arq_apply_ack(&frame);
+  }
+}
+
+// whether sending arq_next_seq would put it ARQ_WINDOW or more past the oldest unacked packet
+uint8_t arq_window_full(){
+  for(uint8_t i = 0; i < arq_inflight; i++)
+    if(arq_next_seq - arq_window[i].packet->packetData.count >= ARQ_WINDOW)
+      return 1;
+
+  return 0;
+}
+
+/**
+* The first packet whose ack is overdue, giving up on those that have had
+* ARQ_MAX_TRIES. NULL when none is due.
+*/
+ArqEntry *arq_overdue(){
+  for(uint8_t i = 0; i < arq_inflight;){
+    ArqEntry *entry = &arq_window[i];
+
+    if(millis() - entry->sent_at < entry->timeout){
+      i++;
+      continue;
+    }
+    if(++link_timeouts >= LINK_FALLBACK_TIMEOUTS && (link_rate != E22_AIR_RATE_BASE || link_power != E22_POWER_BASE)){
+      LOG_WARN("Acks stopped, back to the boot link settings");
+      e22_set_link(E22_AIR_RATE_BASE, E22_POWER_BASE);
+    }
+    if(entry->tries >= ARQ_MAX_TRIES){
+      LOG_WARN("Giving up on packet: %u", entry->packet->packetData.count);
+      arq_given_up++;
+      arq_release(i);
+      continue;
+    }
+    return entry;
+  }
+
+  return NULL;
+}
+
+/**
+* Numbers the packet and sends it. Sequence numbers are handed out here, in
+* send order, since the sampler and the fragmenter both fill packets. With
+* burst set and another packet waiting that the window lets out, this one
+* goes with LINK_FLAG_MORE.
+*/
+void tx_new_packet(Packet *packet, uint8_t burst){
+  LOG_DEBUG("Tx'ing packet");
+  hist_record(&lat_queue, metrics_now_us() - tx_ready_us[packet - tx_packets]);
+  packet->packetData.count = tx_count++;
+  packet->packetData.src = (E22_CONFIG_ADDH << 8) | E22_CONFIG_ADDL_TX;
+  packet->packetData.session = tx_session;
+  arq_next_seq = tx_count;
+
+  packet->packetData.flags &= ~LINK_FLAG_MORE;
+  if(burst && uxQueueMessagesWaiting(txQueue) && !arq_window_full())
+    packet->packetData.flags |= LINK_FLAG_MORE;
+
+  if(packet->packetData.flags & LINK_FLAG_ACK_REQ){
+    ArqEntry *entry = &arq_window[arq_inflight++];
+    entry->packet = packet;
+    entry->tries = 0;
+    arq_send(entry);
+  }
+  else{
+    send_packet(packet);
+    xQueueSend(freeQueue, &packet, 0);
+  }
+}
+
+// how long the tx task can sleep if no frame arrives and no packet is handed over
+TickType_t tx_wait(){
+  unsigned long now = millis();
+  long wait = -1;
+
+  if(tdma_synced()){
+    long sync_left = (long)(tdma.t0 + TDMA_SYNC_FRAMES * tdma.frame_ms - now);
+    wait = tdma_slot_heard() ? (long)(tdma.next_tx - now) : sync_left; // otherwise the next beacon wakes us
+    if(sync_left < wait) wait = sync_left;
+  }
+  else if(tdma_listening())
+    wait = TDMA_LISTEN_MS - (long)now;
+  else
+    for(uint8_t i = 0; i < arq_inflight; i++){
+      long left = (long)(arq_window[i].sent_at + arq_window[i].timeout - now);
+      if(wait < 0 || left < wait) wait = left;
+    }
+
+  if(wait < 0 && (tdma_synced() || arq_inflight)) wait = 0;
+  return wait < 0 ? portMAX_DELAY : pdMS_TO_TICKS(wait);
+}
+
+/**
+* AUX falls when a received frame starts coming out of the module, and for our
+* own sends; it rises once the frame is in the UART, which is when there is
+* something to read.
+*/
+void IRAM_ATTR aux_isr(){
+  BaseType_t woken = pdFALSE;
+
+  if(digitalRead(E22_AUX) == LOW)
+    aux_fall_ms = millis();
+  vTaskNotifyGiveFromISR(txTask, &woken);
+  if(woken) portYIELD_FROM_ISR();
+}
+
+/**
+* Radio side of the pipeline. Woken by the sensor task handing over a packet,
+* by AUX when a control frame comes in, or when something is due. Synced to
+* the gateway's beacons it sends one frame per superframe in its slot, an
+* overdue packet before a new one; otherwise packets go out as soon as they
+* are ready, back to back in a burst when several are. In reliable mode up
+* to ARQ_WINDOW packets stay in flight until they are acked or given up on.
+*/
+void tx_task_code(void *params){
+  Packet *packet;
+  ArqEntry *entry;
+
+  (void)params;
+  for(;;){
+    ulTaskNotifyTake(pdTRUE, tx_wait());
+    poll_control();
+
+    if(tdma_synced()){
+      if((long)(millis() - tdma.next_tx) < 0 || !tdma_slot_heard())
+        continue;
+
+      if((entry = arq_overdue()))
+        arq_send(entry);
+      else if(!arq_window_full() && xQueueReceive(txQueue, &packet, 0) == pdTRUE)
+        tx_new_packet(packet, 0);
+      tdma_plan();
+    }
+    else if(!tdma_listening()){
+      while((entry = arq_overdue()))
+        arq_send(entry);
+      while(!arq_window_full() && xQueueReceive(txQueue, &packet, 0) == pdTRUE){
+        tx_new_packet(packet, 1);
+        poll_control();
+      }
+    }
+  }
+}
+
+// one histogram as a line on the debug serial
+void print_hist(const char *name, const LatencyHist *h){
+  LOG_INFO("%s n: %u avg us: %u p50: %u p99: %u max: %u", name, h->count, h->count ? (uint32_t)(h->sum_us / h->count) : 0, hist_percentile(h, 50), hist_percentile(h, 99), h->max_us);
+}
+
+/**
+* Hands data to the radio task as fragments, taking packet buffers only while
+* the sampler has FRAGMENT_SPARE_PACKETS free. Blocks until the last fragment
+* is queued or timeout_ms has passed, in which case the receiver times out
+* the part that went. Returns 1 when every fragment was queued.
+*/
+uint8_t fragment_send(const uint8_t *data, size_t length, uint8_t type, unsigned long timeout_ms){
+  unsigned long start = millis();
+  Packet *packet;
+
+  if(!fragment_begin(&tx_fragmenter, data, length, type)){
+    LOG_WARN("Payload does not fragment, bytes: %u", length);
+    return 0;
+  }
+
+  while(!fragment_done(&tx_fragmenter)){
+    if(millis() - start >= timeout_ms){
+      LOG_WARN("Radio is behind, fragments not sent: %u of %u", tx_fragmenter.count - tx_fragmenter.index, tx_fragmenter.count);
+      return 0;
+    }
+    if(uxQueueMessagesWaiting(freeQueue) <= FRAGMENT_SPARE_PACKETS || xQueueReceive(freeQueue, &packet, 0) != pdTRUE){
+      vTaskDelay(pdMS_TO_TICKS(FRAGMENT_POLL_MS));
+      continue;
+    }
+
+    fragment_next(&tx_fragmenter, packet);
+    packet->packetData.flags = ARQ_RELIABLE ? LINK_FLAG_ACK_REQ : 0;
+    tx_ready_us[packet - tx_packets] = metrics_now_us();
+    tx_fragments++;
+    xQueueSend(txQueue, &packet, 0); // can't be full, there are only PACKET_BUFFERS packets
+    xTaskNotifyGive(txTask);
+  }
   return 1;
 }
 
-void tx_task_code(){
-  DEBUG_PRINTLN("Tx'ing packet");
-  send_packet(&tx_packet);
-  
-  tx_packet.packetData.count++;
-  DEBUG_PRINTLN("Count increased")
-  
-  clear_packet_messages(&tx_packet);
-  DEBUG_PRINTLN("Wiped packet");
+// counters and stage histograms as JSON, what the gateway publishes for this node
+size_t diag_format(char *out, size_t capacity){
+  const LatencyHist *hists[] = { &lat_fill, &lat_queue, &lat_send, &lat_ack };
+  const char *names[] = { "fill_us", "queue_us", "send_us", "ack_us" };
+  size_t length;
+  int n;
+
+  n = snprintf(out, capacity,
+               "{\"uptime_ms\":%lu,\"packets\":%lu,\"fragments\":%lu,\"bursts\":%lu,\"dropped_samples\":%lu,\"acked\":%lu,"
+               "\"retransmits\":%lu,\"given_up\":%lu,\"rate\":%u,\"power\":%u,\"switches\":%lu,\"bytes\":%lu,\"heap_min\":%lu,"
+               "\"dht_reads\":%lu,\"dht_errors\":%lu,",
+               millis(), (unsigned long)tx_count, (unsigned long)tx_fragments, (unsigned long)tx_bursts, (unsigned long)sample_overruns,
+               (unsigned long)arq_acked, (unsigned long)arq_retransmits, (unsigned long)arq_given_up, link_rate, link_power,
+               (unsigned long)link_switches, (unsigned long)tx_bytes, (unsigned long)ESP.getMinFreeHeap(),
+               (unsigned long)dht.reads, (unsigned long)dht.errors);
+  if(n < 0 || (size_t)n >= capacity) return 0;
+  length = n;
+
+  for(uint8_t i = 0; i < 4; i++){
+    length = hist_format(hists[i], names[i], out, length, capacity - 1); // room for the separator
+    if(!length) return 0;
+    out[length++] = i < 3 ? ',' : '}';
+  }
+  return length;
+}
+
+// sends the diagnostics every DIAG_INTERVAL, called from the reporting loop
+void diag_poll(){
+  static unsigned long last = 0;
+  size_t length;
+
+  if(millis() - last < (unsigned long)DIAG_INTERVAL)
+    return;
+  last = millis();
+
+  length = diag_format(diag_buffer, sizeof(diag_buffer));
+  if(!length){
+    LOG_WARN("Diagnostics do not fit DIAG_MAX_B");
+    return;
+  }
+  if(fragment_send((const uint8_t *)diag_buffer, length, FRAGMENT_TYPE_DIAG, DIAG_INTERVAL / 2)){
+    LOG_INFO("Diagnostics queued, bytes: %u fragments: %u", length, tx_fragmenter.count);
+  }
+}
+
+void setupTasks(){
+  tx_session = random(1, 256); // hardware RNG on the ESP32, differs every boot
+  txQueue = xQueueCreate(PACKET_BUFFERS, sizeof(Packet *));
+  freeQueue = xQueueCreate(PACKET_BUFFERS, sizeof(Packet *));
+
+  for(int i = 0; i < PACKET_BUFFERS; i++){
+    Packet *packet = &tx_packets[i];
+    xQueueSend(freeQueue, &packet, 0);
+  }
+
+  if(SENSOR_DHT && !dht_begin(&dht, DHT_PIN, DHT_RMT_CHANNEL)){
+    LOG_ERROR("DHT RMT setup failed");
+  }
+
+  xTaskCreatePinnedToCore(tx_task_code, "tx", TASK_STACK_B, NULL, TX_TASK_PRIORITY, &txTask, TX_TASK_CORE);
+  attachInterrupt(digitalPinToInterrupt(E22_AUX), aux_isr, CHANGE);
+  xTaskCreatePinnedToCore(sensor_task_code, "sensor", TASK_STACK_B, NULL, SENSOR_TASK_PRIORITY, &sensorTask, SENSOR_TASK_CORE);
 }
 
 void setupWiFi(){
-  DEBUG_PRINTLN("Starting WiFi with:");
-  DEBUG_PRINT("SSID: "); DEBUG_PRINT(wifi_ssid); DEBUG_PRINT(" PASS: "); DEBUG_PRINTLN(wifi_password);
+  LOG_INFO("Starting WiFi with:");
+  LOG_INFO("SSID: %s PASS: %s", wifi_ssid, wifi_password);
 
   WiFi.begin(wifi_ssid, wifi_password);
 
   do{
-    DEBUG_PRINTLN("Could not connect to WiFi, trying again in 5s");
+    LOG_WARN("Could not connect to WiFi, trying again in 5s");
     delay(5000);
   }while(WiFi.status() != WL_CONNECTED);
  
-  DEBUG_PRINTLN("WiFi Connected! ");
+  LOG_INFO("WiFi Connected!");
  
 }
 
 void setupMqtt(){
-  DEBUG_PRINTLN("Starting MQTT Client");
-  DEBUG_PRINT("BROKER: "); DEBUG_PRINT(mqtt_broker); DEBUG_PRINT(" PORT: "); DEBUG_PRINT(mqtt_port); DEBUG_PRINT(" TOPIC: "); DEBUG_PRINTLN(mqtt_topic);
+  LOG_INFO("Starting MQTT Client");
+  LOG_INFO("BROKER: %s PORT: %u TOPIC: %s", mqtt_broker, mqtt_port, mqtt_topic);
 
   while(!mqttClient.connect(mqtt_broker, mqtt_port)){
-    DEBUG_PRINTLN("Could not connect to broker, trying again in 5s");
-    DEBUG_PRINTLN(mqttClient.connectError());
+    LOG_WARN("Could not connect to broker, error: %d, trying again in 5s", mqttClient.connectError());
     delay(5000);
   }
 
-  DEBUG_PRINTLN("Mqtt Broker connected! ");
+  LOG_INFO("Mqtt Broker connected!");
 }
 
 
-uint8_t setupE22(){
-  Serial2.begin(9600, SERIAL_8N1, E22_RX_PIN, E22_TX_PIN);
-  e22ttl.begin(); // begin the e22
-
-  rsc = e22ttl.getConfiguration(); // get the current config from the E22
-  config = (Configuration*)rsc.data; // extract the config data
-
+// what the sketch needs from the module, set on top of the config read from it
+void e22_desired_config(Configuration *config){
   config->ADDH = E22_CONFIG_ADDH;
 #ifdef TRANSMITTER
   config->ADDL = E22_CONFIG_ADDL_TX; // transmitter
@@ -243,13 +868,13 @@ uint8_t setupE22(){
   config->NETID = E22_CONFIG_NETID;
   config->CHAN = E22_CONFIG_CHAN;
 
-  config->SPED.uartBaudRate = UART_BPS_9600;
-  config->SPED.airDataRate = AIR_DATA_RATE_010_24;
+  config->SPED.uartBaudRate = E22_UART_BPS_TYPE;
+  config->SPED.airDataRate = E22_AIR_RATE_BASE;
   config->SPED.uartParity = MODE_00_8N1;
 
   config->OPTION.subPacketSetting = SPS_240_00;
   config->OPTION.RSSIAmbientNoise = RSSI_AMBIENT_NOISE_DISABLED;
-  config->OPTION.transmissionPower = POWER_22;
+  config->OPTION.transmissionPower = E22_POWER_BASE;
 
   config->TRANSMISSION_MODE.enableRSSI = RSSI_ENABLED;
   config->TRANSMISSION_MODE.fixedTransmission = FT_FIXED_TRANSMISSION;
@@ -263,52 +888,200 @@ uint8_t setupE22(){
   config->TRANSMISSION_MODE.WORTransceiverControl = WOR_RECEIVER;
 #endif
   
-  config->TRANSMISSION_MODE.WORPeriod = WOR_2000_011;
+  config->TRANSMISSION_MODE.WORPeriod = E22_WOR_PERIOD;
+}
 
-  e22ttl.setConfiguration(*config, WRITE_CFG_PWR_DWN_SAVE);
+uint8_t setupE22(){
+  uint8_t synced;
 
-  DEBUG_PRINTLN(rsc.status.getResponseDescription());
-  DEBUG_PRINTLN(rsc.status.code);
+  Serial2.setTxBufferSize(E22_UART_TX_BUFFER_B);
+  Serial2.begin(E22_UART_CONFIG_BPS, SERIAL_8N1, E22_RX_PIN, E22_TX_PIN);
+  e22ttl.begin(); // begin the e22
 
-  // read the config we just wrote
-  rsc = e22ttl.getConfiguration(); // get the current config from the E22
-  config = (Configuration*)rsc.data; // extract the config data
+  synced = e22_config_sync(&e22ttl, &Serial2, e22_desired_config, &e22_config);
+  if(E22_WOR) e22ttl.setMode(E22_SEND_MODE);
+  return synced;
+}
 
-  DEBUG_PRINTLN("Re read the config from device");
-  DEBUG_PRINTLN(rsc.status.getResponseDescription());
-  DEBUG_PRINTLN(rsc.status.code);
-  
-  DEBUG_PRINTLN("----------------------------------------");
-
-  DEBUG_PRINT(F("HEAD : "));  DEBUG_PRINT(config->COMMAND, HEX);DEBUG_PRINT(" ");DEBUG_PRINT(config->STARTING_ADDRESS, HEX);DEBUG_PRINT(" ");DEBUG_PRINTLN(config->LENGHT, HEX);
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("AddH : "));  DEBUG_PRINTLN(config->ADDH, HEX);
-  DEBUG_PRINT(F("AddL : "));  DEBUG_PRINTLN(config->ADDL, HEX);
-  DEBUG_PRINT(F("NetID : "));  DEBUG_PRINTLN(config->NETID, HEX);
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("Chan : "));  DEBUG_PRINT(config->CHAN, DEC); DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->getChannelDescription());
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("SpeedParityBit     : "));  DEBUG_PRINT(config->SPED.uartParity, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->SPED.getUARTParityDescription());
-  DEBUG_PRINT(F("SpeedUARTDatte     : "));  DEBUG_PRINT(config->SPED.uartBaudRate, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->SPED.getUARTBaudRateDescription());
-  DEBUG_PRINT(F("SpeedAirDataRate   : "));  DEBUG_PRINT(config->SPED.airDataRate, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->SPED.getAirDataRateDescription());
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("OptionSubPacketSett: "));  DEBUG_PRINT(config->OPTION.subPacketSetting, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->OPTION.getSubPacketSetting());
-  DEBUG_PRINT(F("OptionTranPower    : "));  DEBUG_PRINT(config->OPTION.transmissionPower, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->OPTION.getTransmissionPowerDescription());
-  DEBUG_PRINT(F("OptionRSSIAmbientNo: "));  DEBUG_PRINT(config->OPTION.RSSIAmbientNoise, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->OPTION.getRSSIAmbientNoiseEnable());
-  DEBUG_PRINTLN(F(" "));
-  DEBUG_PRINT(F("TransModeWORPeriod : "));  DEBUG_PRINT(config->TRANSMISSION_MODE.WORPeriod, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getWORPeriodByParamsDescription());
-  DEBUG_PRINT(F("TransModeTransContr: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.WORTransceiverControl, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getWORTransceiverControlDescription());
-  DEBUG_PRINT(F("TransModeEnableLBT : "));  DEBUG_PRINT(config->TRANSMISSION_MODE.enableLBT, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getLBTEnableByteDescription());
-  DEBUG_PRINT(F("TransModeEnableRSSI: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.enableRSSI, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getRSSIEnableByteDescription());
-  DEBUG_PRINT(F("TransModeEnabRepeat: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.enableRepeater, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getRepeaterModeEnableByteDescription());
-  DEBUG_PRINT(F("TransModeFixedTrans: "));  DEBUG_PRINT(config->TRANSMISSION_MODE.fixedTransmission, BIN);DEBUG_PRINT(" -> "); DEBUG_PRINTLN(config->TRANSMISSION_MODE.getFixedTransmissionDescription());
-
-  DEBUG_PRINTLN("----------------------------------------");
-
-  rsc.close();
-
-  return rsc.status.code != 1?0:1;
+// M0 and M1 are held so the module stays asleep while the ESP32 is in deep sleep
+void e22_sleep(){
+  e22ttl.setMode(MODE_3_SLEEP);
+  gpio_hold_en((gpio_num_t)E22_M0);
+  gpio_hold_en((gpio_num_t)E22_M1);
+  gpio_deep_sleep_hold_en();
+}
+
+// back from e22_sleep() after a deep sleep, the config is still in the module
+void e22_wake(){
+  gpio_hold_dis((gpio_num_t)E22_M0);
+  gpio_hold_dis((gpio_num_t)E22_M1);
+  Serial2.setTxBufferSize(E22_UART_TX_BUFFER_B);
+  Serial2.begin(E22_UART_CONFIG_BPS, SERIAL_8N1, E22_RX_PIN, E22_TX_PIN);
+  e22ttl.begin();
+  e22_uart_data(&Serial2, &e22_config);
+  e22ttl.setMode(E22_SEND_MODE);
+}
+
+void rtc_restore(){
+  memcpy((void *)&e22_config, rtc_state.e22_config, sizeof(Configuration));
+  tx_count = rtc_state.tx_count;
+  tx_bytes = rtc_state.tx_bytes;
+  arq_acked = rtc_state.acked;
+  arq_retransmits = rtc_state.retransmits;
+  arq_given_up = rtc_state.given_up;
+  tx_session = rtc_state.session;
+  link_rate = rtc_state.link_rate;
+  link_power = rtc_state.link_power;
+}
+
+void rtc_save(){
+  memcpy(rtc_state.e22_config, (const void *)&e22_config, sizeof(Configuration));
+  rtc_state.tx_count = tx_count;
+  rtc_state.tx_bytes = tx_bytes;
+  rtc_state.acked = arq_acked;
+  rtc_state.retransmits = arq_retransmits;
+  rtc_state.given_up = arq_given_up;
+  rtc_state.session = tx_session;
+  rtc_state.link_rate = link_rate;
+  rtc_state.link_power = link_power;
+}
+
+/**
+* Waits for the gateway's ack of count, following the rate and power it asks
+* for. Returns 1 once acked, 0 on timeout.
+*/
+uint8_t sleep_wait_ack(uint32_t count, unsigned long timeout){
+  unsigned long start = millis();
+  ControlFrame frame;
+  uint8_t rssi;
+
+  while(millis() - start < timeout){
+    if(Serial2.available() < (int)(CONTROL_FRAME_SIZE_B + (E22_RSSI ? 1 : 0))){
+      delay(10);
+      continue;
+    }
+    if(Serial2.readBytes((uint8_t *)&frame, CONTROL_FRAME_SIZE_B) != CONTROL_FRAME_SIZE_B || (E22_RSSI && Serial2.readBytes(&rssi, 1) != 1)
+       || frame.magic != CTRL_MAGIC){
+      LOG_ERROR("E22 received a bad control frame");
+      while(Serial2.available()) Serial2.read();
+      continue;
+    }
+    if(frame.type == CTRL_BEACON || frame.session != tx_session)
+      continue; // a sleeping node has no slot to keep
+
+    link_follow(&frame);
+    if(link_acked(&frame, count))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+* Sends the full packet in RTC memory and waits for its ack, resending up to
+* ARQ_MAX_TRIES times. One packet at a time and blocking, nothing else runs
+* on a sleeping node.
+*/
+void sleep_send(Packet *packet){
+  unsigned long timeout = ARQ_ACK_SLACK + link_airtime_ms(CONTROL_FRAME_SIZE_B, link_rate);
+
+  packet->packetData.count = tx_count++;
+  packet->packetData.src = (E22_CONFIG_ADDH << 8) | E22_CONFIG_ADDL_TX;
+  packet->packetData.session = tx_session;
+  packet->packetData.flags = ARQ_RELIABLE ? LINK_FLAG_ACK_REQ : 0;
+
+  for(uint8_t tries = 0; tries < ARQ_MAX_TRIES; tries++){
+    if(tries){
+      packet->packetData.flags |= LINK_FLAG_RETX;
+      arq_retransmits++;
+    }
+    packet->packetData.flags = (packet->packetData.flags & (LINK_FLAG_ACK_REQ | LINK_FLAG_RETX)) | LINK_FLAGS_LINK(link_rate, link_power);
+    packet_seal(packet);
+
+    rs = e22ttl.sendFixedMessage(E22_DEST_ADDH, E22_CONFIG_ADDL_RX, E22_CONFIG_CHAN, (const void *)packet, PACKET_SIZE_B); // returns once off the air
+    tx_bytes += PACKET_SIZE_B;
+    if(rs.code != E22_SUCCESS){
+      LOG_ERROR("E22 failed to send message: %s", rs.getResponseDescription());
+    }
+
+    if(!ARQ_RELIABLE)
+      return;
+    if(sleep_wait_ack(packet->packetData.count, timeout + random(ARQ_ACK_SLACK) * tries)){
+      arq_acked++;
+      return;
+    }
+    if(++link_timeouts >= LINK_FALLBACK_TIMEOUTS && (link_rate != E22_AIR_RATE_BASE || link_power != E22_POWER_BASE)){
+      LOG_WARN("Acks stopped, back to the boot link settings");
+      e22_set_link(E22_AIR_RATE_BASE, E22_POWER_BASE);
+    }
+  }
+
+  LOG_WARN("Giving up on packet: %u", packet->packetData.count);
+  arq_given_up++;
+}
+
+/**
+* One wake of a deep sleeping node, run from setup() in place of the tasks:
+* takes a sample into the packet kept in RTC memory, sends the packet once it
+* is full, and sleeps until the next sample is due. Never returns. The E22
+* sleeps too and is only woken to send; its config is synced once per power
+* on. Sleeping nodes do not follow beacons, they send unscheduled.
+*/
+void sleep_cycle(){
+  unsigned long woke = millis(), awake;
+  Message new_message;
+
+  if(esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER || rtc_state.magic != RTC_STATE_MAGIC){
+    LOG_INFO("Power on, sleeping between samples, interval ms: %u", SENSOR_INTERVAL);
+    memset((void *)&rtc_state, 0, sizeof(RtcState));
+    rtc_state.magic = RTC_STATE_MAGIC;
+    rtc_state.session = random(1, 256);
+    rtc_state.link_rate = E22_AIR_RATE_BASE;
+    rtc_state.link_power = E22_POWER_BASE;
+    clear_packet_messages(&rtc_state.packet, &rtc_state.codec);
+
+    setupE22();
+    memcpy(rtc_state.e22_config, (const void *)&e22_config, sizeof(Configuration));
+    e22_sleep();
+  }
+  rtc_restore();
+  rtc_state.wakes++;
+
+#if SENSOR_DHT
+  // the RMT does not keep a capture across deep sleep, so this one waits for it; a failed read is a gap, not a repeat
+  if(dht_begin(&dht, DHT_PIN, DHT_RMT_CHANNEL) && dht_read(&dht) == DHT_OK){
+    rtc_state.dht_reads++;
+    new_message.temperature = dht.reading.temperature / 10.0f;
+    new_message.humidity = dht.reading.humidity / 10.0f;
+    append_packet_message(&rtc_state.packet, &rtc_state.codec, new_message);
+  }
+  else{
+    rtc_state.dht_errors++;
+    LOG_WARN("DHT read failed, sample skipped: %u", dht.status);
+  }
+#else
+  new_message.temperature = (float)random(0, 40);
+  new_message.humidity = (float)random(0, 100);
+  append_packet_message(&rtc_state.packet, &rtc_state.codec, new_message);
+#endif
+
+  if(packet_full(&rtc_state.packet)){
+    e22_wake();
+    sleep_send(&rtc_state.packet);
+    e22_sleep();
+    clear_packet_messages(&rtc_state.packet, &rtc_state.codec);
+
+    LOG_INFO("Packets: %u Acked: %u Retransmits: %u Given up: %u", tx_count, arq_acked, arq_retransmits, arq_given_up);
+    LOG_INFO("Rate: %u Power: %u Wakes: %u Awake ms: %u DHT reads: %u DHT errors: %u", link_rate, link_power, rtc_state.wakes,
+             rtc_state.awake_ms, rtc_state.dht_reads, rtc_state.dht_errors);
+  }
+
+  rtc_save();
+  awake = millis() - woke;
+  rtc_state.awake_ms += awake;
+  log_flush();
 
+  esp_sleep_enable_timer_wakeup((uint64_t)(awake < (unsigned long)SENSOR_INTERVAL ? SENSOR_INTERVAL - awake : 1) * 1000);
+  esp_deep_sleep_start();
 }
 
 #endif
@@ -0,0 +1,209 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <PacketSchema.h>
+
+/*
+* Payloads larger than one frame, node diagnostics and the like, split into
+* fragments of FRAGMENT_DATA_B. A fragment is a frame of its own, the same
+* PACKET_MAX_B as a data packet and told apart by FRAGMENT_SCHEMA, so it goes
+* through the link layer unchanged: it takes a sequence number, is acked and
+* resent like any packet, and the receiver sees every fragment once.
+*
+*   PacketData, stream (u8), index (u8), count (u8), type (u8), total (u16),
+*   size (u8), data[FRAGMENT_DATA_B], trailer[FRAME_TRAILER_B]
+*
+* stream numbers a payload per node and session, total is the payload's
+* length and size what this fragment carries of it. The receiver puts
+* fragments together in FRAGMENT_REASM_SLOTS buffers of FRAGMENT_MAX_B, keyed
+* by node, session and stream, in any order. A payload that has not
+* completed FRAGMENT_TIMEOUT_MS after its last fragment arrived is dropped;
+* with every buffer in use a new payload takes the one idle longest.
+*/
+
+#define FRAGMENT_SCHEMA 0x80 // schemas from here up are not Message types
+#define FRAGMENT_MAX_B 2048 // largest payload
+#define FRAGMENT_REASM_SLOTS 4 // payloads being put together at once on the receiver
+const long FRAGMENT_TIMEOUT_MS = 1000L * 60 * 2; // a few superframes with retransmissions
+
+#define FRAGMENT_TYPE_DIAG 1 // node counters and latency histograms, JSON
+
+typedef struct __attribute__((packed)) _fragment_header{
+  uint8_t stream;
+  uint8_t index;
+  uint8_t count;
+  uint8_t type; // FRAGMENT_TYPE_*
+  uint16_t total; // payload bytes over all fragments
+  uint8_t size; // payload bytes in this one
+}FragmentHeader;
+
+typedef struct __attribute__((packed)) _fragment_frame{
+  PacketData packetData; // schema FRAGMENT_SCHEMA, codec and the message indexes unused
+  FragmentHeader fragment;
+  uint8_t data[PACKET_MAX_B - sizeof(PacketData) - sizeof(FragmentHeader) - FRAME_TRAILER_B];
+  uint8_t trailer[FRAME_TRAILER_B]; // sealed like a data packet
+}FragmentFrame;
+
+#define FRAGMENT_DATA_B sizeof(((FragmentFrame *)0)->data)
+#define FRAGMENT_MAX_COUNT ((FRAGMENT_MAX_B + FRAGMENT_DATA_B - 1) / FRAGMENT_DATA_B)
+
+static_assert(sizeof(FragmentFrame) == sizeof(Packet), "a fragment travels in a Packet buffer");
+static_assert(offsetof(FragmentFrame, trailer) == offsetof(Packet, trailer), "the trailer has to end the frame");
+static_assert(alignof(FragmentFrame) == 1, "FragmentFrame must be readable from any byte buffer");
+static_assert(FRAGMENT_DATA_B <= UINT8_MAX, "size is 8 bits");
+static_assert(FRAGMENT_MAX_B <= UINT16_MAX, "total is 16 bits");
+static_assert(FRAGMENT_MAX_COUNT <= 16, "the receiver tracks fragments in 16 bits");
+static_assert(FRAGMENT_SCHEMA != PACKET_SCHEMA, "schema clash");
+
+// sender side, one payload at a time
+typedef struct _fragmenter{
+  const uint8_t *data;
+  uint16_t total;
+  uint8_t stream;
+  uint8_t index; // next fragment
+  uint8_t count;
+  uint8_t type;
+}Fragmenter;
+
+/**
+* Starts splitting data, which has to stay valid until the last fragment is
+* out. Returns 0 when it is empty or larger than FRAGMENT_MAX_B.
+*/
+inline uint8_t fragment_begin(Fragmenter *f, const uint8_t *data, size_t length, uint8_t type){
+  if(!length || length > FRAGMENT_MAX_B)
+    return 0;
+
+  f->data = data;
+  f->total = length;
+  f->stream++;
+  f->index = 0;
+  f->count = (length + FRAGMENT_DATA_B - 1) / FRAGMENT_DATA_B;
+  f->type = type;
+  return 1;
+}
+
+inline uint8_t fragment_done(const Fragmenter *f){ return f->index >= f->count; }
+
+/**
+* Fills packet with the next fragment's header and data, the link fields of
+* PacketData are left to the sender. Returns 0 when there is none left.
+*/
+inline uint8_t fragment_next(Fragmenter *f, Packet *packet){
+  FragmentFrame *frame = (FragmentFrame *)packet;
+  size_t offset = (size_t)f->index * FRAGMENT_DATA_B;
+
+  if(fragment_done(f))
+    return 0;
+
+  memset((void *)frame, 0, sizeof(FragmentFrame));
+  frame->packetData.schema = FRAGMENT_SCHEMA;
+  frame->fragment.stream = f->stream;
+  frame->fragment.index = f->index;
+  frame->fragment.count = f->count;
+  frame->fragment.type = f->type;
+  frame->fragment.total = f->total;
+  frame->fragment.size = f->total - offset < FRAGMENT_DATA_B ? f->total - offset : FRAGMENT_DATA_B;
+  memcpy(frame->data, f->data + offset, frame->fragment.size);
+
+  f->index++;
+  return 1;
+}
+
+// every fragment but the last is full, and they add up to total
+inline uint8_t fragment_valid(const Packet *packet){
+  const FragmentHeader *h = &((const FragmentFrame *)packet)->fragment;
+
+  return packet->packetData.schema == FRAGMENT_SCHEMA && h->total && h->total <= FRAGMENT_MAX_B
+         && h->count == (h->total + FRAGMENT_DATA_B - 1) / FRAGMENT_DATA_B && h->index < h->count
+         && h->size == (h->index + 1 < h->count ? FRAGMENT_DATA_B : h->total - (size_t)h->index * FRAGMENT_DATA_B);
+}
+
+// receiver side
+typedef struct _reassembly{
+  uint8_t active;
+  uint16_t src;
+  uint8_t session;
+  uint8_t stream;
+  uint8_t type;
+  uint8_t count;
+  uint16_t total;
+  uint16_t received; // bit i: fragment i is in
+  uint32_t last_ms; // last fragment arrived
+  uint8_t data[FRAGMENT_MAX_B];
+}Reassembly;
+
+typedef struct _reassembler{
+  Reassembly slots[FRAGMENT_REASM_SLOTS];
+  uint32_t fragments;
+  uint32_t completed;
+  uint32_t expired; // timed out or evicted with fragments missing
+}Reassembler;
+
+// drops payloads that have not seen a fragment for FRAGMENT_TIMEOUT_MS
+inline void reasm_expire(Reassembler *r, uint32_t now){
+  for(uint8_t i = 0; i < FRAGMENT_REASM_SLOTS; i++)
+    if(r->slots[i].active && now - r->slots[i].last_ms >= (uint32_t)FRAGMENT_TIMEOUT_MS){
+      r->slots[i].active = 0;
+      r->expired++;
+    }
+}
+
+/**
+* Adds a fragment that passed fragment_valid(). Returns the buffer once its
+* payload is complete, valid until the next call; NULL otherwise.
+*/
+inline Reassembly *reasm_add(Reassembler *r, const Packet *packet, uint32_t now){
+  const FragmentFrame *frame = (const FragmentFrame *)packet;
+  const FragmentHeader *h = &frame->fragment;
+  const PacketData *pd = &frame->packetData;
+  Reassembly *slot = NULL, *idle = NULL;
+
+  r->fragments++;
+
+  for(uint8_t i = 0; i < FRAGMENT_REASM_SLOTS; i++){
+    Reassembly *s = &r->slots[i];
+
+    if(s->active && s->src == pd->src && s->session == pd->session && s->stream == h->stream){
+      slot = s;
+      break;
+    }
+    if(!idle || (idle->active && (!s->active || now - s->last_ms > now - idle->last_ms)))
+      idle = s;
+  }
+
+  // a stream number reused with another shape is a new payload
+  if(slot && (slot->total != h->total || slot->type != h->type)){
+    slot->active = 0;
+    r->expired++;
+  }
+  if(!slot || !slot->active){
+    slot = slot ? slot : idle;
+    if(slot->active) r->expired++;
+
+    slot->active = 1;
+    slot->src = pd->src;
+    slot->session = pd->session;
+    slot->stream = h->stream;
+    slot->type = h->type;
+    slot->count = h->count;
+    slot->total = h->total;
+    slot->received = 0;
+  }
+
+  memcpy(slot->data + (size_t)h->index * FRAGMENT_DATA_B, frame->data, h->size);
+  slot->received |= 1 << h->index;
+  slot->last_ms = now;
+
+  if(slot->received != (uint16_t)((1UL << slot->count) - 1))
+    return NULL;
+
+  slot->active = 0;
+  r->completed++;
+  return slot;
+}
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef FRAME_CHECK_H
+#define FRAME_CHECK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(ESP_PLATFORM) && !defined(HOST_SIM)
+  #include <esp_rom_crc.h>
+#endif
+
+/*
+* Integrity check and forward error correction for frames on the air. The
+* last FRAME_TRAILER_B bytes of a frame are its trailer:
+*
+*   crc (u32)           CRC-32 (zlib's) of everything in front of it
+*   parity[FRAME_FEC_B] Reed-Solomon over GF(2^8), everything in front of it
+*
+* The Reed-Solomon code is shortened to the frame, so a frame can be at most
+* FRAME_RS_MAX_B, and corrects up to FRAME_FEC_B / 2 bytes anywhere in it,
+* trailer included. FRAME_FEC_B=0 leaves the CRC alone. Both ends have to be
+* built with the same FRAME_FEC_B, a frame with another trailer fails the CRC.
+*
+* The receiver checks the CRC first and only runs the decoder when it fails,
+* a clean frame costs one pass of table lookups. Whatever the decoder
+* corrected is checked against the CRC again, a frame with more errors than
+* the code can fix is dropped rather than miscorrected into garbage.
+*
+* The ESP32 takes the CRC from its ROM, everything else builds the table.
+*/
+
+#ifndef FRAME_FEC_B
+  #define FRAME_FEC_B 8 // parity bytes, corrects half as many byte errors
+#endif
+#define FRAME_CRC_B 4
+#define FRAME_TRAILER_B (FRAME_CRC_B + FRAME_FEC_B)
+#define FRAME_RS_MAX_B 255 // one codeword of GF(2^8)
+#define FRAME_RS_POLY 0x11D // x^8 + x^4 + x^3 + x^2 + 1, alpha = 2
+#define FRAME_CRC_POLY 0xEDB88320UL // reflected
+
+static_assert(FRAME_FEC_B % 2 == 0 && FRAME_FEC_B <= 32, "FRAME_FEC_B has to be even, two parity bytes per byte corrected");
+
+typedef struct _frame_tables{
+  uint8_t exp[2 * 255]; // twice over so products need no modulo
+  uint8_t log[256];
+  uint8_t gen[FRAME_FEC_B + 1]; // generator, (x - a^0)...(x - a^(FRAME_FEC_B-1)), lowest power first
+  uint32_t crc[256];
+}FrameTables;
+
+inline uint8_t frame_tables_build(FrameTables *t){
+  uint16_t x = 1;
+
+  for(uint16_t i = 0; i < 255; i++){
+    t->exp[i] = t->exp[i + 255] = x;
+    t->log[x] = i;
+    x <<= 1;
+    if(x & 0x100) x ^= FRAME_RS_POLY;
+  }
+
+  t->gen[0] = 1;
+  for(uint8_t j = 0; j < FRAME_FEC_B; j++){
+    t->gen[j + 1] = 0;
+    for(uint8_t k = j + 1; k > 0; k--)
+      t->gen[k] = t->gen[k - 1] ^ (t->gen[k] ? t->exp[t->log[t->gen[k]] + j] : 0);
+    t->gen[0] = t->exp[t->log[t->gen[0]] + j];
+  }
+
+  for(uint32_t i = 0; i < 256; i++){
+    uint32_t c = i;
+
+    for(uint8_t k = 0; k < 8; k++)
+      c = (c >> 1) ^ (c & 1 ? FRAME_CRC_POLY : 0);
+    t->crc[i] = c;
+  }
+  return 1;
+}
+
+// built once on first use, by whichever task gets there first
+inline const FrameTables *frame_tables(){
+  static FrameTables tables;
+  static const uint8_t built = frame_tables_build(&tables);
+
+  (void)built;
+  return &tables;
+}
+
+inline uint8_t gf_mul(const FrameTables *t, uint8_t a, uint8_t b){ return a && b ? t->exp[t->log[a] + t->log[b]] : 0; }
+
+inline uint8_t gf_div(const FrameTables *t, uint8_t a, uint8_t b){ return a ? t->exp[t->log[a] + 255 - t->log[b]] : 0; }
+
+inline uint32_t frame_crc32(const uint8_t *data, size_t length){
+#if defined(ESP_PLATFORM) && !defined(HOST_SIM)
+  return esp_rom_crc32_le(0, data, length);
+#else
+  const uint32_t *table = frame_tables()->crc;
+  uint32_t c = 0xFFFFFFFFUL;
+
+  while(length--)
+    c = table[(c ^ *data++) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFFUL;
+#endif
+}
+
+// parity of data, the remainder of data(x) * x^FRAME_FEC_B divided by the generator
+inline void rs_encode(const uint8_t *data, size_t length, uint8_t *parity){
+  const FrameTables *t = frame_tables();
+
+  memset(parity, 0, FRAME_FEC_B);
+  for(size_t i = 0; i < length; i++){
+    uint8_t feedback = data[i] ^ parity[0];
+
+    if(!feedback){
+      memmove(parity, parity + 1, FRAME_FEC_B - 1);
+      parity[FRAME_FEC_B - 1] = 0;
+      continue;
+    }
+    for(uint8_t k = 0; k + 1 < FRAME_FEC_B; k++)
+      parity[k] = parity[k + 1] ^ gf_mul(t, feedback, t->gen[FRAME_FEC_B - 1 - k]);
+    parity[FRAME_FEC_B - 1] = gf_mul(t, feedback, t->gen[0]);
+  }
+}
+
+/**
+* Corrects the codeword in place, data and parity, length bytes in all.
+* Returns how many bytes it changed, or -1 with more errors than it can
+* locate; the codeword is then left as it was.
+*/
+inline int rs_decode(uint8_t *code, size_t length){
+  const FrameTables *t = frame_tables();
+  uint8_t syndromes[FRAME_FEC_B], lambda[FRAME_FEC_B + 1] = { 1 }, prev[FRAME_FEC_B + 1] = { 1 }, omega[FRAME_FEC_B];
+  uint8_t positions[FRAME_FEC_B / 2], values[FRAME_FEC_B / 2], errors = 0, found = 0, order = 0, shift = 1, last = 1;
+
+  // S_j = code(a^j)
+  for(uint8_t j = 0; j < FRAME_FEC_B; j++){
+    uint8_t s = 0;
+
+    for(size_t i = 0; i < length; i++)
+      s = (s ? t->exp[t->log[s] + j] : 0) ^ code[i];
+    syndromes[j] = s;
+    errors |= s;
+  }
+  if(!errors)
+    return 0;
+
+  // Berlekamp-Massey, lambda is the error locator
+  for(uint8_t r = 0; r < FRAME_FEC_B; r++){
+    uint8_t d = syndromes[r], keep[FRAME_FEC_B + 1];
+
+    for(uint8_t i = 1; i <= order; i++)
+      d ^= gf_mul(t, lambda[i], syndromes[r - i]);
+    if(!d){
+      shift++;
+      continue;
+    }
+
+    uint8_t scale = gf_div(t, d, last);
+    memcpy(keep, lambda, sizeof(keep));
+    for(uint8_t i = 0; i + shift <= FRAME_FEC_B; i++)
+      lambda[i + shift] ^= gf_mul(t, scale, prev[i]);
+
+    if(2 * order <= r){
+      order = r + 1 - order;
+      memcpy(prev, keep, sizeof(prev));
+      last = d;
+      shift = 1;
+    }
+    else
+      shift++;
+  }
+  if(order > FRAME_FEC_B / 2)
+    return -1;
+
+  // Chien search, byte i stands for x^(length - 1 - i) and is wrong when lambda(a^-(length - 1 - i)) = 0
+  for(size_t i = 0; i < length && found <= order; i++){
+    uint8_t inv = (255 - (length - 1 - i) % 255) % 255, sum = 0;
+
+    for(uint8_t k = 0; k <= order; k++)
+      if(lambda[k]) sum ^= t->exp[(t->log[lambda[k]] + (uint32_t)inv * k) % 255];
+    if(!sum){
+      if(found == order) return -1;
+      positions[found++] = i;
+    }
+  }
+  if(found != order)
+    return -1;
+
+  // Forney, omega = syndromes * lambda mod x^FRAME_FEC_B
+  for(uint8_t k = 0; k < FRAME_FEC_B; k++){
+    omega[k] = 0;
+    for(uint8_t i = 0; i <= k && i <= order; i++)
+      omega[k] ^= gf_mul(t, lambda[i], syndromes[k - i]);
+  }
+  for(uint8_t e = 0; e < found; e++){
+    uint8_t power = (length - 1 - positions[e]) % 255, inv = (255 - power) % 255, num = 0, den = 0;
+
+    for(uint8_t k = 0; k < FRAME_FEC_B; k++)
+      if(omega[k]) num ^= t->exp[(t->log[omega[k]] + (uint32_t)inv * k) % 255];
+    for(uint8_t k = 1; k <= order; k += 2) // formal derivative, only the odd terms survive
+      if(lambda[k]) den ^= t->exp[(t->log[lambda[k]] + (uint32_t)inv * (k - 1)) % 255];
+    if(!den)
+      return -1;
+    values[e] = gf_mul(t, t->exp[power], gf_div(t, num, den));
+  }
+
+  for(uint8_t e = 0; e < found; e++)
+    code[positions[e]] ^= values[e];
+  return found;
+}
+
+/**
+* Fills the trailer in the last FRAME_TRAILER_B bytes of frame, after
+* everything in front of it is final.
+*/
+inline void frame_seal(uint8_t *frame, size_t size){
+  size_t body = size - FRAME_TRAILER_B;
+  uint32_t crc = frame_crc32(frame, body);
+
+  frame[body] = crc & 0xFF;
+  frame[body + 1] = (crc >> 8) & 0xFF;
+  frame[body + 2] = (crc >> 16) & 0xFF;
+  frame[body + 3] = crc >> 24;
+  if(FRAME_FEC_B)
+    rs_encode(frame, size - FRAME_FEC_B, frame + size - FRAME_FEC_B);
+}
+
+inline uint8_t frame_crc_ok(const uint8_t *frame, size_t size){
+  size_t body = size - FRAME_TRAILER_B;
+
+  return frame_crc32(frame, body) == ((uint32_t)frame[body] | ((uint32_t)frame[body + 1] << 8)
+                                      | ((uint32_t)frame[body + 2] << 16) | ((uint32_t)frame[body + 3] << 24));
+}
+
+/**
+* Checks a received frame and corrects it in place where the parity allows.
+* Returns the number of bytes corrected, 0 for a clean frame, or -1 when the
+* frame is corrupt beyond repair and may have been changed on the way.
+*/
+inline int frame_check(uint8_t *frame, size_t size){
+  int corrected;
+
+  if(frame_crc_ok(frame, size))
+    return 0;
+  if(!FRAME_FEC_B || (corrected = rs_decode(frame, size)) <= 0)
+    return -1;
+  return frame_crc_ok(frame, size) ? corrected : -1;
+}
+
+#endif
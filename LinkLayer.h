@@ -0,0 +1,319 @@
+#ifndef LINK_LAYER_H
+#define LINK_LAYER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <Airtime.h>
+
+/*
+* Selective repeat ARQ over E22 fixed transmission.
+*
+* Data packets carry their sequence number in PacketData.count, a session
+* byte picked at boot so the receiver can tell a restarted transmitter from
+* old duplicates, and LINK_FLAG_* bits. When LINK_FLAG_ACK_REQ is set the
+* receiver answers every data packet, duplicates included, with a ControlFrame
+* sent back to PacketData.src:
+*
+*   seq    every sequence number below it has been received (cumulative)
+*   bitmap bit i set when seq + i has been received, bit 0 is always clear
+*
+* CTRL_ACK when nothing is missing below the highest packet seen, CTRL_NACK
+* when there are holes, the transmitter then resends the holes right away
+* instead of waiting for its timeout. Because a transmitter keeps every packet
+* it sends within LINK_SEND_WINDOW of its oldest unacked one, the receiver can
+* count a hole as a gap as soon as a packet that far past it shows up.
+*
+* Bursts: a transmitter with more packets ready writes the next one into the
+* module while the previous one is still on air. Every packet but the last of
+* such a burst carries LINK_FLAG_MORE and the receiver holds its ack until the
+* last one, a half duplex transmitter would not hear it anyway; the window
+* fits in the E22's buffer, so a burst never has to wait for room.
+*
+* Adaptive link: every packet reports the air rate and power it was sent with
+* in its flags, the receiver keeps an RSSI average normalised to full power
+* plus a loss estimate (retransmissions and gaps), and asks for a faster rate
+* or lower power through LINK_ARG_* in its acks when the margin allows. The
+* receiver changes its own rate right after the ack that carries the switch;
+* if that ack is lost both ends fall back to their boot rate on silence.
+* While off the boot rate the receiver also sends a beacon on the boot rate
+* every minute or so, a node that boots later hears it and moves to the rate
+* in its args[0].
+*
+* Slotted access: the receiver broadcasts a CTRL_BEACON at the start of every
+* superframe and hands each node a slot in LINK_ARG_SLOT of its acks. The end
+* of the beacon on air is the time reference on both sides, so a node's clock
+* only has to hold for one superframe; a node only sends in a superframe whose
+* beacon it heard, a late or lost beacon costs it that slot rather than
+* risking a collision with it. After the beacon and TDMA_GUARD_MS comes
+* the join slot, shared by nodes that have no slot yet, then the assigned
+* slots, each long enough for one packet and its ack:
+*
+*   | beacon | guard | join | slot 0 | slot 1 | ... | slot n-1 | idle |
+*
+*   seq    superframe length, ms
+*   bitmap TDMA_BEACON_BITMAP(slot length in ms, number of slots)
+*   args[0] receiver's air rate, a node that heard it on another rate follows
+*/
+
+#define LINK_FLAG_ACK_REQ 0x01 // reliable mode, answer with a ControlFrame
+#define LINK_FLAG_RETX 0x02 // this is a retransmission
+#define LINK_FLAG_MORE 0x80 // another packet follows right behind, ack that one
+#define LINK_FLAG_POWER(flags) (((flags) >> 2) & 0x03) // OPTION.transmissionPower the packet was sent with
+#define LINK_FLAG_RATE(flags) (((flags) >> 4) & 0x07) // SPED.airDataRate the packet was sent with
+#define LINK_FLAGS_LINK(rate, power) ((((rate) & 0x07) << 4) | (((power) & 0x03) << 2))
+
+#define CTRL_MAGIC 0xC7
+#define CTRL_ACK 1
+#define CTRL_NACK 2
+#define CTRL_BEACON 3
+
+// args of an ACK/NACK, rate and power the node switches to and its TDMA slot
+#define LINK_ARG_SET 0x80
+#define LINK_ARG_RATE 0
+#define LINK_ARG_POWER 1
+#define LINK_ARG_SLOT 2
+
+#define LINK_WINDOW 32 // sequence numbers tracked past the cumulative ack, bits in the bitmap
+#define LINK_SEND_WINDOW 4 // a transmitter never sends seq >= its oldest unacked + this
+
+typedef struct _control_frame{
+  uint8_t magic;
+  uint8_t type;
+  uint16_t src; // address of the sender
+  uint32_t seq;
+  uint32_t bitmap;
+  uint8_t session; // echoes the data packet's session
+  uint8_t args[3]; // type specific
+}ControlFrame;
+
+#define CONTROL_FRAME_SIZE_B sizeof(ControlFrame)
+
+#define LINK_RX_NEW 0
+#define LINK_RX_DUPLICATE 1
+
+// receive window for one transmitter
+typedef struct _link_rx_state{
+  uint8_t active;
+  uint8_t session;
+  uint32_t expected; // lowest sequence number not yet received
+  uint32_t bitmap; // bit i: expected + i received
+  uint32_t gaps; // sequence numbers given up on
+  uint32_t duplicates;
+  uint32_t recovered; // retransmissions that filled a hole
+}LinkRxState;
+
+inline uint8_t link_popcount(uint32_t bits){
+  uint8_t n = 0;
+  for(; bits; bits &= bits - 1) n++;
+  return n;
+}
+
+// moves expected up to seq, counting the holes passed over as gaps
+inline void link_rx_slide(LinkRxState *st, uint32_t seq){
+  if(seq - st->expected >= 2 * LINK_WINDOW){
+    st->gaps += (seq - st->expected) - link_popcount(st->bitmap);
+    st->expected = seq;
+    st->bitmap = 0;
+    return;
+  }
+  while(st->expected != seq){
+    if(!(st->bitmap & 1)) st->gaps++;
+    st->bitmap >>= 1;
+    st->expected++;
+  }
+}
+
+/**
+* Records sequence number seq from a transmitter. Returns LINK_RX_DUPLICATE
+* when it was already received, the caller drops it but still acks. Without
+* LINK_FLAG_ACK_REQ nothing will be resent, so holes count as gaps at once.
+*/
+inline uint8_t link_rx_accept(LinkRxState *st, uint32_t seq, uint8_t session, uint8_t flags){
+  uint32_t d;
+
+  if(!st->active || st->session != session){
+    st->active = 1;
+    st->session = session;
+    st->expected = seq;
+    st->bitmap = 0;
+  }
+
+  d = seq - st->expected;
+  if(d >= 0x80000000UL){ // behind the window
+    st->duplicates++;
+    return LINK_RX_DUPLICATE;
+  }
+
+  if(!(flags & LINK_FLAG_ACK_REQ)) link_rx_slide(st, seq);
+  else if(d >= LINK_SEND_WINDOW) link_rx_slide(st, seq - LINK_SEND_WINDOW + 1); // transmitter gave up on the oldest
+
+  d = seq - st->expected;
+  if(st->bitmap & (1UL << d)){
+    st->duplicates++;
+    return LINK_RX_DUPLICATE;
+  }
+  if(flags & LINK_FLAG_RETX) st->recovered++;
+
+  st->bitmap |= 1UL << d;
+  while(st->bitmap & 1){
+    st->bitmap >>= 1;
+    st->expected++;
+  }
+  return LINK_RX_NEW;
+}
+
+inline void link_make_ack(const LinkRxState *st, ControlFrame *ack, uint16_t src){
+  memset((void *)ack, 0, CONTROL_FRAME_SIZE_B);
+  ack->magic = CTRL_MAGIC;
+  ack->type = st->bitmap ? CTRL_NACK : CTRL_ACK;
+  ack->src = src;
+  ack->seq = st->expected;
+  ack->bitmap = st->bitmap;
+  ack->session = st->session;
+}
+
+// whether a ControlFrame acknowledges sequence number seq
+inline uint8_t link_acked(const ControlFrame *ack, uint32_t seq){
+  uint32_t d = seq - ack->seq;
+
+  if(d >= 0x80000000UL) return 1;
+  return d < LINK_WINDOW && (ack->bitmap & (1UL << d));
+}
+
+// whether seq is a hole below the highest sequence number the receiver has seen
+inline uint8_t link_missing(const ControlFrame *ack, uint32_t seq){
+  uint32_t d = seq - ack->seq;
+
+  if(d >= LINK_WINDOW || link_acked(ack, seq)) return 0;
+  return (ack->bitmap >> d) != 0;
+}
+
+#define LINK_RATES 8
+#define LINK_POWERS 4
+#define LINK_MARGIN_DB 8 // fade margin kept above sensitivity
+#define LINK_HYSTERESIS_DB 4 // extra margin needed to go faster or quieter
+#define LINK_LOSS_TARGET_PCT 5
+#define LINK_ADAPT_MIN_SAMPLES 8 // packets since the last switch before deciding again
+#define LINK_CEILING_HOLD 64 // packets a rate that failed on loss stays off limits
+
+// per SPED.airDataRate, roughly the E22-900T22 datasheet, ~3 dB per doubling
+static const int16_t link_sensitivity_dbm[LINK_RATES] = { -147, -142, -139, -136, -133, -130, -127, -124 };
+// per OPTION.transmissionPower
+static const int8_t link_power_dbm[LINK_POWERS] = { 22, 17, 13, 10 };
+
+// the E22 RSSI byte is 256 + dBm
+inline int16_t link_rssi_dbm(uint8_t rssi){ return (int16_t)rssi - 256; }
+
+// on air time of a frame in 240 byte sub-packets (SPS_240_00), rounded up
+inline uint32_t link_airtime_ms(uint16_t bytes, uint8_t rate){ return (airtime_us(bytes, rate, airtime_sub_packet_b[0]) + 999) / 1000; }
+
+typedef struct _link_adapt{
+  int16_t rssi_q4; // average RSSI as if sent at full power, dBm * 16
+  uint8_t samples; // packets since the last switch
+  uint8_t lost; // retransmissions and gaps since the last switch
+  uint8_t want_power; // power last asked for
+  uint8_t ceiling; // fastest rate allowed while ceiling_hold runs
+  uint8_t ceiling_hold;
+}LinkAdapt;
+
+inline void link_adapt_reset(LinkAdapt *la, uint8_t power){
+  la->samples = 0;
+  la->lost = 0;
+  la->want_power = power;
+}
+
+/**
+* Adds one received packet, lost counts the transmissions it took beyond the
+* first plus any new gaps.
+*/
+inline void link_adapt_sample(LinkAdapt *la, uint8_t rssi, uint8_t power, uint8_t lost){
+  int16_t full = (link_rssi_dbm(rssi) + link_power_dbm[0] - link_power_dbm[power & 0x03]) * 16;
+
+  la->rssi_q4 = la->samples ? la->rssi_q4 + (full - la->rssi_q4) / 4 : full;
+  if(la->samples < 255) la->samples++;
+  la->lost = la->lost + lost < 255 ? la->lost + lost : 255;
+  if(la->ceiling_hold) la->ceiling_hold--;
+}
+
+// margin left at rate when sending with power
+inline int16_t link_margin_db(const LinkAdapt *la, uint8_t rate, uint8_t power){
+  return la->rssi_q4 / 16 - (link_power_dbm[0] - link_power_dbm[power]) - link_sensitivity_dbm[rate];
+}
+
+/**
+* Picks the next air rate and power from the samples since the last switch.
+* Loss over target first buys back power, then a slower rate; otherwise the
+* rate moves one step and the power goes as low as the margin allows. Without
+* adapt_rate only the power changes. Returns 1 when rate or power changed.
+*/
+inline uint8_t link_adapt_choose(LinkAdapt *la, uint8_t *rate, uint8_t *power, uint8_t adapt_rate){
+  uint8_t r = *rate, p = *power;
+
+  if(la->samples < LINK_ADAPT_MIN_SAMPLES) return 0;
+
+  if((uint16_t)la->lost * 100 > (uint16_t)LINK_LOSS_TARGET_PCT * la->samples){
+    if(p) p = 0;
+    else if(adapt_rate && r){
+      la->ceiling = --r;
+      la->ceiling_hold = LINK_CEILING_HOLD;
+    }
+  }
+  else{
+    if(adapt_rate){
+      if(r + 1 < LINK_RATES && (!la->ceiling_hold || r + 1 <= la->ceiling) && link_margin_db(la, r + 1, 0) >= LINK_MARGIN_DB + LINK_HYSTERESIS_DB) r++;
+      else if(r && link_margin_db(la, r, 0) < LINK_MARGIN_DB) r--;
+    }
+
+    if(p + 1 < LINK_POWERS && link_margin_db(la, r, p + 1) >= LINK_MARGIN_DB + LINK_HYSTERESIS_DB) p++;
+    while(p && link_margin_db(la, r, p) < LINK_MARGIN_DB) p--;
+  }
+
+  la->samples = 0;
+  la->lost = 0;
+  if(r == *rate && p == *power) return 0;
+
+  *rate = r;
+  *power = p;
+  la->want_power = p;
+  return 1;
+}
+
+#define TDMA_MAX_SLOTS 64 // nodes past this share the join slot
+#define TDMA_GUARD_MS 60 // per slot, clock drift, task latency and the receiver's turnaround
+#define TDMA_FRAME_MIN_MS 10000 // superframes are stretched to this, fewer beacons with few nodes
+#define TDMA_SYNC_FRAMES 3 // superframes a node keeps its schedule without hearing a beacon
+#define TDMA_BEACON_BITMAP(slot_ms, slots) (((uint32_t)(slots) << 16) | ((slot_ms) & 0xFFFF))
+#define TDMA_BEACON_SLOT_MS(bitmap) ((uint16_t)((bitmap) & 0xFFFF))
+#define TDMA_BEACON_SLOTS(bitmap) ((uint16_t)((bitmap) >> 16))
+#define TDMA_JOIN_SLOT 0x7F // fits LINK_ARG_SLOT, an ack with it tells the node it has no slot
+#define TDMA_FRAME_OVERHEAD_B 12 // the module's own header per frame, a guess on top of the LoRa preamble and header
+
+// time to move bytes over an 8N1 UART
+inline uint32_t link_uart_ms(uint16_t bytes, uint32_t bps){ return ((uint32_t)bytes * 10 * 1000 + bps - 1) / bps; }
+
+// one packet of packet_b bytes into the node's module, on air, out of the receiver's, then the ack back
+inline uint32_t tdma_slot_ms(uint16_t packet_b, uint8_t rate, uint32_t uart_bps){
+  return link_uart_ms(3 + packet_b, uart_bps) + link_airtime_ms(packet_b + TDMA_FRAME_OVERHEAD_B, rate) + link_uart_ms(packet_b + 1, uart_bps)
+       + link_uart_ms(3 + CONTROL_FRAME_SIZE_B, uart_bps) + link_airtime_ms(CONTROL_FRAME_SIZE_B + TDMA_FRAME_OVERHEAD_B, rate) + link_uart_ms(CONTROL_FRAME_SIZE_B + 1, uart_bps)
+       + TDMA_GUARD_MS;
+}
+
+// sending a beacon, UART in and air, the next superframe's beacon starts this long before its end
+inline uint32_t tdma_beacon_ms(uint8_t rate, uint32_t uart_bps){
+  return link_uart_ms(3 + CONTROL_FRAME_SIZE_B, uart_bps) + link_airtime_ms(CONTROL_FRAME_SIZE_B + TDMA_FRAME_OVERHEAD_B, rate);
+}
+
+// start of a slot, or of the join slot, from the end of the beacon
+inline uint32_t tdma_slot_offset_ms(uint16_t slot_ms, uint8_t slot){
+  return TDMA_GUARD_MS + (slot == TDMA_JOIN_SLOT ? 0 : ((uint32_t)slot + 1) * slot_ms);
+}
+
+// end of one beacon to the end of the next
+inline uint32_t tdma_frame_ms(uint16_t slot_ms, uint8_t slots, uint32_t beacon_ms){
+  uint32_t used = tdma_slot_offset_ms(slot_ms, slots) + TDMA_GUARD_MS + beacon_ms; // slot n-1, then the next beacon
+
+  return used > TDMA_FRAME_MIN_MS ? used : TDMA_FRAME_MIN_MS;
+}
+
+#endif
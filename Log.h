@@ -0,0 +1,411 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+* Deferred logging. LOG_ERROR() .. LOG_DEBUG() take a printf format, which
+* must be a single string literal, and its arguments:
+*
+*   LOG_INFO("Link now rate: %u power: %u", rate, power);
+*
+* Levels above LOG_LEVEL compile to nothing, arguments are not evaluated.
+* An enabled call does not format anything: it copies the arguments, tagged
+* by type and varint packed, into a slot of a lock-free ring and returns. A
+* low priority task drains the ring to Serial, as text with LOG_BINARY 0, or
+* as frames that tools/log_decode.cpp turns back into text on the host:
+*
+*   0xA5 0x5A, length (u8), id (u32), ms (u32), level (u8), args..., xor of id..args (u8)
+*
+* id is the FNV-1a hash of the format string, the decoder finds the string by
+* hashing every LOG_*() format in the sources it is given. Each argument is a
+* tag byte and its value: LOG_ARG_INT zigzag varint, LOG_ARG_UINT varint,
+* LOG_ARG_FLOAT four bytes, LOG_ARG_STR a length byte and the bytes. Strings
+* and argument lists that do not fit in LOG_DATA_B are cut short. When the
+* ring is full new messages are dropped and counted.
+*/
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5 // also the E22 library's own prints, those block
+
+#ifndef LOG_LEVEL
+  #define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_SYNC0 0xA5
+#define LOG_SYNC1 0x5A
+#define LOG_HEADER_B 9 // id, ms, level
+#define LOG_DATA_B 44 // packed arguments per message
+#define LOG_STR_MAX_B 32 // longest string argument kept
+
+#define LOG_ARG_INT 1
+#define LOG_ARG_UINT 2
+#define LOG_ARG_FLOAT 3
+#define LOG_ARG_STR 4
+
+static const char *const log_level_names[] = { "NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+
+constexpr uint32_t log_hash(const char *s, uint32_t h = 2166136261u){
+  return *s ? log_hash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+// forces log_hash() to run at compile time
+template<uint32_t H> struct LogId { static const uint32_t value = H; };
+
+typedef struct _log_buf{
+  uint8_t *data;
+  uint8_t length;
+  uint8_t capacity;
+}LogBuf;
+
+inline void log_put_varint(LogBuf *b, uint8_t tag, uint64_t v){
+  uint8_t bytes[11], n = 0;
+
+  bytes[n++] = tag;
+  do{
+    bytes[n++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+    v >>= 7;
+  }while(v);
+
+  if(b->length + n > b->capacity) { b->capacity = b->length; return; } // no partial arguments, nor any after it
+  memcpy(b->data + b->length, bytes, n);
+  b->length += n;
+}
+
+inline void log_put_int(LogBuf *b, int64_t v){ log_put_varint(b, LOG_ARG_INT, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+inline void log_put_uint(LogBuf *b, uint64_t v){ log_put_varint(b, LOG_ARG_UINT, v); }
+
+inline void log_put_float(LogBuf *b, float v){
+  if(b->length + 5 > b->capacity) { b->capacity = b->length; return; }
+  b->data[b->length++] = LOG_ARG_FLOAT;
+  memcpy(b->data + b->length, &v, 4);
+  b->length += 4;
+}
+
+inline void log_put_str(LogBuf *b, const char *s){
+  size_t n = s ? strlen(s) : 0;
+
+  if(n > LOG_STR_MAX_B) n = LOG_STR_MAX_B;
+  if(b->length + 2 > b->capacity) { b->capacity = b->length; return; }
+  if(b->length + 2 + n > b->capacity) n = b->capacity - b->length - 2;
+
+  b->data[b->length++] = LOG_ARG_STR;
+  b->data[b->length++] = (uint8_t)n;
+  memcpy(b->data + b->length, s, n);
+  b->length += n;
+}
+
+inline void log_put(LogBuf *b, bool v){ log_put_uint(b, v); }
+inline void log_put(LogBuf *b, char v){ log_put_int(b, v); }
+inline void log_put(LogBuf *b, signed char v){ log_put_int(b, v); }
+inline void log_put(LogBuf *b, short v){ log_put_int(b, v); }
+inline void log_put(LogBuf *b, int v){ log_put_int(b, v); }
+inline void log_put(LogBuf *b, long v){ log_put_int(b, v); }
+inline void log_put(LogBuf *b, long long v){ log_put_int(b, v); }
+inline void log_put(LogBuf *b, unsigned char v){ log_put_uint(b, v); }
+inline void log_put(LogBuf *b, unsigned short v){ log_put_uint(b, v); }
+inline void log_put(LogBuf *b, unsigned int v){ log_put_uint(b, v); }
+inline void log_put(LogBuf *b, unsigned long v){ log_put_uint(b, v); }
+inline void log_put(LogBuf *b, unsigned long long v){ log_put_uint(b, v); }
+inline void log_put(LogBuf *b, float v){ log_put_float(b, v); }
+inline void log_put(LogBuf *b, double v){ log_put_float(b, (float)v); }
+inline void log_put(LogBuf *b, const char *v){ log_put_str(b, v); }
+template<typename T> inline void log_put(LogBuf *b, const T *v){ log_put_uint(b, (uintptr_t)v); }
+
+// anything with c_str(), Arduino's String
+template<typename T> inline auto log_put(LogBuf *b, const T &v) -> decltype(v.c_str(), void()){ log_put_str(b, v.c_str()); }
+
+inline void log_put_args(LogBuf *b){ (void)b; }
+
+template<typename T, typename... Args> inline void log_put_args(LogBuf *b, const T &first, const Args &... rest){
+  log_put(b, first);
+  log_put_args(b, rest...);
+}
+
+// one argument decoded from a message, for log_format()
+typedef struct _log_arg{
+  uint8_t tag;
+  int64_t i;
+  uint64_t u;
+  float f;
+  char s[LOG_STR_MAX_B + 1];
+}LogArg;
+
+// reads the argument at *pos, 0 at the end or on a malformed one
+inline uint8_t log_get_arg(const uint8_t *data, uint8_t length, uint8_t *pos, LogArg *arg){
+  uint64_t v = 0;
+  uint8_t shift = 0, n;
+
+  if(*pos >= length) return 0;
+  arg->tag = data[(*pos)++];
+
+  switch(arg->tag){
+    case LOG_ARG_INT:
+    case LOG_ARG_UINT:
+      do{
+        if(*pos >= length || shift > 63) return 0;
+        v |= (uint64_t)(data[*pos] & 0x7F) << shift;
+        shift += 7;
+      }while(data[(*pos)++] & 0x80);
+      arg->u = v;
+      arg->i = arg->tag == LOG_ARG_INT ? (int64_t)(v >> 1) ^ -(int64_t)(v & 1) : (int64_t)v;
+      if(arg->tag == LOG_ARG_INT) arg->u = (uint64_t)arg->i;
+      arg->f = arg->tag == LOG_ARG_INT ? (float)arg->i : (float)arg->u;
+      return 1;
+    case LOG_ARG_FLOAT:
+      if(*pos + 4 > length) return 0;
+      memcpy(&arg->f, data + *pos, 4);
+      *pos += 4;
+      arg->i = (int64_t)arg->f;
+      arg->u = (uint64_t)arg->i;
+      return 1;
+    case LOG_ARG_STR:
+      if(*pos >= length || *pos + 1 + data[*pos] > length) return 0;
+      n = data[(*pos)++];
+      memcpy(arg->s, data + *pos, n);
+      arg->s[n] = 0;
+      *pos += n;
+      return 1;
+  }
+  return 0;
+}
+
+/**
+* printf for a packed message, the conversion decides how an argument is
+* shown and length modifiers are ignored, so %d, %ld and %lu all take any
+* integer. A string where a number is expected is printed as is, missing
+* arguments as "?". Returns the length written, always terminated.
+*/
+inline size_t log_format(const char *fmt, const uint8_t *data, uint8_t length, char *out, size_t capacity){
+  size_t n = 0;
+  uint8_t pos = 0;
+  LogArg arg;
+
+  if(!capacity) return 0;
+
+  while(*fmt && n + 1 < capacity){
+    char spec[16];
+    uint8_t k = 0;
+    int w;
+
+    if(*fmt != '%' || fmt[1] == '%'){
+      out[n++] = *fmt;
+      fmt += *fmt == '%' ? 2 : 1;
+      continue;
+    }
+
+    spec[k++] = *fmt++;
+    while(*fmt && strchr("-+ #0123456789.", *fmt) && k < sizeof(spec) - 4) spec[k++] = *fmt++;
+    while(*fmt && strchr("hlLzjt", *fmt)) fmt++;
+    if(!*fmt) break;
+
+    if(!log_get_arg(data, length, &pos, &arg))
+      w = snprintf(out + n, capacity - n, "?");
+    else if(arg.tag == LOG_ARG_STR || *fmt == 's'){
+      if(arg.tag == LOG_ARG_FLOAT) snprintf(arg.s, sizeof(arg.s), "%g", (double)arg.f);
+      else if(arg.tag == LOG_ARG_INT) snprintf(arg.s, sizeof(arg.s), "%lld", (long long)arg.i);
+      else if(arg.tag == LOG_ARG_UINT) snprintf(arg.s, sizeof(arg.s), "%llu", (unsigned long long)arg.u);
+      spec[k++] = 's'; spec[k] = 0;
+      w = snprintf(out + n, capacity - n, spec, arg.s);
+    }
+    else if(strchr("feEgGaA", *fmt)){
+      spec[k++] = *fmt; spec[k] = 0;
+      w = snprintf(out + n, capacity - n, spec, (double)arg.f);
+    }
+    else if(strchr("di", *fmt)){
+      spec[k++] = 'l'; spec[k++] = 'l'; spec[k++] = 'd'; spec[k] = 0;
+      w = snprintf(out + n, capacity - n, spec, (long long)arg.i);
+    }
+    else if(*fmt == 'c'){
+      spec[k++] = 'c'; spec[k] = 0;
+      w = snprintf(out + n, capacity - n, spec, (int)(arg.u & 0x7F));
+    }
+    else{
+      spec[k++] = 'l'; spec[k++] = 'l'; spec[k++] = *fmt == 'p' ? 'x' : *fmt; spec[k] = 0;
+      w = snprintf(out + n, capacity - n, spec, (unsigned long long)arg.u);
+    }
+    fmt++;
+
+    if(w < 0) break;
+    n += (size_t)w < capacity - n ? (size_t)w : capacity - n - 1;
+  }
+
+  out[n] = 0;
+  return n;
+}
+
+#ifndef LOG_NO_RUNTIME
+
+#include <Arduino.h>
+#include <atomic>
+
+#ifndef LOG_BINARY
+  #ifdef HOST_SIM
+    #define LOG_BINARY 0 // the sim's output is read as it runs
+  #else
+    #define LOG_BINARY 1
+  #endif
+#endif
+
+#define LOG_RING_SLOTS 64 // power of two
+#define LOG_TASK_STACK_B 3072
+#define LOG_TASK_PRIORITY tskIDLE_PRIORITY // only runs when nothing else has work
+#ifndef LOG_TASK_CORE
+  #define LOG_TASK_CORE 1
+#endif
+#define LOG_TEXT_MAX_B 192
+const long LOG_DRAIN_MS = 20;
+
+/*
+* Bounded MPMC queue (Vyukov): a slot's seq says whose turn it is, producers
+* claim slots with a CAS on head, so any task, or an ISR, can log without a
+* lock and without blocking.
+*/
+typedef struct _log_slot{
+  std::atomic<uint32_t> seq;
+  const char *fmt;
+  uint32_t id;
+  uint32_t ms;
+  uint8_t level;
+  uint8_t length;
+  uint8_t data[LOG_DATA_B];
+}LogSlot;
+
+typedef struct _log_ring{
+  LogSlot slots[LOG_RING_SLOTS];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> dropped;
+}LogRing;
+
+inline LogRing *log_ring(){
+  static LogRing ring;
+  static bool ready = false;
+
+  if(!ready){ // setupLog() runs this before any other task exists
+    for(uint32_t i = 0; i < LOG_RING_SLOTS; i++) ring.slots[i].seq.store(i, std::memory_order_relaxed);
+    ready = true;
+  }
+  return &ring;
+}
+
+inline LogSlot *log_claim(uint32_t *pos){
+  LogRing *ring = log_ring();
+
+  *pos = ring->head.load(std::memory_order_relaxed);
+  for(;;){
+    LogSlot *slot = &ring->slots[*pos & (LOG_RING_SLOTS - 1)];
+    int32_t dif = (int32_t)(slot->seq.load(std::memory_order_acquire) - *pos);
+
+    if(dif == 0){
+      if(ring->head.compare_exchange_weak(*pos, *pos + 1, std::memory_order_relaxed)) return slot;
+    }
+    else if(dif < 0){
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return NULL;
+    }
+    else
+      *pos = ring->head.load(std::memory_order_relaxed);
+  }
+}
+
+template<typename... Args> void log_write(uint8_t level, const char *fmt, uint32_t id, const Args &... args){
+  uint32_t pos;
+  LogSlot *slot = log_claim(&pos);
+  LogBuf b;
+
+  if(!slot) return;
+
+  b.data = slot->data; b.length = 0; b.capacity = LOG_DATA_B;
+  log_put_args(&b, args...);
+
+  slot->fmt = fmt;
+  slot->id = id;
+  slot->ms = millis();
+  slot->level = level;
+  slot->length = b.length;
+  slot->seq.store(pos + 1, std::memory_order_release); // the drain task may take it now
+}
+
+#define LOG_AT(level, fmt, ...) do{ if((level) <= LOG_LEVEL) log_write((level), fmt, LogId<log_hash(fmt)>::value, ##__VA_ARGS__); }while(0)
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOG_TRACE(fmt, ...) LOG_AT(LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+
+// writes one message to Serial, in the drain task only
+inline void log_emit(const LogSlot *slot){
+#if LOG_BINARY
+  uint8_t frame[3 + LOG_HEADER_B + LOG_DATA_B + 1], n = 0, check = 0;
+
+  frame[n++] = LOG_SYNC0;
+  frame[n++] = LOG_SYNC1;
+  frame[n++] = LOG_HEADER_B + slot->length;
+  memcpy(frame + n, &slot->id, 4); n += 4; // little endian on both the ESP32 and the host
+  memcpy(frame + n, &slot->ms, 4); n += 4;
+  frame[n++] = slot->level;
+  memcpy(frame + n, slot->data, slot->length); n += slot->length;
+  for(uint8_t i = 3; i < n; i++) check ^= frame[i];
+  frame[n++] = check;
+  Serial.write(frame, n);
+#else
+  char text[LOG_TEXT_MAX_B];
+
+  log_format(slot->fmt, slot->data, slot->length, text, sizeof(text));
+  Serial.printf("%lu %s %s\n", (unsigned long)slot->ms, log_level_names[slot->level], text);
+#endif
+}
+
+// takes the oldest message off the ring, 0 when empty
+inline uint8_t log_drain_one(){
+  LogRing *ring = log_ring();
+  uint32_t pos = ring->tail.load(std::memory_order_relaxed);
+  LogSlot *slot = &ring->slots[pos & (LOG_RING_SLOTS - 1)];
+
+  if(slot->seq.load(std::memory_order_acquire) != pos + 1)
+    return 0;
+
+  log_emit(slot);
+  ring->tail.store(pos + 1, std::memory_order_relaxed);
+  slot->seq.store(pos + LOG_RING_SLOTS, std::memory_order_release); // free for the producer one lap on
+  return 1;
+}
+
+// drains the ring from the caller, for a sketch that runs without the log task, before a deep sleep
+inline void log_flush(){
+  while(log_drain_one());
+  Serial.flush();
+}
+
+void log_task_code(void *params){
+  uint32_t reported = 0;
+
+  (void)params;
+  for(;;){
+    uint32_t dropped = log_ring()->dropped.load(std::memory_order_relaxed);
+
+    while(log_drain_one());
+    if(dropped != reported){
+      LOG_WARN("Log ring full, dropped: %lu", dropped - reported);
+      reported = dropped;
+    }
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+  }
+}
+
+// before anything logs from another task
+void setupLog(){
+  log_ring();
+  xTaskCreatePinnedToCore(log_task_code, "log", LOG_TASK_STACK_B, NULL, LOG_TASK_PRIORITY, NULL, LOG_TASK_CORE);
+}
+
+#endif // LOG_NO_RUNTIME
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef MESSAGE_CODEC_H
+#define MESSAGE_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+* Message codecs shared by the transmitter and the receiver.
+*
+* Every field of a Message is stored as a scaled fixed point int16_t. The
+* packet carries the codec id so the receiver can always decode what the
+* transmitter packed, whatever MESSAGE_CODEC each side was built with.
+*
+* CODEC_DELTA_VLB stores the zigzag encoded delta from the previous sample of
+* the same field behind a short prefix:
+*
+*   0                 delta == 0          1 bit
+*   10   + 3 bits     |zigzag| < 8        5 bits
+*   110  + 6 bits     |zigzag| < 64       9 bits
+*   1110 + 10 bits    |zigzag| < 1024    14 bits
+*   1111 + 16 bits    absolute value     20 bits
+*
+* The predictor starts at 0 at the beginning of each packet so every packet
+* decodes on its own.
+*/
+
+#define CODEC_RAW        0x00 // fixed point fields, 16 bits each
+#define CODEC_DELTA_VLB  0x01 // fixed point deltas, zigzag + variable length bits
+
+#ifndef MESSAGE_CODEC
+  #define MESSAGE_CODEC CODEC_DELTA_VLB
+#endif
+
+#define CODEC_MAX_FIELDS 4
+#define CODEC_FIELD_BITS 16
+#define CODEC_VLB_MAX_FIELD_BITS (4 + CODEC_FIELD_BITS)
+#define CODEC_MAX_BITS(fields) ((fields) * CODEC_VLB_MAX_FIELD_BITS) // worst case for any codec
+
+typedef struct _codec_state{
+  int16_t last[CODEC_MAX_FIELDS];
+}CodecState;
+
+typedef struct _bit_stream{
+  uint8_t *data;
+  uint16_t bit_index;
+  uint16_t bit_capacity;
+}BitStream;
+
+typedef struct _vlb_bucket{
+  uint8_t prefix;
+  uint8_t prefix_bits;
+  uint8_t value_bits;
+}VlbBucket;
+
+static const VlbBucket vlb_buckets[] = {
+  { 0x0, 1, 0 },
+  { 0x2, 2, 3 },
+  { 0x6, 3, 6 },
+  { 0xE, 4, 10 },
+  { 0xF, 4, CODEC_FIELD_BITS }, // escape, absolute value
+};
+
+#define VLB_BUCKET_COUNT (sizeof(vlb_buckets) / sizeof(VlbBucket))
+#define VLB_ESCAPE (VLB_BUCKET_COUNT - 1)
+
+inline int16_t codec_to_fixed(float value, int16_t scale){
+  float scaled = value * scale;
+  scaled += scaled < 0 ? -0.5f : 0.5f;
+
+  if(scaled > INT16_MAX) return INT16_MAX;
+  if(scaled < INT16_MIN) return INT16_MIN;
+
+  return (int16_t)scaled;
+}
+
+inline float codec_from_fixed(int16_t value, int16_t scale){ return (float)value / scale; }
+
+inline void codec_reset(CodecState *state){ memset((void *)state, 0, sizeof(CodecState)); }
+
+inline void bits_write(BitStream *stream, uint32_t value, uint8_t nbits){
+  while(nbits--){
+    uint8_t mask = 0x80 >> (stream->bit_index & 7);
+
+    if((value >> nbits) & 1)
+      stream->data[stream->bit_index >> 3] |= mask;
+    else
+      stream->data[stream->bit_index >> 3] &= ~mask;
+
+    stream->bit_index++;
+  }
+}
+
+inline uint8_t bits_read(BitStream *stream, uint8_t nbits, uint32_t *value){
+  if(stream->bit_index + nbits > stream->bit_capacity) return 0;
+
+  *value = 0;
+  while(nbits--){
+    *value = (*value << 1) | ((stream->data[stream->bit_index >> 3] >> (7 - (stream->bit_index & 7))) & 1);
+    stream->bit_index++;
+  }
+
+  return 1;
+}
+
+inline uint32_t zigzag_encode(int32_t value){ return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31); }
+
+inline int32_t zigzag_decode(uint32_t value){ return (int32_t)(value >> 1) ^ -(int32_t)(value & 1); }
+
+inline uint8_t vlb_bucket(uint32_t zigzag){
+  for(uint8_t i = 0; i < VLB_ESCAPE; i++)
+    if(zigzag < (1UL << vlb_buckets[i].value_bits))
+      return i;
+
+  return VLB_ESCAPE;
+}
+
+inline uint16_t codec_message_bits(uint8_t codec, const CodecState *state, const int16_t *fields, uint8_t nfields){
+  if(codec == CODEC_RAW) return nfields * CODEC_FIELD_BITS;
+
+  uint16_t bits = 0;
+  for(uint8_t i = 0; i < nfields; i++){
+    const VlbBucket *bucket = &vlb_buckets[vlb_bucket(zigzag_encode((int32_t)fields[i] - state->last[i]))];
+    bits += bucket->prefix_bits + bucket->value_bits;
+  }
+
+  return bits;
+}
+
+/**
+* Packs one message into the stream. Returns 0 and leaves the stream untouched
+* when the message does not fit.
+*/
+inline uint8_t codec_encode(uint8_t codec, CodecState *state, BitStream *stream, const int16_t *fields, uint8_t nfields){
+  if(nfields > CODEC_MAX_FIELDS) return 0;
+  if(stream->bit_index + codec_message_bits(codec, state, fields, nfields) > stream->bit_capacity) return 0;
+
+  for(uint8_t i = 0; i < nfields; i++){
+    if(codec == CODEC_RAW){
+      bits_write(stream, (uint16_t)fields[i], CODEC_FIELD_BITS);
+      continue;
+    }
+
+    uint32_t zigzag = zigzag_encode((int32_t)fields[i] - state->last[i]);
+    uint8_t b = vlb_bucket(zigzag);
+
+    bits_write(stream, vlb_buckets[b].prefix, vlb_buckets[b].prefix_bits);
+    bits_write(stream, b == VLB_ESCAPE ? (uint16_t)fields[i] : zigzag, vlb_buckets[b].value_bits);
+    state->last[i] = fields[i];
+  }
+
+  return 1;
+}
+
+/**
+* Unpacks one message from the stream. Returns 0 on a truncated or corrupt stream.
+*/
+inline uint8_t codec_decode(uint8_t codec, CodecState *state, BitStream *stream, int16_t *fields, uint8_t nfields){
+  uint32_t value;
+
+  if(nfields > CODEC_MAX_FIELDS) return 0;
+
+  for(uint8_t i = 0; i < nfields; i++){
+    if(codec == CODEC_RAW){
+      if(!bits_read(stream, CODEC_FIELD_BITS, &value)) return 0;
+      fields[i] = (int16_t)value;
+      continue;
+    }
+
+    if(codec != CODEC_DELTA_VLB) return 0;
+
+    uint8_t b = 0;
+    while(b < VLB_ESCAPE){
+      if(!bits_read(stream, 1, &value)) return 0;
+      if(!value) break;
+      b++;
+    }
+
+    if(!bits_read(stream, vlb_buckets[b].value_bits, &value)) return 0;
+
+    fields[i] = b == VLB_ESCAPE ? (int16_t)value : (int16_t)(state->last[i] + zigzag_decode(value));
+    state->last[i] = fields[i];
+  }
+
+  return 1;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifndef METRICS_NO_CLOCK
+  #include <Arduino.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+* Stage timing for the hot path. A stage that starts and ends in the same
+* task is timed with the CPU cycle counter, one register read; hand-offs
+* between tasks use esp_timer's microsecond clock, the two cores' cycle
+* counters are not in step. Latencies go into fixed log2 histograms that are
+* never reset, readers diff two snapshots for rates.
+*
+*   {"n":12,"avg":830,"p50":1023,"p99":2047,"max":1544,"b":[0,0,...,3,9]}
+*
+* avg and max are exact, percentiles are the upper edge of their bucket, b
+* stops at the highest bucket in use. Everything in us. Host tools define
+* METRICS_NO_CLOCK and time stages with their own clock.
+*/
+
+#define METRICS_BUCKETS 24 // bucket i holds [2^i, 2^(i+1)) us, the last one everything from ~8.4 s up
+#define METRICS_HIST_MAX_B (80 + METRICS_BUCKETS * 11) // one histogram as JSON
+
+typedef struct _latency_hist{
+  uint32_t buckets[METRICS_BUCKETS];
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t sum_us;
+}LatencyHist;
+
+#ifndef METRICS_NO_CLOCK
+
+inline uint32_t metrics_cycles(){ return ESP.getCycleCount(); }
+
+// cycles since start, only valid within one task and for less than a counter wrap (~17 s at 240 MHz)
+inline uint32_t metrics_cycles_us(uint32_t start){ return (metrics_cycles() - start) / ESP.getCpuFreqMHz(); }
+
+// shared by both cores, wraps after ~71 minutes which is fine for differences
+inline uint32_t metrics_now_us(){ return (uint32_t)esp_timer_get_time(); }
+
+#endif // METRICS_NO_CLOCK
+
+inline void hist_record(LatencyHist *h, uint32_t us){
+  uint8_t i = 0;
+
+  for(uint32_t v = us >> 1; v && i < METRICS_BUCKETS - 1; v >>= 1) i++;
+  h->buckets[i]++;
+  h->count++;
+  h->sum_us += us;
+  if(us > h->max_us) h->max_us = us;
+}
+
+// upper edge of the bucket holding the pct-th percentile, capped at the maximum seen
+inline uint32_t hist_percentile(const LatencyHist *h, uint8_t pct){
+  uint32_t rank = ((uint64_t)h->count * pct + 99) / 100, seen = 0;
+
+  for(uint8_t i = 0; i < METRICS_BUCKETS; i++){
+    seen += h->buckets[i];
+    if(seen >= rank && seen){
+      uint32_t edge = i < 31 ? (2UL << i) - 1 : 0xFFFFFFFFUL;
+      return edge < h->max_us ? edge : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+// appends "name":{...} to out, returns the new length or 0 when it does not fit
+inline size_t hist_format(const LatencyHist *h, const char *name, char *out, size_t length, size_t capacity){
+  int8_t top = METRICS_BUCKETS - 1;
+  int n;
+
+  while(top > 0 && !h->buckets[top]) top--;
+
+  n = snprintf(out + length, capacity - length, "\"%s\":{\"n\":%lu,\"avg\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu,\"b\":[",
+               name, (unsigned long)h->count, (unsigned long)(h->count ? h->sum_us / h->count : 0),
+               (unsigned long)hist_percentile(h, 50), (unsigned long)hist_percentile(h, 99), (unsigned long)h->max_us);
+  if(n < 0 || (size_t)n >= capacity - length) return 0;
+  length += n;
+
+  for(int8_t i = 0; i <= top; i++){
+    n = snprintf(out + length, capacity - length, i < top ? "%lu," : "%lu]}", (unsigned long)h->buckets[i]);
+    if(n < 0 || (size_t)n >= capacity - length) return 0;
+    length += n;
+  }
+  return length;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef NODE_TABLE_H
+#define NODE_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <LinkLayer.h>
+
+/*
+* Per node state on the gateway, keyed by the node's E22 address
+* (ADDH << 8 | ADDL). Open addressing with linear probing in a fixed array,
+* so lookups are O(1) on average and the footprint does not grow with the
+* number of nodes. The table stops at NODE_TABLE_MAX entries to keep probe
+* chains short; a new node then takes the place of the one heard least
+* recently, if that one has been silent for at least the expiry time.
+* Entries move when a node is evicted (backward shift), so pointers are only
+* valid until the next node_get().
+*/
+
+#define NODE_TABLE_BITS 8
+#define NODE_TABLE_SLOTS (1 << NODE_TABLE_BITS)
+#define NODE_TABLE_MAX (NODE_TABLE_SLOTS * 3 / 4)
+#define NODE_RSSI_HISTORY 8
+#define NODE_ADDR_EMPTY 0xFFFF // the broadcast address, never a node
+
+typedef struct _node_state{
+  uint16_t addr;
+  uint8_t rssi[NODE_RSSI_HISTORY]; // last RSSI bytes, oldest at rssi_head
+  uint8_t rssi_head;
+  uint32_t last_seen; // ms
+  uint32_t packets; // new packets passed on
+  LinkRxState link; // sequence window, gaps, duplicates
+  LinkAdapt adapt;
+  uint8_t slot; // TDMA slot + 1, 0 while it has none
+}NodeState;
+
+typedef struct _node_table{
+  NodeState slots[NODE_TABLE_SLOTS];
+  uint16_t count;
+  uint32_t evicted;
+  uint32_t refused; // nodes turned away while every entry was in use
+}NodeTable;
+
+// Fibonacci hashing, spreads consecutive addresses across the table
+inline uint16_t node_hash(uint16_t addr){ return (uint16_t)(addr * 40503u) >> (16 - NODE_TABLE_BITS); }
+
+inline void node_table_init(NodeTable *t){
+  memset((void *)t, 0, sizeof(NodeTable));
+  for(uint16_t i = 0; i < NODE_TABLE_SLOTS; i++)
+    t->slots[i].addr = NODE_ADDR_EMPTY;
+}
+
+inline NodeState *node_find(NodeTable *t, uint16_t addr){
+  for(uint16_t i = node_hash(addr);; i = (i + 1) & (NODE_TABLE_SLOTS - 1)){
+    if(t->slots[i].addr == addr) return &t->slots[i];
+    if(t->slots[i].addr == NODE_ADDR_EMPTY) return NULL;
+  }
+}
+
+// removes a node and shifts later members of its probe chain back into the hole
+inline void node_remove(NodeTable *t, NodeState *n){
+  uint16_t hole = n - t->slots;
+
+  for(uint16_t i = (hole + 1) & (NODE_TABLE_SLOTS - 1); t->slots[i].addr != NODE_ADDR_EMPTY; i = (i + 1) & (NODE_TABLE_SLOTS - 1)){
+    uint16_t home = node_hash(t->slots[i].addr);
+
+    // move it unless its home lies cyclically in (hole, i]
+    if(((i - home) & (NODE_TABLE_SLOTS - 1)) >= ((i - hole) & (NODE_TABLE_SLOTS - 1))){
+      t->slots[hole] = t->slots[i];
+      hole = i;
+    }
+  }
+
+  t->slots[hole].addr = NODE_ADDR_EMPTY;
+  t->count--;
+}
+
+/**
+* Finds the node or adds it. Returns NULL when the table is full and no node
+* has been silent for expire_ms.
+*/
+inline NodeState *node_get(NodeTable *t, uint16_t addr, uint32_t now, uint32_t expire_ms){
+  NodeState *n = node_find(t, addr);
+  uint16_t i;
+
+  if(n || addr == NODE_ADDR_EMPTY) return n;
+
+  if(t->count >= NODE_TABLE_MAX){
+    NodeState *oldest = NULL;
+
+    for(i = 0; i < NODE_TABLE_SLOTS; i++) // only runs when a new node shows up on a full table
+      if(t->slots[i].addr != NODE_ADDR_EMPTY && (!oldest || now - t->slots[i].last_seen > now - oldest->last_seen))
+        oldest = &t->slots[i];
+
+    if(!oldest || now - oldest->last_seen < expire_ms){
+      t->refused++;
+      return NULL;
+    }
+    node_remove(t, oldest);
+    t->evicted++;
+  }
+
+  for(i = node_hash(addr); t->slots[i].addr != NODE_ADDR_EMPTY; i = (i + 1) & (NODE_TABLE_SLOTS - 1));
+
+  n = &t->slots[i];
+  memset((void *)n, 0, sizeof(NodeState));
+  n->addr = addr;
+  n->last_seen = now;
+  link_adapt_reset(&n->adapt, 0); // nodes boot on full power
+  t->count++;
+  return n;
+}
+
+inline void node_rssi_push(NodeState *n, uint8_t rssi){
+  n->rssi[n->rssi_head] = rssi;
+  n->rssi_head = (n->rssi_head + 1) % NODE_RSSI_HISTORY;
+}
+
+#endif
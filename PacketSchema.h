@@ -0,0 +1,182 @@
+#ifndef PACKET_SCHEMA_H
+#define PACKET_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <FrameCheck.h>
+#include <MessageCodec.h>
+
+/*
+* The data packet as it goes over the air, one definition for the
+* transmitter and the receiver. A frame is a PacketData header, a payload of
+* messages packed by MessageCodec.h and the CRC and parity of FrameCheck.h:
+*
+*   schema (u8), count (u32), _msg_index (u8), codec (u8), _bit_index (u16),
+*   src (u16), flags (u8), session (u8), payload[PACKET_MAX_B - 13 - FRAME_TRAILER_B],
+*   trailer[FRAME_TRAILER_B]
+*
+* All of it is packed, so a frame is exactly PACKET_MAX_B bytes with no padding
+* and can be read straight out of a UART buffer. The sender seals the trailer
+* last with packet_seal(), the receiver runs packet_check() before it looks at
+* anything else. The static_asserts below pin the size and offset of every
+* field and the SCHEMA the layout belongs to, so moving, adding or resizing a
+* field fails to compile until the asserts and SCHEMA are updated together.
+* A field whose type changes to another of the same size passes, that still
+* needs the bump by hand. The receiver drops frames whose schema byte it does
+* not know, rather than decoding them into garbage.
+*
+* PacketFrame<MessageT, MaxBytes> sizes the payload for any message type with
+* a SCHEMA id and FIELDS count, so other message types can share the link in
+* frames of their own, told apart by the schema byte. Every frame of
+* PACKET_MAX_B ends in the trailer, whatever its schema.
+*/
+
+#define PACKET_MAX_B 235 // a frame in one 240 byte E22 sub-packet, with room for the fixed transmission address
+
+typedef struct _Message{
+  static const uint8_t SCHEMA = 2; // bump when the fields, their scales or PacketData change
+  static const uint8_t FIELDS = 2; // temperature, humidity
+
+  float temperature;
+  float humidity;
+}Message;
+
+typedef struct __attribute__((packed)) _packet_data{
+  uint8_t schema; // MessageT::SCHEMA, first so it can be checked before anything else
+  uint32_t count;
+  uint8_t _msg_index;
+  uint8_t codec;
+  uint16_t _bit_index;
+  uint16_t src; // ADDH << 8 | ADDL of the transmitter, the E22 does not report it
+  uint8_t flags; // LINK_FLAG_*
+  uint8_t session; // picked at boot, count restarts with it
+}PacketData;
+
+template<typename MessageT, size_t MaxBytes> struct __attribute__((packed)) PacketFrame{
+  static constexpr size_t PAYLOAD_B = MaxBytes - sizeof(PacketData) - FRAME_TRAILER_B;
+  static constexpr size_t RAW_COUNT = PAYLOAD_B / sizeof(MessageT); // messages that would fit as plain structs
+  static constexpr size_t MESSAGE_TARGET = RAW_COUNT * 4; // for the packed payload, packet_full() also stops when the bit budget runs out
+  static constexpr uint8_t SCHEMA = MessageT::SCHEMA;
+
+  static_assert(MaxBytes > sizeof(PacketData) + sizeof(MessageT) + FRAME_TRAILER_B, "no room for a message");
+  static_assert(MaxBytes <= FRAME_RS_MAX_B, "longer than one Reed-Solomon codeword");
+  static_assert(PAYLOAD_B * 8 <= UINT16_MAX, "_bit_index is 16 bits");
+  static_assert(MESSAGE_TARGET <= UINT8_MAX, "_msg_index is 8 bits");
+  static_assert(MessageT::FIELDS <= CODEC_MAX_FIELDS, "too many fields for the codec");
+
+  PacketData packetData;
+  uint8_t payload[PAYLOAD_B]; // messages packed by the codec in packetData.codec
+  uint8_t trailer[FRAME_TRAILER_B]; // CRC and parity, FrameCheck.h
+};
+
+typedef PacketFrame<Message, PACKET_MAX_B> Packet;
+
+static_assert(Message::SCHEMA == 2, "the asserts below describe schema 2, update them with it");
+static_assert(sizeof(PacketData) == 13, "PacketData changed, bump Message::SCHEMA and fix the layout above");
+static_assert(offsetof(PacketData, schema) == 0 && offsetof(PacketData, count) == 1 && offsetof(PacketData, _msg_index) == 5
+              && offsetof(PacketData, codec) == 6 && offsetof(PacketData, _bit_index) == 7 && offsetof(PacketData, src) == 9
+              && offsetof(PacketData, flags) == 11 && offsetof(PacketData, session) == 12,
+              "PacketData fields moved, bump Message::SCHEMA and fix the layout above");
+static_assert(sizeof(Message) == 8 && Message::FIELDS == 2, "Message changed, bump Message::SCHEMA");
+static_assert(offsetof(Message, temperature) == 0 && offsetof(Message, humidity) == 4, "Message fields moved, bump Message::SCHEMA");
+static_assert(sizeof(Packet) == PACKET_MAX_B, "Packet is not exactly PACKET_MAX_B");
+static_assert(offsetof(Packet, payload) == sizeof(PacketData), "padding between header and payload");
+static_assert(offsetof(Packet, trailer) == PACKET_MAX_B - FRAME_TRAILER_B, "the trailer has to end the frame");
+static_assert(alignof(Packet) == 1, "Packet must be readable from any byte buffer");
+
+#define PACKET_SCHEMA ((uint8_t)Packet::SCHEMA) // casts keep the class constants from being odr-used
+#define PACKET_SIZE_B sizeof(Packet)
+#define PACKETDATA_SIZE_B sizeof(PacketData)
+#define PACKET_PAYLOAD_SIZE_B ((size_t)Packet::PAYLOAD_B)
+#define MESSAGE_SIZE_B sizeof(Message)
+#define MESSAGE_FIELDS ((uint8_t)Message::FIELDS)
+#define RAW_MESSAGE_COUNT ((size_t)Packet::RAW_COUNT) // (235 - 13 - 12) / 8 = 26 messages as plain floats
+#define MESSAGE_COUNT ((size_t)Packet::MESSAGE_TARGET)
+#define MESSAGE_MAX_BITS CODEC_MAX_BITS(MESSAGE_FIELDS)
+
+#define TEMP_SCALE 10 // 0.1 C, DHT22 resolution
+#define HUM_SCALE 10 // 0.1 %
+
+static const int16_t message_scales[MESSAGE_FIELDS] = { TEMP_SCALE, HUM_SCALE };
+
+// every sample a fresh read: the DHT22 measures at most every 2 s, this leaves it room for jitter
+const long SENSOR_INTERVAL = 2500; // ms
+const long TX_INTERVAL = SENSOR_INTERVAL * MESSAGE_COUNT; // ms, a packet is full and sent this often at the latest
+
+inline uint8_t append_packet_message(Packet *packet, CodecState *state, Message msg){
+  int16_t fields[MESSAGE_FIELDS] = { codec_to_fixed(msg.temperature, TEMP_SCALE), codec_to_fixed(msg.humidity, HUM_SCALE) };
+  BitStream stream = { packet->payload, packet->packetData._bit_index, PACKET_PAYLOAD_SIZE_B * 8 };
+
+  if(!codec_encode(packet->packetData.codec, state, &stream, fields, MESSAGE_FIELDS))
+    return 0;
+
+  packet->packetData._bit_index = stream.bit_index;
+  packet->packetData._msg_index++;
+
+  return 1;
+}
+
+/**
+* Decodes the packed payload into fixed point fields, MESSAGE_FIELDS per
+* message. Returns how many messages were decoded.
+*/
+inline uint8_t unpack_packet_fields(const Packet *packet, int16_t *fields, uint8_t max){
+  CodecState state;
+  BitStream stream = { (uint8_t *)packet->payload, 0, packet->packetData._bit_index };
+  uint8_t i;
+
+  if(stream.bit_capacity > PACKET_PAYLOAD_SIZE_B * 8)
+    return 0;
+
+  codec_reset(&state);
+  for(i = 0; i < packet->packetData._msg_index && i < max; i++)
+    if(!codec_decode(packet->packetData.codec, &state, &stream, &fields[i * MESSAGE_FIELDS], MESSAGE_FIELDS))
+      break;
+
+  return i;
+}
+
+/**
+* Decodes the packed payload into messages, returns how many were decoded.
+*/
+inline uint8_t unpack_packet_messages(const Packet *packet, Message *messages, uint8_t max){
+  int16_t fields[MESSAGE_COUNT * MESSAGE_FIELDS];
+  uint8_t n = unpack_packet_fields(packet, fields, max < MESSAGE_COUNT ? max : MESSAGE_COUNT);
+
+  for(uint8_t i = 0; i < n; i++){
+    messages[i].temperature = codec_from_fixed(fields[i * MESSAGE_FIELDS], TEMP_SCALE);
+    messages[i].humidity = codec_from_fixed(fields[i * MESSAGE_FIELDS + 1], HUM_SCALE);
+  }
+
+  return n;
+}
+
+// full when the count target is hit or a worst case message might not fit
+inline uint8_t packet_full(const Packet *packet){
+  return packet->packetData._msg_index >= MESSAGE_COUNT || (size_t)packet->packetData._bit_index + MESSAGE_MAX_BITS > PACKET_PAYLOAD_SIZE_B * 8;
+}
+
+inline void clear_packet_messages(Packet *packet, CodecState *state){
+  memset((void *)&packet->payload, 0, PACKET_PAYLOAD_SIZE_B);
+  packet->packetData.schema = PACKET_SCHEMA;
+  packet->packetData._msg_index = 0;
+  packet->packetData._bit_index = 0;
+  packet->packetData.codec = MESSAGE_CODEC;
+  codec_reset(state);
+}
+
+// fills in the trailer, the last thing before the packet goes to the module
+inline void packet_seal(Packet *packet){ frame_seal((uint8_t *)packet, PACKET_SIZE_B); }
+
+// CRC and FEC on a received frame of any schema, see frame_check()
+inline int packet_check(Packet *packet){ return frame_check((uint8_t *)packet, PACKET_SIZE_B); }
+
+// header checks the receiver can do before decoding anything
+inline uint8_t packet_valid(const Packet *packet){
+  return packet->packetData.schema == PACKET_SCHEMA && packet->packetData._msg_index
+         && packet->packetData._bit_index <= PACKET_PAYLOAD_SIZE_B * 8;
+}
+
+#endif
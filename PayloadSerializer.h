@@ -0,0 +1,167 @@
+#ifndef PAYLOAD_SERIALIZER_H
+#define PAYLOAD_SERIALIZER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Streaming writer for MQTT payloads that batch several radio packets.
+*
+* Binary (PAYLOAD_FORMAT_BINARY), little endian:
+*   batch:  0xE2, version (u8), fields (u8), scale (i16) * fields, record...
+*   record: count (varint), rssi (u8), src (u16), messages (u8), value (i16) * fields * messages
+*
+* JSON (PAYLOAD_FORMAT_JSON):
+*   {"packets":[{"count":12,"rssi":200,"src":2,"m":[[21.5,40.2],...]},...]}
+*
+* Values are the fixed point fields straight from the codec, JSON prints them
+* scaled back without going through float formatting.
+*/
+
+#define PAYLOAD_FORMAT_BINARY 0
+#define PAYLOAD_FORMAT_JSON 1
+
+#define PAYLOAD_MAGIC 0xE2
+#define PAYLOAD_VERSION 1
+
+#define PAYLOAD_JSON_FIELD_MAX_B 12 // "-3276.8" plus separator, with room for a wider scale
+#define PAYLOAD_JSON_RECORD_MAX_B 64 // {"count":4294967295,"rssi":255,"src":65535,"m":[ ... ]},
+
+typedef struct _payload_writer{
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length;
+  uint8_t format;
+  uint8_t nfields;
+  const int16_t *scales;
+  uint8_t packets;
+}PayloadWriter;
+
+inline void payload_put(PayloadWriter *w, uint8_t byte){ w->buffer[w->length++] = byte; }
+
+inline void payload_put_str(PayloadWriter *w, const char *str){ while(*str) payload_put(w, (uint8_t)*str++); }
+
+inline void payload_put_u16(PayloadWriter *w, uint16_t value){
+  payload_put(w, value & 0xFF);
+  payload_put(w, value >> 8);
+}
+
+inline void payload_put_varint(PayloadWriter *w, uint32_t value){
+  while(value >= 0x80){
+    payload_put(w, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  payload_put(w, value);
+}
+
+inline void payload_put_uint(PayloadWriter *w, uint32_t value, uint8_t min_digits = 1){
+  char digits[10];
+  uint8_t n = 0;
+
+  do{
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  }while(value || n < min_digits);
+
+  while(n) payload_put(w, digits[--n]);
+}
+
+inline void payload_put_fixed(PayloadWriter *w, int32_t value, int32_t scale){
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+  uint8_t decimals = 0;
+
+  for(int32_t s = scale; s > 1; s /= 10) decimals++;
+
+  if(value < 0) payload_put(w, '-');
+  payload_put_uint(w, magnitude / scale);
+  if(decimals){
+    payload_put(w, '.');
+    payload_put_uint(w, magnitude % scale, decimals);
+  }
+}
+
+/**
+* Starts a new batch in buffer, writing the batch header.
+*/
+inline void payload_begin(PayloadWriter *w, uint8_t *buffer, size_t capacity, uint8_t format, uint8_t nfields, const int16_t *scales){
+  w->buffer = buffer;
+  w->capacity = capacity;
+  w->length = 0;
+  w->format = format;
+  w->nfields = nfields;
+  w->scales = scales;
+  w->packets = 0;
+
+  if(format == PAYLOAD_FORMAT_JSON){
+    payload_put_str(w, "{\"packets\":[");
+    return;
+  }
+
+  payload_put(w, PAYLOAD_MAGIC);
+  payload_put(w, PAYLOAD_VERSION);
+  payload_put(w, nfields);
+  for(uint8_t i = 0; i < nfields; i++)
+    payload_put_u16(w, (uint16_t)scales[i]);
+}
+
+inline void payload_reset(PayloadWriter *w){ payload_begin(w, w->buffer, w->capacity, w->format, w->nfields, w->scales); }
+
+// worst case bytes for a record, including the JSON batch trailer
+inline size_t payload_record_max(const PayloadWriter *w, uint8_t messages){
+  if(w->format == PAYLOAD_FORMAT_JSON)
+    return PAYLOAD_JSON_RECORD_MAX_B + (size_t)messages * (w->nfields * PAYLOAD_JSON_FIELD_MAX_B + 3) + 2;
+
+  return 5 + 1 + 2 + 1 + (size_t)messages * w->nfields * 2;
+}
+
+inline uint8_t payload_fits(const PayloadWriter *w, uint8_t messages){ return w->length + payload_record_max(w, messages) <= w->capacity; }
+
+/**
+* Appends one radio packet, fields holds messages * nfields values. Returns 0
+* when the record might not fit, flush the batch and try again.
+*/
+inline uint8_t payload_append_packet(PayloadWriter *w, uint32_t count, uint8_t rssi, uint16_t src, const int16_t *fields, uint8_t messages){
+  if(!payload_fits(w, messages)) return 0;
+
+  if(w->format == PAYLOAD_FORMAT_JSON){
+    if(w->packets) payload_put(w, ',');
+    payload_put_str(w, "{\"count\":"); payload_put_uint(w, count);
+    payload_put_str(w, ",\"rssi\":"); payload_put_uint(w, rssi);
+    payload_put_str(w, ",\"src\":"); payload_put_uint(w, src);
+    payload_put_str(w, ",\"m\":[");
+    for(uint8_t m = 0; m < messages; m++){
+      if(m) payload_put(w, ',');
+      payload_put(w, '[');
+      for(uint8_t f = 0; f < w->nfields; f++){
+        if(f) payload_put(w, ',');
+        payload_put_fixed(w, fields[m * w->nfields + f], w->scales[f]);
+      }
+      payload_put(w, ']');
+    }
+    payload_put_str(w, "]}");
+  }
+  else{
+    payload_put_varint(w, count);
+    payload_put(w, rssi);
+    payload_put_u16(w, src);
+    payload_put(w, messages);
+    for(uint16_t i = 0; i < (uint16_t)messages * w->nfields; i++)
+      payload_put_u16(w, (uint16_t)fields[i]);
+  }
+
+  w->packets++;
+  return 1;
+}
+
+/**
+* Closes the batch and returns the payload length. Call payload_reset() once
+* it has been published.
+*/
+inline size_t payload_finish(PayloadWriter *w){
+  if(w->format == PAYLOAD_FORMAT_JSON)
+    payload_put_str(w, "]}");
+
+  return w->length;
+}
+
+#endif
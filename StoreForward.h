@@ -0,0 +1,219 @@
+#ifndef STORE_FORWARD_H
+#define STORE_FORWARD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+* Append-only ring log of opaque records (MQTT batches) kept in a file, on
+* LittleFS through the ESP-IDF VFS on the gateway and a plain file on a host.
+*
+* Each record is an 8 byte header (magic, length, seq) followed by its bytes.
+* A record that would run past the end of the ring leaves a wrap marker and
+* starts again at offset 0. Only the read position is persisted, in a small
+* index file rewritten once per drained batch; the write position is found at
+* open by walking records forward from it while their seq keeps counting up.
+* When the ring is full the oldest records are dropped.
+*/
+
+#define SF_MAGIC 0x5346
+#define SF_WRAP 0xFFFF
+
+typedef struct _sf_header{
+  uint16_t magic;
+  uint16_t length;
+  uint32_t seq;
+}SfHeader;
+
+typedef struct _sf_index{
+  uint32_t read_off;
+  uint32_t read_seq;
+}SfIndex;
+
+typedef struct _store_forward{
+  FILE *file;
+  const char *index_path;
+  uint32_t capacity;
+  uint32_t read_off;
+  uint32_t read_seq;
+  uint32_t write_off;
+  uint32_t write_seq;
+  uint32_t dropped; // records lost to a full ring
+}StoreForward;
+
+#define SF_HEADER_B sizeof(SfHeader)
+
+inline uint8_t sf_read_header(StoreForward *sf, uint32_t offset, SfHeader *header){
+  if(offset + SF_HEADER_B > sf->capacity) return 0;
+  if(fseek(sf->file, offset, SEEK_SET)) return 0;
+  return fread(header, SF_HEADER_B, 1, sf->file) == 1;
+}
+
+inline uint8_t sf_write_at(StoreForward *sf, uint32_t offset, const void *data, size_t length){
+  if(fseek(sf->file, offset, SEEK_SET)) return 0;
+  return fwrite(data, 1, length, sf->file) == length;
+}
+
+inline uint32_t sf_pending(const StoreForward *sf){ return sf->write_seq - sf->read_seq; }
+
+inline uint8_t sf_empty(const StoreForward *sf){ return sf->write_seq == sf->read_seq; }
+
+/**
+* Moves the read position past the next record, following a wrap marker.
+* Returns the record's length, or -1 when the log is empty or corrupt.
+*/
+inline int32_t sf_skip(StoreForward *sf){
+  SfHeader header;
+
+  if(sf_empty(sf)) return -1;
+
+  if(!sf_read_header(sf, sf->read_off, &header) || (header.magic == SF_MAGIC && header.length == SF_WRAP && header.seq == sf->read_seq)){
+    sf->read_off = 0;
+    if(!sf_read_header(sf, 0, &header)) return -1;
+  }
+  if(header.magic != SF_MAGIC || header.seq != sf->read_seq || header.length == SF_WRAP) return -1;
+
+  sf->read_off += SF_HEADER_B + header.length;
+  sf->read_seq++;
+  return header.length;
+}
+
+/**
+* Persists the read position, call after a batch of sf_consume()/sf_skip().
+*/
+inline void sf_commit(StoreForward *sf){
+  SfIndex index = { sf->read_off, sf->read_seq };
+  FILE *file = fopen(sf->index_path, "wb");
+
+  if(!file) return;
+  fwrite(&index, sizeof(SfIndex), 1, file);
+  fclose(file);
+}
+
+/**
+* Opens or creates the log. Without an index the log starts empty.
+*/
+inline uint8_t sf_open(StoreForward *sf, const char *path, const char *index_path, uint32_t capacity){
+  SfIndex index = { 0, 0 };
+  FILE *file = fopen(index_path, "rb");
+  SfHeader header;
+
+  memset((void *)sf, 0, sizeof(StoreForward));
+  sf->index_path = index_path;
+  sf->capacity = capacity;
+
+  if(file){
+    if(fread(&index, sizeof(SfIndex), 1, file) != 1) memset(&index, 0, sizeof(SfIndex));
+    fclose(file);
+    sf->file = fopen(path, "r+b");
+  }
+  if(!sf->file){
+    sf->file = fopen(path, "w+b");
+    memset(&index, 0, sizeof(SfIndex));
+  }
+  if(!sf->file) return 0;
+
+  sf->read_off = sf->write_off = index.read_off < capacity ? index.read_off : 0;
+  sf->read_seq = sf->write_seq = index.read_seq;
+
+  // walk forward to find where the last run stopped writing
+  for(;;){
+    if(!sf_read_header(sf, sf->write_off, &header) || header.magic != SF_MAGIC || header.seq != sf->write_seq){
+      if(sf->write_off != 0 && sf_read_header(sf, 0, &header) && header.magic == SF_MAGIC && header.seq == sf->write_seq && header.length != SF_WRAP
+         && sf->write_off + SF_HEADER_B > sf->capacity){
+        sf->write_off = 0; // ran out of room for even a wrap marker
+        continue;
+      }
+      break;
+    }
+    if(header.length == SF_WRAP){
+      sf->write_off = 0;
+      continue;
+    }
+    sf->write_off += SF_HEADER_B + header.length;
+    sf->write_seq++;
+  }
+
+  if(sf_empty(sf)) sf->read_off = sf->write_off;
+  sf_commit(sf);
+  return 1;
+}
+
+/**
+* Copies the next record into buffer without consuming it. Returns its length,
+* or -1 when the log is empty, the record is larger than capacity or corrupt.
+*/
+inline int32_t sf_peek(StoreForward *sf, uint8_t *buffer, uint16_t capacity){
+  SfHeader header;
+  uint32_t offset = sf->read_off;
+
+  if(sf_empty(sf)) return -1;
+
+  if(!sf_read_header(sf, offset, &header) || (header.magic == SF_MAGIC && header.length == SF_WRAP && header.seq == sf->read_seq)){
+    offset = 0;
+    if(!sf_read_header(sf, offset, &header)) return -1;
+  }
+  if(header.magic != SF_MAGIC || header.seq != sf->read_seq || header.length > capacity) return -1;
+  if(fread(buffer, 1, header.length, sf->file) != header.length) return -1;
+
+  return header.length;
+}
+
+inline void sf_consume(StoreForward *sf){ sf_skip(sf); }
+
+// drops the oldest records until length more bytes fit at the write position
+inline uint8_t sf_make_room(StoreForward *sf, uint32_t length){
+  SfHeader marker = { SF_MAGIC, SF_WRAP, 0 };
+
+  if(length > sf->capacity / 2) return 0;
+
+  for(;;){
+    uint8_t full = !sf_empty(sf) && sf->write_off == sf->read_off;
+
+    if(!full && sf->write_off >= sf->read_off){
+      if(sf->capacity - sf->write_off >= length) return 1;
+
+      if(length <= sf->read_off || sf_empty(sf)){
+        if(sf->capacity - sf->write_off >= SF_HEADER_B){
+          marker.seq = sf->write_seq;
+          if(!sf_write_at(sf, sf->write_off, &marker, SF_HEADER_B)) return 0;
+        }
+        if(sf_empty(sf)) sf->read_off = 0;
+        sf->write_off = 0;
+        continue;
+      }
+    }
+    else if(!full && sf->read_off - sf->write_off >= length)
+      return 1;
+
+    if(sf_skip(sf) < 0){
+      // lost track of the oldest record, start over empty
+      sf->read_off = sf->write_off;
+      sf->read_seq = sf->write_seq;
+    }
+    sf->dropped++;
+  }
+}
+
+/**
+* Appends one record. Returns 0 if it could not be written.
+*/
+inline uint8_t sf_append(StoreForward *sf, const uint8_t *data, uint16_t length){
+  SfHeader header = { SF_MAGIC, length, 0 };
+  uint32_t dropped = sf->dropped;
+
+  if(!sf->file || length == SF_WRAP || !sf_make_room(sf, SF_HEADER_B + length)) return 0;
+
+  header.seq = sf->write_seq;
+  if(!sf_write_at(sf, sf->write_off, &header, SF_HEADER_B) || fwrite(data, 1, length, sf->file) != length) return 0;
+  fflush(sf->file);
+
+  sf->write_off += SF_HEADER_B + length;
+  sf->write_seq++;
+
+  if(sf->dropped != dropped) sf_commit(sf); // the read position moved
+  return 1;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef GATEWAY_MQTT_H
+#define GATEWAY_MQTT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+* Just enough MQTT 3.1.1 for the gateway: CONNECT with a clean session,
+* QoS 0 PUBLISH and PINGREQ, over a blocking TCP socket to a local broker.
+* Whatever the broker sends after the CONNACK, PINGRESP only, is read and
+* thrown away. Every call returns 0 once the connection is gone; the caller
+* closes it and connects again.
+*/
+
+#define MQTT_KEEPALIVE_S 30
+#define MQTT_CONNECT_TIMEOUT_MS 5000
+#define MQTT_HEADER_MAX_B 5 // type and up to four bytes of remaining length
+
+typedef struct _mqtt_conn{
+  int fd;
+  uint64_t last_sent_ms; // for the keepalive
+}MqttConn;
+
+inline size_t mqtt_put_length(uint8_t *out, size_t length){
+  size_t n = 0;
+
+  do{
+    out[n] = length & 0x7F;
+    length >>= 7;
+    if(length) out[n] |= 0x80;
+    n++;
+  }while(length);
+  return n;
+}
+
+inline uint8_t mqtt_write(MqttConn *c, struct iovec *iov, int count, uint64_t now_ms){
+  while(count){
+    ssize_t n = writev(c->fd, iov, count);
+
+    if(n <= 0) return 0;
+    while(count && (size_t)n >= iov->iov_len){
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if(count){
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  c->last_sent_ms = now_ms;
+  return 1;
+}
+
+inline uint8_t mqtt_wait(int fd, short events, int timeout_ms){
+  pollfd pfd = { fd, events, 0 };
+
+  return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & events);
+}
+
+inline void mqtt_close(MqttConn *c){
+  if(c->fd >= 0) close(c->fd);
+  c->fd = -1;
+}
+
+/**
+* Connects and waits for the CONNACK. Returns 1 when the broker accepted.
+*/
+inline uint8_t mqtt_connect(MqttConn *c, const char *host, uint16_t port, const char *client_id, uint64_t now_ms){
+  addrinfo hints, *res = NULL;
+  char service[8];
+  uint8_t header[MQTT_HEADER_MAX_B], variable[10] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, MQTT_KEEPALIVE_S }, id_length[2], ack[4];
+  size_t id_b = strlen(client_id), n;
+  int one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+  if(getaddrinfo(host, service, &hints, &res) || !res) return 0;
+
+  c->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if(c->fd < 0 || connect(c->fd, res->ai_addr, res->ai_addrlen) < 0){
+    freeaddrinfo(res);
+    mqtt_close(c);
+    return 0;
+  }
+  freeaddrinfo(res);
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  header[0] = 0x10;
+  n = 1 + mqtt_put_length(header + 1, sizeof(variable) + 2 + id_b);
+  id_length[0] = id_b >> 8;
+  id_length[1] = id_b & 0xFF;
+
+  struct iovec iov[4] = { { header, n }, { variable, sizeof(variable) }, { id_length, 2 }, { (void *)client_id, id_b } };
+  if(!mqtt_write(c, iov, 4, now_ms)
+     || !mqtt_wait(c->fd, POLLIN, MQTT_CONNECT_TIMEOUT_MS) || recv(c->fd, ack, sizeof(ack), MSG_WAITALL) != sizeof(ack)
+     || ack[0] != 0x20 || ack[3] != 0){
+    mqtt_close(c);
+    return 0;
+  }
+  return 1;
+}
+
+inline uint8_t mqtt_publish(MqttConn *c, const char *topic, const uint8_t *payload, size_t length, uint64_t now_ms){
+  uint8_t header[MQTT_HEADER_MAX_B], topic_length[2];
+  size_t topic_b = strlen(topic), n;
+
+  header[0] = 0x30;
+  n = 1 + mqtt_put_length(header + 1, 2 + topic_b + length);
+  topic_length[0] = topic_b >> 8;
+  topic_length[1] = topic_b & 0xFF;
+
+  struct iovec iov[4] = { { header, n }, { topic_length, 2 }, { (void *)topic, topic_b }, { (void *)payload, length } };
+  return mqtt_write(c, iov, 4, now_ms);
+}
+
+/**
+* Reads and drops what the broker sent, and pings when nothing went out for
+* half the keepalive. Returns 0 when the broker closed the connection.
+*/
+inline uint8_t mqtt_service(MqttConn *c, uint64_t now_ms){
+  uint8_t scratch[64], ping[2] = { 0xC0, 0 };
+  ssize_t n;
+
+  while((n = recv(c->fd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0);
+  if(n == 0) return 0;
+
+  if(now_ms - c->last_sent_ms >= MQTT_KEEPALIVE_S * 1000 / 2){
+    struct iovec iov[1] = { { ping, sizeof(ping) } };
+    return mqtt_write(c, iov, 1, now_ms);
+  }
+  return 1;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+/*
+* Lock-free ring between exactly one producer and one consumer thread. Items
+* are filled and read in place, a frame never gets copied into the queue:
+*
+*   T *item = q.claim();    // NULL when full
+*   ... fill *item ...
+*   q.publish();
+*
+*   T *item = q.peek();     // NULL when empty
+*   ... use *item ...
+*   q.release();
+*
+* head and tail each have one writer and sit on cache lines of their own, so
+* the two sides only share a line when one of them looks at the other's end.
+*/
+
+#define SPSC_CACHE_LINE_B 64
+
+template<typename T, size_t N> struct SpscQueue{
+  static_assert(N && !(N & (N - 1)), "N has to be a power of two");
+
+  alignas(SPSC_CACHE_LINE_B) std::atomic<size_t> head{0}; // next to read, consumer's
+  alignas(SPSC_CACHE_LINE_B) std::atomic<size_t> tail{0}; // next to write, producer's
+  alignas(SPSC_CACHE_LINE_B) T items[N];
+
+  T *claim(){
+    size_t t = tail.load(std::memory_order_relaxed);
+
+    if(t - head.load(std::memory_order_acquire) == N) return NULL;
+    return &items[t & (N - 1)];
+  }
+
+  void publish(){ tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  T *peek(){
+    size_t h = head.load(std::memory_order_relaxed);
+
+    if(h == tail.load(std::memory_order_acquire)) return NULL;
+    return &items[h & (N - 1)];
+  }
+
+  void release(){ head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  size_t size(){ return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+};
+
+#endif
@@ -0,0 +1,820 @@
+/*
+* Gateway for a Linux box with E22 modules on serial devices, USB adapters or
+* anything else that looks like a tty. It publishes what the ESP32_rx
+* firmware publishes, on the same topics, to a local MQTT broker:
+*
+*   g++ -std=gnu++17 -O2 -I. gateway/e22_gateway.cpp -o e22_gateway -pthread -lutil
+*   ./e22_gateway /dev/ttyUSB0 /dev/ttyUSB1
+*   ./e22_gateway -N -g 4 -t 10         4 channels of synthetic frames on ptys, no broker
+*
+* Each module is set up beforehand the way the receiver sets up its own,
+* fixed transmission with the RSSI byte on. The gateway only listens: it
+* sends no acks and no beacons, so the nodes it serves are built with
+* -DARQ_RELIABLE=0 -DTDMA_ENABLED=0.
+*
+* One thread per stage, joined by SpscQueue.h rings:
+*
+*   reader per device -> chunks -> parse -> frames -> decode -> messages -> publish
+*
+* A reader only moves bytes off its tty, stamped with the time they came in.
+* The parser cuts each device's stream into PACKET_SIZE_B and the RSSI byte,
+* starts over after a pause of GW_FRAME_GAP_MS inside a frame, checks the
+* CRC and corrects what FEC can (FrameCheck.h), and after a frame that does
+* not check out looks for the next schema byte. Decoding
+* drops duplicates per node and device, packs every packet into a payload of
+* its own (PayloadSerializer.h) and puts fragments back together. With -a
+* it adds the samples to their node's summary windows instead (Aggregate.h)
+* and publishes a summary as windows close. A stage
+* whose next queue is full drops and counts rather than holding up the one
+* before it, a tty only buffers a few KB.
+*
+* Options:
+*   -h host -p port     broker, default 127.0.0.1:1883
+*   -c id               MQTT client id, default e22_gateway
+*   -N                  no broker, count publishes only
+*   -j                  JSON payloads instead of binary
+*   -s baud             tty speed, default 9600
+*   -i seconds          stats interval, default 60
+*   -g channels         instead of devices, that many ptys fed synthetic frames
+*   -n nodes -r rate    nodes per channel (8) and frames/s per channel (0, flat out)
+*   -e share            share of synthetic frames sent with byte errors, default 0
+*   -t seconds          stop after this long, default when signalled
+*   -a ms               summaries over windows of ms instead of every packet
+*   -w node:field:ms    window for one node (hex) and field index, * for any,
+*                       first match wins over -a, may be repeated
+*   -b                  with -a, every packet as well
+*
+* With -g a BENCH line sums up the run on stdout.
+*/
+
+#define METRICS_NO_CLOCK
+#define AGG_NODES_MAX 64
+#include <Aggregate.h>
+#include <Fragment.h>
+#include <LinkLayer.h>
+#include <Metrics.h>
+#include <NodeTable.h>
+#include <PacketSchema.h>
+#include <PayloadSerializer.h>
+
+#include "Mqtt.h"
+#include "SpscQueue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <random>
+#include <thread>
+#include <vector>
+
+#define GW_MAX_DEVICES 8
+#define GW_CHUNK_B 256
+#define GW_CHUNK_SLOTS 256 // per device, 64 KB of tty input
+#define GW_FRAME_SLOTS 1024
+#define GW_MESSAGE_SLOTS 256
+#define GW_FRAME_B (PACKET_SIZE_B + 1) // packet and the RSSI byte
+#define GW_FRAME_GAP_MS 50 // a pause this long inside a frame means bytes went missing
+#define GW_PUBLISH_MAX_B 4096 // one packet of MESSAGE_COUNT in JSON, or a reassembled payload
+#define GW_TOPIC_MAX_B 48
+#define GW_IDLE_US 200 // a stage with nothing to do sleeps this long
+#define GW_REOPEN_MS 1000 // a device that went away is tried again this often
+#define GW_STATS_MAX_B (704 + 3 * METRICS_HIST_MAX_B)
+#define GW_AGG_RULES_MAX 16
+#define GW_GEN_DIAG_EVERY 64 // packets per node between synthetic diagnostics
+#define GW_GEN_DIAG_B 600
+
+const long GW_NODE_EXPIRE_MS = 1000L * 60 * 60;
+const long GW_BACKOFF_MIN = 1000; // ms, doubles per failed connect
+const long GW_BACKOFF_MAX = 60000;
+
+const char mqtt_topic[] = "EPIC_E22/Rx_Packet";
+const char mqtt_diag_topic[] = "EPIC_E22/Tx_Diag";
+const char mqtt_stats_topic[] = "EPIC_E22/Gw_Stats";
+const char mqtt_summary_topic[] = "EPIC_E22/Rx_Summary";
+
+typedef struct _gw_chunk{
+  uint64_t read_us;
+  uint16_t length;
+  uint8_t data[GW_CHUNK_B];
+}GwChunk;
+
+typedef struct _gw_frame{
+  uint64_t read_us; // the chunk that completed it
+  uint8_t device;
+  uint8_t rssi;
+  Packet packet;
+}GwFrame;
+
+typedef struct _gw_message{
+  uint64_t read_us;
+  uint64_t decoded_us;
+  char topic[GW_TOPIC_MAX_B];
+  uint16_t length;
+  uint8_t payload[GW_PUBLISH_MAX_B];
+}GwMessage;
+
+typedef struct _gw_device{
+  const char *path;
+  int fd;
+  SpscQueue<GwChunk, GW_CHUNK_SLOTS> chunks;
+  std::atomic<uint32_t> frames;
+  // parse thread
+  uint8_t frame[GW_FRAME_B];
+  size_t have;
+  uint64_t last_us;
+  // decode thread
+  NodeTable nodes;
+}GwDevice;
+
+typedef struct _gw_stats{
+  std::atomic<uint32_t> bytes;
+  std::atomic<uint32_t> chunk_drops; // chunk queue full
+  std::atomic<uint32_t> frames;
+  std::atomic<uint32_t> partial; // cut short by a pause
+  std::atomic<uint32_t> corrupt; // full length, failed the CRC after FEC
+  std::atomic<uint32_t> corrected; // frames FEC repaired
+  std::atomic<uint32_t> invalid; // passed the CRC, failed the header checks
+  std::atomic<uint32_t> frame_drops; // frame queue full
+  std::atomic<uint32_t> duplicates;
+  std::atomic<uint32_t> gaps;
+  std::atomic<uint32_t> decode_errors;
+  std::atomic<uint32_t> messages; // sensor messages decoded
+  std::atomic<uint32_t> message_drops; // message queue full
+  std::atomic<uint32_t> published;
+  std::atomic<uint32_t> published_bytes;
+  std::atomic<uint32_t> lost; // publishes while the broker was away
+  std::atomic<uint32_t> reconnects;
+  std::atomic<uint32_t> generated;
+  // copies of the decode thread's reassembler and aggregator counters
+  std::atomic<uint32_t> fragments;
+  std::atomic<uint32_t> reassembled;
+  std::atomic<uint32_t> reassembly_expired;
+  std::atomic<uint32_t> summaries;
+  std::atomic<uint32_t> windows;
+  std::atomic<uint32_t> windows_early;
+}GwStats;
+
+static GwDevice devices[GW_MAX_DEVICES];
+static uint8_t device_count = 0;
+static SpscQueue<GwFrame, GW_FRAME_SLOTS> frame_queue;
+static SpscQueue<GwMessage, GW_MESSAGE_SLOTS> message_queue;
+static GwStats stats;
+static Reassembler reassembler; // decode thread
+static Aggregator aggregator; // decode thread
+static AggRule agg_rules[GW_AGG_RULES_MAX];
+static uint8_t agg_rule_count = 0;
+static uint8_t agg_mode = AGG_MODE_RAW;
+static uint32_t agg_default_ms = 0; // 0 publishes every packet
+static LatencyHist lat_decode; // read to decoded, queues included
+static LatencyHist lat_publish; // one broker write
+static LatencyHist lat_e2e; // read to published
+
+static const char *broker_host = "127.0.0.1";
+static uint16_t broker_port = 1883;
+static const char *client_id = "e22_gateway";
+static uint8_t null_broker = 0;
+static uint8_t payload_format = PAYLOAD_FORMAT_BINARY;
+static uint32_t tty_baud = 9600;
+static long stats_interval_ms = 1000 * 60;
+static double gen_corrupt = 0; // share of synthetic frames sent with byte errors
+
+static std::atomic<int> gw_stop{0}; // readers and generators, lock free so the signal handler may set it
+static std::atomic<bool> parse_stop{false}, decode_stop{false}, publish_stop{false}; // set once the stage before has finished
+static std::atomic<bool> gen_stop{false};
+
+static void on_signal(int signal){ (void)signal; gw_stop = 1; }
+
+static uint64_t gw_now_us(){
+  timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t gw_now_ms(){ return gw_now_us() / 1000; }
+
+static void gw_log(const char *fmt, ...){
+  va_list args;
+
+  fprintf(stderr, "%llu e22_gateway: ", (unsigned long long)gw_now_ms());
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+static speed_t gw_speed(uint32_t baud){
+  switch(baud){
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    default: return B9600;
+  }
+}
+
+// raw 8N1, reads return whatever has come in
+static int gw_open_tty(const char *path){
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  termios tio;
+
+  if(fd < 0) return -1;
+  if(tcgetattr(fd, &tio) == 0){
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, gw_speed(tty_baud));
+    cfsetospeed(&tio, gw_speed(tty_baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIFLUSH);
+  return fd;
+}
+
+// ---- reader, one per device ----
+
+static void reader_thread(GwDevice *d){
+  uint8_t scratch[GW_CHUNK_B];
+
+  while(!gw_stop){
+    if(d->fd < 0){
+      d->fd = gw_open_tty(d->path);
+      if(d->fd < 0){
+        usleep(GW_REOPEN_MS * 1000);
+        continue;
+      }
+      gw_log("%s open", d->path);
+    }
+
+    pollfd pfd = { d->fd, POLLIN, 0 };
+    if(poll(&pfd, 1, 100) <= 0)
+      continue;
+
+    GwChunk *chunk = d->chunks.claim();
+    ssize_t n = read(d->fd, chunk ? chunk->data : scratch, GW_CHUNK_B);
+
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if(n <= 0){
+      gw_log("%s: %s, reopening", d->path, n ? strerror(errno) : "closed");
+      close(d->fd);
+      d->fd = -1;
+      continue;
+    }
+
+    stats.bytes += n;
+    if(!chunk){
+      stats.chunk_drops++;
+      continue;
+    }
+    chunk->read_us = gw_now_us();
+    chunk->length = n;
+    d->chunks.publish();
+  }
+}
+
+// ---- parse ----
+
+inline uint8_t gw_schema_known(uint8_t schema){ return schema == PACKET_SCHEMA || schema == FRAGMENT_SCHEMA; }
+
+// a whole frame is in d->frame, queue it or resync on the next schema byte in it
+static void gw_frame_done(GwDevice *d, uint8_t device, uint64_t read_us){
+  Packet packet; // checked and corrected apart from d->frame, a resync needs the bytes as they came
+  GwFrame *frame;
+  size_t i;
+  int corrected;
+
+  memcpy((void *)&packet, d->frame, PACKET_SIZE_B);
+  corrected = packet_check(&packet);
+  if(corrected > 0)
+    stats.corrected++;
+
+  if(corrected < 0 || (!packet_valid(&packet) && !fragment_valid(&packet))){
+    if(corrected < 0)
+      stats.corrupt++;
+    else
+      stats.invalid++;
+    for(i = 1; i < d->have && !gw_schema_known(d->frame[i]); i++);
+    memmove(d->frame, d->frame + i, d->have - i);
+    d->have -= i;
+    return;
+  }
+
+  d->have = 0;
+  d->frames++;
+  stats.frames++;
+
+  frame = frame_queue.claim();
+  if(!frame){
+    stats.frame_drops++;
+    return;
+  }
+  frame->read_us = read_us;
+  frame->device = device;
+  frame->rssi = d->frame[PACKET_SIZE_B];
+  memcpy((void *)&frame->packet, (const void *)&packet, PACKET_SIZE_B);
+  frame_queue.publish();
+}
+
+static void gw_parse_chunk(GwDevice *d, uint8_t device, const GwChunk *chunk){
+  if(d->have && chunk->read_us - d->last_us > GW_FRAME_GAP_MS * 1000ULL){
+    stats.partial++;
+    d->have = 0;
+  }
+  d->last_us = chunk->read_us;
+
+  for(uint16_t i = 0; i < chunk->length; i++){
+    if(!d->have && !gw_schema_known(chunk->data[i]))
+      continue; // between frames, or the rest of one that was cut
+    d->frame[d->have++] = chunk->data[i];
+    if(d->have == GW_FRAME_B)
+      gw_frame_done(d, device, chunk->read_us);
+  }
+}
+
+static void parse_thread(){
+  for(;;){
+    uint8_t idle = 1;
+
+    for(uint8_t i = 0; i < device_count; i++){
+      GwChunk *chunk;
+
+      while((chunk = devices[i].chunks.peek())){
+        gw_parse_chunk(&devices[i], i, chunk);
+        devices[i].chunks.release();
+        idle = 0;
+      }
+    }
+
+    if(idle){
+      if(parse_stop) break;
+      usleep(GW_IDLE_US);
+    }
+  }
+}
+
+// ---- decode ----
+
+static GwMessage *gw_message(uint64_t read_us, const char *topic, uint16_t src){
+  GwMessage *msg = message_queue.claim();
+
+  if(!msg){
+    stats.message_drops++;
+    return NULL;
+  }
+  snprintf(msg->topic, sizeof(msg->topic), "%s/%04X", topic, src);
+  msg->read_us = read_us;
+  return msg;
+}
+
+// queues the node's summary of the windows that are due, all open ones with force
+static void gw_summary(AggNode *node, uint8_t force){
+  uint8_t buffer[AGG_SUMMARY_MAX_B];
+  PayloadWriter writer;
+  GwMessage *msg;
+  size_t length;
+
+  writer.buffer = buffer;
+  writer.capacity = sizeof(buffer);
+  writer.format = payload_format;
+  if(!(length = agg_write(&aggregator, node, (uint32_t)gw_now_ms(), force, &writer))) return;
+
+  if(!(msg = gw_message(gw_now_us(), mqtt_summary_topic, node->src))) return;
+  memcpy(msg->payload, buffer, length);
+  msg->length = length;
+  msg->decoded_us = gw_now_us();
+  message_queue.publish();
+}
+
+static void gw_summaries(uint8_t force){
+  if(agg_next_ms(&aggregator, (uint32_t)gw_now_ms()) != 0 && !force) return;
+  for(uint8_t i = 0; i < AGG_NODES_MAX; i++)
+    gw_summary(&aggregator.nodes[i], force);
+}
+
+static void gw_decode(const GwFrame *frame){
+  const PacketData *pd = &frame->packet.packetData;
+  NodeState *node = node_get(&devices[frame->device].nodes, pd->src, (uint32_t)gw_now_ms(), GW_NODE_EXPIRE_MS);
+  int16_t fields[MESSAGE_COUNT * MESSAGE_FIELDS];
+  PayloadWriter writer;
+  GwMessage *msg;
+  uint8_t n;
+
+  if(node){
+    uint32_t gaps = node->link.gaps;
+
+    node->last_seen = (uint32_t)gw_now_ms();
+    node_rssi_push(node, frame->rssi);
+    if(link_rx_accept(&node->link, pd->count, pd->session, pd->flags) == LINK_RX_DUPLICATE){
+      stats.duplicates++;
+      return;
+    }
+    stats.gaps += node->link.gaps - gaps;
+    node->packets++;
+  }
+
+  if(pd->schema == FRAGMENT_SCHEMA){
+    Reassembly *done = reasm_add(&reassembler, &frame->packet, (uint32_t)gw_now_ms());
+
+    if(!done) return;
+    if(done->type != FRAGMENT_TYPE_DIAG){
+      gw_log("reassembled payload of unknown type: %u", done->type);
+      return;
+    }
+    if(!(msg = gw_message(frame->read_us, mqtt_diag_topic, done->src))) return;
+    memcpy(msg->payload, done->data, done->total);
+    msg->length = done->total;
+  }
+  else{
+    n = unpack_packet_fields(&frame->packet, fields, MESSAGE_COUNT);
+    if(n != pd->_msg_index){
+      stats.decode_errors++;
+      return;
+    }
+    stats.messages += n;
+
+    if(agg_mode & AGG_MODE_SUMMARY){
+      if(!agg_add_packet(&aggregator, pd->src, fields, n, (uint32_t)gw_now_ms())){
+        gw_summary(agg_oldest(&aggregator), 1);
+        agg_add_packet(&aggregator, pd->src, fields, n, (uint32_t)gw_now_ms());
+      }
+    }
+    if(!(agg_mode & AGG_MODE_RAW)) return;
+
+    if(!(msg = gw_message(frame->read_us, mqtt_topic, pd->src))) return;
+    payload_begin(&writer, msg->payload, sizeof(msg->payload), payload_format, MESSAGE_FIELDS, message_scales);
+    payload_append_packet(&writer, pd->count, frame->rssi, pd->src, fields, n);
+    msg->length = payload_finish(&writer);
+  }
+
+  msg->decoded_us = gw_now_us();
+  message_queue.publish();
+}
+
+// the publish thread only ever reads the copies in stats
+static void gw_decode_counters(){
+  stats.fragments.store(reassembler.fragments, std::memory_order_relaxed);
+  stats.reassembled.store(reassembler.completed, std::memory_order_relaxed);
+  stats.reassembly_expired.store(reassembler.expired, std::memory_order_relaxed);
+  stats.summaries.store(aggregator.summaries, std::memory_order_relaxed);
+  stats.windows.store(aggregator.windows, std::memory_order_relaxed);
+  stats.windows_early.store(aggregator.early, std::memory_order_relaxed);
+}
+
+static void decode_thread(){
+  uint64_t last_expire = gw_now_ms();
+
+  for(uint8_t i = 0; i < device_count; i++)
+    node_table_init(&devices[i].nodes);
+  agg_init(&aggregator, MESSAGE_FIELDS, message_scales, agg_rules, agg_rule_count, agg_default_ms);
+
+  for(;;){
+    GwFrame *frame = frame_queue.peek();
+
+    if(!frame){
+      if(decode_stop) break;
+      usleep(GW_IDLE_US);
+    }
+    else{
+      gw_decode(frame);
+      frame_queue.release();
+    }
+
+    if(gw_now_ms() - last_expire >= (uint64_t)stats_interval_ms){
+      last_expire = gw_now_ms();
+      reasm_expire(&reassembler, (uint32_t)last_expire);
+    }
+    gw_summaries(0);
+    gw_decode_counters();
+  }
+
+  gw_summaries(1); // whatever is open at the end goes out short
+  gw_decode_counters();
+}
+
+// ---- publish ----
+
+static uint8_t gw_publish(MqttConn *conn, const char *topic, const uint8_t *payload, size_t length){
+  uint64_t started = gw_now_us();
+
+  if(!null_broker){
+    if(conn->fd < 0) return 0;
+    if(!mqtt_publish(conn, topic, payload, length, gw_now_ms())){
+      gw_log("broker write failed, reconnecting");
+      mqtt_close(conn);
+      return 0;
+    }
+  }
+
+  hist_record(&lat_publish, gw_now_us() - started);
+  stats.published++;
+  stats.published_bytes += length;
+  return 1;
+}
+
+static void gw_stats_publish(MqttConn *conn){
+  static char buffer[GW_STATS_MAX_B];
+  const LatencyHist *hists[3] = { &lat_decode, &lat_publish, &lat_e2e };
+  const char *names[3] = { "decode_us", "publish_us", "e2e_us" };
+  size_t length;
+  int n;
+
+  n = snprintf(buffer, sizeof(buffer),
+               "{\"uptime_ms\":%llu,\"bytes\":%u,\"frames\":%u,\"partial\":%u,\"corrupt\":%u,\"corrected\":%u,\"invalid\":%u,\"duplicates\":%u,\"gaps\":%u,\"errors\":%u,"
+               "\"messages\":%u,\"published\":%u,\"published_bytes\":%u,\"lost\":%u,\"reconnects\":%u,"
+               "\"dropped\":{\"chunks\":%u,\"frames\":%u,\"messages\":%u},\"fragments\":%u,\"reassembled\":%u,\"reassembly_expired\":%u,"
+               "\"summaries\":%u,\"windows\":%u,\"windows_early\":%u,\"devices\":[",
+               (unsigned long long)gw_now_ms(), stats.bytes.load(), stats.frames.load(), stats.partial.load(), stats.corrupt.load(),
+               stats.corrected.load(), stats.invalid.load(), stats.duplicates.load(), stats.gaps.load(), stats.decode_errors.load(), stats.messages.load(),
+               stats.published.load(), stats.published_bytes.load(), stats.lost.load(), stats.reconnects.load(),
+               stats.chunk_drops.load(), stats.frame_drops.load(), stats.message_drops.load(),
+               stats.fragments.load(), stats.reassembled.load(), stats.reassembly_expired.load(),
+               stats.summaries.load(), stats.windows.load(), stats.windows_early.load());
+  if(n < 0 || (size_t)n >= sizeof(buffer)) return;
+  length = n;
+
+  for(uint8_t i = 0; i < device_count && length < sizeof(buffer); i++)
+    length += snprintf(buffer + length, sizeof(buffer) - length, i + 1 < device_count ? "%u," : "%u],", devices[i].frames.load());
+
+  for(uint8_t i = 0; i < 3; i++){
+    length = hist_format(hists[i], names[i], buffer, length, sizeof(buffer) - 1);
+    if(!length) return;
+    buffer[length++] = i < 2 ? ',' : '}';
+  }
+
+  gw_log("%.*s", (int)length, buffer);
+  gw_publish(conn, mqtt_stats_topic, (const uint8_t *)buffer, length);
+}
+
+static void publish_thread(){
+  MqttConn conn = { -1, 0 };
+  uint64_t retry_ms = 0, last_stats = gw_now_ms();
+  long backoff = GW_BACKOFF_MIN;
+
+  for(;;){
+    uint64_t now = gw_now_ms();
+    GwMessage *msg;
+
+    if(!null_broker && conn.fd < 0 && now >= retry_ms){
+      if(mqtt_connect(&conn, broker_host, broker_port, client_id, now)){
+        gw_log("connected to %s:%u", broker_host, broker_port);
+        stats.reconnects++;
+        backoff = GW_BACKOFF_MIN;
+      }
+      else{
+        gw_log("broker %s:%u not reachable, next try in %ld ms", broker_host, broker_port, backoff);
+        retry_ms = now + backoff;
+        backoff = backoff * 2 < GW_BACKOFF_MAX ? backoff * 2 : GW_BACKOFF_MAX;
+      }
+    }
+
+    if((msg = message_queue.peek())){
+      if(gw_publish(&conn, msg->topic, msg->payload, msg->length)){
+        hist_record(&lat_decode, msg->decoded_us - msg->read_us);
+        hist_record(&lat_e2e, gw_now_us() - msg->read_us);
+      }
+      else
+        stats.lost++; // no store and forward on the gateway, the broker is local
+      message_queue.release();
+    }
+    else{
+      if(publish_stop) break;
+      if(conn.fd >= 0 && !mqtt_service(&conn, now)){
+        gw_log("broker closed the connection");
+        mqtt_close(&conn);
+      }
+      usleep(GW_IDLE_US);
+    }
+
+    if(now - last_stats >= (uint64_t)stats_interval_ms){
+      last_stats = now;
+      gw_stats_publish(&conn);
+    }
+  }
+
+  mqtt_close(&conn);
+}
+
+// ---- synthetic frames ----
+
+typedef struct _gen_node{
+  Packet packet; // filled once, count and session change per frame
+  uint32_t packets;
+  Fragmenter fragmenter;
+  char diag[GW_GEN_DIAG_B];
+}GenNode;
+
+static uint8_t gen_write(int fd, const void *data, size_t length){
+  const uint8_t *p = (const uint8_t *)data;
+
+  while(length && !gen_stop){
+    ssize_t n = write(fd, p, length);
+
+    if(n < 0 && errno != EAGAIN && errno != EINTR) return 0;
+    if(n <= 0){
+      pollfd pfd = { fd, POLLOUT, 0 };
+      poll(&pfd, 1, 100);
+      continue;
+    }
+    p += n;
+    length -= n;
+  }
+  return !length;
+}
+
+/**
+* Feeds one pty master with frames from nodes, round robin, at rate frames
+* per second or as fast as the gateway takes them. Every GW_GEN_DIAG_EVERY
+* packets a node also sends diagnostics in fragments. A gen_corrupt share of
+* frames goes out with 1 to FRAME_FEC_B / 2 + 1 bytes hit, one more than FEC
+* can take.
+*/
+static void generator_thread(int fd, uint8_t channel, uint8_t nodes, uint32_t rate){
+  std::vector<GenNode> gen(nodes);
+  std::mt19937 rng(channel + 1);
+  std::normal_distribution<float> step(0, 0.1);
+  uint8_t frame[GW_FRAME_B];
+  uint64_t next_us = gw_now_us();
+  uint32_t sent = 0;
+
+  for(uint8_t i = 0; i < nodes; i++){
+    Message msg = { 21.0f + i, 45.0f };
+    CodecState state;
+
+    clear_packet_messages(&gen[i].packet, &state);
+    while(!packet_full(&gen[i].packet)){
+      msg.temperature += step(rng);
+      msg.humidity += 2 * step(rng);
+      if(!append_packet_message(&gen[i].packet, &state, msg)) break;
+    }
+    gen[i].packet.packetData.src = ((uint16_t)channel << 8) | (i + 1);
+    gen[i].packet.packetData.session = rng();
+    gen[i].packet.packetData.count = 0;
+    gen[i].packets = i * GW_GEN_DIAG_EVERY / nodes; // staggered, FRAGMENT_REASM_SLOTS could not hold every node's diagnostics at once
+    memset(gen[i].diag, 'x', sizeof(gen[i].diag));
+    memcpy(gen[i].diag, "{\"synthetic\":\"", 14);
+    memcpy(gen[i].diag + sizeof(gen[i].diag) - 2, "\"}", 2);
+  }
+
+  while(!gen_stop){
+    GenNode *node = &gen[sent % nodes];
+    PacketData *pd = &node->packet.packetData;
+
+    if(fragment_next(&node->fragmenter, (Packet *)frame)){
+      ((Packet *)frame)->packetData.src = pd->src;
+      ((Packet *)frame)->packetData.session = pd->session;
+      ((Packet *)frame)->packetData.count = pd->count++;
+    }
+    else{
+      memcpy(frame, (const void *)&node->packet, PACKET_SIZE_B);
+      pd->count++;
+      if(++node->packets % GW_GEN_DIAG_EVERY == 0)
+        fragment_begin(&node->fragmenter, (const uint8_t *)node->diag, sizeof(node->diag), FRAGMENT_TYPE_DIAG);
+    }
+    packet_seal((Packet *)frame);
+    if(gen_corrupt > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < gen_corrupt)
+      for(uint32_t hits = 1 + rng() % (FRAME_FEC_B / 2 + 1); hits; hits--)
+        frame[rng() % PACKET_SIZE_B] ^= 1 + rng() % 255;
+    frame[PACKET_SIZE_B] = 180 + rng() % 40; // RSSI byte
+
+    if(!gen_write(fd, frame, sizeof(frame))) break;
+    stats.generated++;
+    sent++;
+
+    if(rate){
+      next_us += 1000000 / rate;
+      uint64_t now = gw_now_us();
+      if(next_us > now) usleep(next_us - now);
+    }
+  }
+}
+
+// node:field:ms, node in hex and field an index, either may be *
+static uint8_t gw_parse_rule(const char *spec, AggRule *rule){
+  char *end;
+
+  rule->src = spec[0] == '*' ? AGG_ANY_NODE : (uint16_t)strtoul(spec, &end, 16);
+  spec = spec[0] == '*' ? spec + 1 : end;
+  if(*spec++ != ':') return 0;
+  rule->field = spec[0] == '*' ? AGG_ANY_FIELD : (uint8_t)strtoul(spec, &end, 10);
+  spec = spec[0] == '*' ? spec + 1 : end;
+  if(*spec++ != ':') return 0;
+  rule->window_ms = strtoul(spec, &end, 10);
+  return !*end && rule->window_ms;
+}
+
+int main(int argc, char **argv){
+  static char pty_names[GW_MAX_DEVICES][64];
+  std::thread readers[GW_MAX_DEVICES], generators[GW_MAX_DEVICES];
+  int masters[GW_MAX_DEVICES];
+  uint8_t channels = 0, nodes = 8, agg_both = 0;
+  uint32_t rate = 0;
+  long seconds = 0;
+  uint64_t started;
+  int opt;
+
+  while((opt = getopt(argc, argv, "h:p:c:Njs:i:g:n:r:e:t:a:w:b")) != -1){
+    switch(opt){
+      case 'h': broker_host = optarg; break;
+      case 'p': broker_port = atoi(optarg); break;
+      case 'c': client_id = optarg; break;
+      case 'N': null_broker = 1; break;
+      case 'j': payload_format = PAYLOAD_FORMAT_JSON; break;
+      case 's': tty_baud = atoi(optarg); break;
+      case 'i': stats_interval_ms = atol(optarg) * 1000; break;
+      case 'g': channels = atoi(optarg); break;
+      case 'n': nodes = atoi(optarg); break;
+      case 'r': rate = atoi(optarg); break;
+      case 'e': gen_corrupt = atof(optarg); break;
+      case 't': seconds = atol(optarg); break;
+      case 'a': agg_default_ms = strtoul(optarg, NULL, 10); break;
+      case 'w':
+        if(agg_rule_count == GW_AGG_RULES_MAX || !gw_parse_rule(optarg, &agg_rules[agg_rule_count++])){
+          fprintf(stderr, "e22_gateway: -w node:field:ms, at most %u\n", GW_AGG_RULES_MAX);
+          return 1;
+        }
+        break;
+      case 'b': agg_both = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-c id] [-N] [-j] [-s baud] [-i seconds] [-t seconds] [-a ms [-w node:field:ms]... [-b]] <tty>...\n"
+                        "       %s -g channels [-n nodes] [-r frames/s] [-e share] [...]\n", argv[0], argv[0]);
+        return 1;
+    }
+  }
+
+  if(agg_default_ms)
+    agg_mode = agg_both ? AGG_MODE_BOTH : AGG_MODE_SUMMARY;
+
+  if(channels > GW_MAX_DEVICES || (!channels && (optind >= argc || argc - optind > GW_MAX_DEVICES)) || !nodes){
+    fprintf(stderr, "e22_gateway: 1 to %u devices or channels\n", GW_MAX_DEVICES);
+    return 1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN); // a broker that went away shows up as a failed write
+
+  for(uint8_t i = 0; i < channels; i++){
+    int slave;
+    termios tio;
+
+    if(openpty(&masters[i], &slave, pty_names[i], NULL, NULL) < 0){
+      perror("e22_gateway: openpty");
+      return 1;
+    }
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio); // no echo back into the generator before the reader opens it
+    devices[device_count++].path = pty_names[i];
+  }
+  for(int i = optind; !channels && i < argc; i++)
+    devices[device_count++].path = argv[i];
+
+  started = gw_now_us();
+  std::thread publisher(publish_thread), decoder(decode_thread), parser(parse_thread);
+  for(uint8_t i = 0; i < device_count; i++){
+    devices[i].fd = -1;
+    readers[i] = std::thread(reader_thread, &devices[i]);
+  }
+  for(uint8_t i = 0; i < channels; i++)
+    generators[i] = std::thread(generator_thread, masters[i], i, nodes, rate);
+
+  while(!gw_stop && (!seconds || gw_now_us() - started < (uint64_t)seconds * 1000000))
+    usleep(100 * 1000);
+
+  // stop at the source and let every stage drain the one before
+  gen_stop = true;
+  for(uint8_t i = 0; i < channels; i++) generators[i].join();
+  usleep(100 * 1000);
+  gw_stop = 1;
+  for(uint8_t i = 0; i < device_count; i++) readers[i].join();
+  parse_stop = true;
+  parser.join();
+  decode_stop = true;
+  decoder.join();
+  publish_stop = true;
+  publisher.join();
+
+  if(channels){
+    double elapsed = (gw_now_us() - started) / 1e6;
+
+    printf("BENCH channels=%u nodes=%u rate=%u seconds=%.1f generated=%u frames=%u published=%u published_bytes=%u dropped=%u corrupt=%u corrected=%u invalid=%u "
+           "partial=%u frames_per_s=%.0f messages_per_s=%.0f kb_per_s=%.1f e2e_p50_us=%u e2e_p99_us=%u e2e_max_us=%u\n",
+           channels, nodes, rate, elapsed, stats.generated.load(), stats.frames.load(), stats.published.load(),
+           stats.published_bytes.load(), stats.chunk_drops.load() + stats.frame_drops.load() + stats.message_drops.load(), stats.corrupt.load(), stats.corrected.load(),
+           stats.invalid.load(), stats.partial.load(), stats.frames / elapsed, stats.messages / elapsed, stats.bytes / elapsed / 1024,
+           hist_percentile(&lat_e2e, 50), hist_percentile(&lat_e2e, 99), lat_e2e.max_us);
+  }
+  return 0;
+}
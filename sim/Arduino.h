@@ -0,0 +1,565 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+/*
+* Host stand-in for the parts of the ESP32 Arduino core the sketches use, so
+* ESP32_tx and ESP32_rx build and run as plain Linux processes.
+*
+* Time runs SIM_TIME_SCALE times faster than the wall clock: millis() and
+* delay() are scaled, so a long TX_INTERVAL can be benchmarked in seconds.
+*/
+
+#ifndef HOST_SIM
+  #define HOST_SIM
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define OUTPUT_OPEN_DRAIN 0x12
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define SERIAL_8N1 0x800001c
+
+#define F(string_literal) (string_literal)
+
+// ---- clock ----
+
+inline double sim_time_scale(){
+  static double scale = getenv("SIM_TIME_SCALE") ? atof(getenv("SIM_TIME_SCALE")) : 1.0;
+  return scale > 0 ? scale : 1.0;
+}
+
+inline uint64_t sim_now_ns(){
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t sim_boot_ns(){
+  static uint64_t boot = sim_now_ns();
+  return boot;
+}
+
+// wall clock nanoseconds -> sim milliseconds
+inline double sim_ns_to_ms(uint64_t ns){ return ns * sim_time_scale() / 1e6; }
+
+inline void sim_sleep_ms(double ms){
+  if(ms > 0) std::this_thread::sleep_for(std::chrono::nanoseconds((uint64_t)(ms * 1e6 / sim_time_scale())));
+}
+
+inline unsigned long millis(){ return (unsigned long)sim_ns_to_ms(sim_now_ns() - sim_boot_ns()); }
+inline unsigned long micros(){ return (unsigned long)(sim_ns_to_ms(sim_now_ns() - sim_boot_ns()) * 1000); }
+inline int64_t esp_timer_get_time(){ return (int64_t)(sim_ns_to_ms(sim_now_ns() - sim_boot_ns()) * 1000); }
+inline void delay(unsigned long ms){ sim_sleep_ms(ms); }
+inline void delayMicroseconds(unsigned int us){ sim_sleep_ms(us / 1000.0); }
+inline void yield(){ std::this_thread::yield(); }
+
+// ---- ESP ----
+
+// cycle counter of a 240 MHz core on the sim clock; the heap is the host's, reported as a fixed ESP32-ish size
+class EspClass {
+public:
+  uint32_t getCycleCount(){ return (uint32_t)(uint64_t)(sim_ns_to_ms(sim_now_ns() - sim_boot_ns()) * 1000 * getCpuFreqMHz()); }
+  uint32_t getCpuFreqMHz(){ return 240; }
+  uint32_t getHeapSize(){ return 320 * 1024; }
+  uint32_t getFreeHeap(){ return getHeapSize(); }
+  uint32_t getMinFreeHeap(){ return getHeapSize(); }
+};
+
+inline EspClass ESP;
+
+// ---- deep sleep ----
+
+/*
+* esp_deep_sleep_start() sleeps the timer out on the sim clock and throws
+* SimDeepSleep, sim_main.h runs setup() again as the wake boot. Memory is not
+* cleared, so RTC_DATA_ATTR is a no-op and other globals keep their values
+* too; boot time is not modelled. esp_reset_reason() is a power-on reset
+* for the first boot and a deep sleep one after that.
+*/
+
+#define RTC_DATA_ATTR
+
+typedef int gpio_num_t;
+
+typedef enum {
+  ESP_SLEEP_WAKEUP_UNDEFINED = 0,
+  ESP_SLEEP_WAKEUP_TIMER = 4
+} esp_sleep_wakeup_cause_t;
+
+typedef enum {
+  ESP_RST_UNKNOWN = 0,
+  ESP_RST_POWERON = 1,
+  ESP_RST_SW = 3,
+  ESP_RST_DEEPSLEEP = 8
+} esp_reset_reason_t;
+
+struct SimDeepSleep {};
+
+typedef struct _sim_sleep{
+  uint64_t timer_us;
+  esp_sleep_wakeup_cause_t cause;
+  uint32_t count;
+  double slept_ms;
+}SimSleep;
+
+inline SimSleep *sim_sleep(){
+  static SimSleep state;
+  return &state;
+}
+
+inline void esp_sleep_enable_timer_wakeup(uint64_t us){ sim_sleep()->timer_us = us; }
+inline esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(){ return sim_sleep()->cause; }
+inline esp_reset_reason_t esp_reset_reason(){ return sim_sleep()->count ? ESP_RST_DEEPSLEEP : ESP_RST_POWERON; }
+inline void gpio_hold_en(gpio_num_t pin){ (void)pin; }
+inline void gpio_hold_dis(gpio_num_t pin){ (void)pin; }
+inline void gpio_deep_sleep_hold_en(){}
+
+[[noreturn]] inline void esp_deep_sleep_start(){
+  SimSleep *state = sim_sleep();
+
+  sim_sleep_ms(state->timer_us / 1000.0);
+  state->count++;
+  state->slept_ms += state->timer_us / 1000.0;
+  state->cause = ESP_SLEEP_WAKEUP_TIMER;
+  throw SimDeepSleep();
+}
+
+// ---- random ----
+
+inline void randomSeed(unsigned long seed){ srand(seed); }
+inline long random(long howbig){ return howbig > 0 ? rand() % howbig : 0; }
+inline long random(long howsmall, long howbig){ return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall); }
+
+// ---- pins ----
+
+#define SIM_PIN_COUNT 64
+
+inline volatile int *sim_pins(){
+  static volatile int pins[SIM_PIN_COUNT];
+  return pins;
+}
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define IRAM_ATTR
+#define digitalPinToInterrupt(pin) (pin)
+
+typedef struct _sim_interrupt{
+  void (*isr)(void);
+  int mode;
+}SimInterrupt;
+
+inline SimInterrupt *sim_interrupts(){
+  static SimInterrupt interrupts[SIM_PIN_COUNT];
+  return interrupts;
+}
+
+inline void pinMode(uint8_t pin, uint8_t mode){ (void)pin; (void)mode; }
+inline int digitalRead(uint8_t pin){ return pin < SIM_PIN_COUNT ? sim_pins()[pin] : LOW; }
+
+// also how the fake peripherals drive input pins, edges run the attached ISR in the caller's thread
+inline void digitalWrite(uint8_t pin, uint8_t level){
+  if(pin >= SIM_PIN_COUNT) return;
+
+  int previous = sim_pins()[pin];
+  SimInterrupt interrupt = sim_interrupts()[pin];
+
+  sim_pins()[pin] = level;
+  if(interrupt.isr && previous != level
+     && ((level == LOW && (interrupt.mode & FALLING)) || (level == HIGH && (interrupt.mode & RISING))))
+    interrupt.isr();
+}
+
+inline void attachInterrupt(uint8_t pin, void (*isr)(void), int mode){
+  if(pin < SIM_PIN_COUNT) sim_interrupts()[pin] = { isr, mode };
+}
+inline void detachInterrupt(uint8_t pin){
+  if(pin < SIM_PIN_COUNT) sim_interrupts()[pin] = { NULL, 0 };
+}
+
+// ---- String / Print / Stream ----
+
+class String : public std::string {
+public:
+  String() {}
+  String(const char *s) : std::string(s ? s : "") {}
+  String(const std::string &s) : std::string(s) {}
+  String(int value) : std::string(std::to_string(value)) {}
+  String(unsigned int value) : std::string(std::to_string(value)) {}
+  String(long value) : std::string(std::to_string(value)) {}
+  String(unsigned long value) : std::string(std::to_string(value)) {}
+
+  const char *c_str() const { return std::string::c_str(); }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size){
+    size_t n = 0;
+    while(size--) n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *str){ return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size){ return write((const uint8_t *)buffer, size); }
+
+  size_t print(const char *str){ return write(str); }
+  size_t print(const String &str){ return write((const uint8_t *)str.data(), str.size()); }
+  size_t print(char c){ return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC){ return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC){ return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC){ return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC){
+    if(base == DEC && n < 0) return print('-') + print((unsigned long)-n, base);
+    return print((unsigned long)n, base);
+  }
+  size_t print(unsigned long n, int base = DEC){
+    char buf[8 * sizeof(long) + 1];
+    char *str = &buf[sizeof(buf) - 1];
+
+    *str = '\0';
+    if(base < 2) base = 10;
+    do{
+      unsigned long digit = n % base;
+      n /= base;
+      *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    }while(n);
+
+    return write(str);
+  }
+  size_t print(double n, int digits = 2){
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf);
+  }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))){
+    char buf[256];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    return write(buf);
+  }
+
+  size_t println(){ return write("\r\n"); }
+  template <typename T> size_t println(T value){ return print(value) + println(); }
+  template <typename T> size_t println(T value, int format){ return print(value, format) + println(); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeout){ _timeout = timeout; }
+  unsigned long getTimeout(){ return _timeout; }
+
+  virtual size_t readBytes(uint8_t *buffer, size_t length){
+    size_t count = 0;
+    unsigned long start = millis();
+
+    while(count < length && millis() - start < _timeout){
+      int c = read();
+      if(c < 0){
+        delay(1);
+        continue;
+      }
+      buffer[count++] = (uint8_t)c;
+    }
+
+    return count;
+  }
+  size_t readBytes(char *buffer, size_t length){ return readBytes((uint8_t *)buffer, length); }
+
+protected:
+  unsigned long _timeout = 1000;
+};
+
+/*
+* UART 0 writes to stdout. Any other port is a byte pipe: whatever is attached
+* to it (the fake E22) pushes bytes in with sim_feed() and receives what the
+* sketch writes through the tx sink. Every sim_feed() is one burst on the
+* line, the onReceive() callback runs after it like on the rx timeout.
+*/
+class HardwareSerial : public Stream {
+public:
+  explicit HardwareSerial(int uart_nr) : _uart_nr(uart_nr) {}
+
+  void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1){
+    (void)config; (void)rxPin; (void)txPin;
+    _baud = baud;
+  }
+  void end(){}
+  size_t setRxBufferSize(size_t size){ return size; }
+  size_t setTxBufferSize(size_t size){ return size; }
+  bool setRxTimeout(uint8_t symbols){ (void)symbols; return true; }
+  void onReceive(std::function<void(void)> callback, bool onlyOnTimeout = false){
+    (void)onlyOnTimeout;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _on_receive = callback;
+  }
+  void updateBaudRate(unsigned long baud){ _baud = baud; }
+  unsigned long baudRate(){ return _baud; }
+  operator bool() const { return true; }
+
+  int available() override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return (int)_rx.size();
+  }
+  int peek() override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _rx.empty() ? -1 : _rx.front();
+  }
+  int read() override {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_rx.empty()) return -1;
+    int c = _rx.front();
+    _rx.pop_front();
+    return c;
+  }
+
+  size_t readBytes(uint8_t *buffer, size_t length) override {
+    size_t count = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds((uint64_t)(_timeout * 1e6 / sim_time_scale()));
+
+    while(count < length){
+      if(_rx.empty() && _cv.wait_until(lock, deadline, [this]{ return !_rx.empty(); }) == false)
+        break;
+      while(count < length && !_rx.empty()){
+        buffer[count++] = _rx.front();
+        _rx.pop_front();
+      }
+    }
+
+    return count;
+  }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    if(_uart_nr == 0){
+      fwrite(buffer, 1, size, stdout);
+      fflush(stdout);
+      return size;
+    }
+    if(_tx_sink) _tx_sink(buffer, size);
+    return size;
+  }
+  using Print::write;
+
+  void flush(){}
+
+  // sim side
+  void sim_feed(const uint8_t *buffer, size_t size){
+    std::function<void(void)> on_receive;
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _rx.insert(_rx.end(), buffer, buffer + size);
+      on_receive = _on_receive;
+    }
+    _cv.notify_all();
+    if(on_receive) on_receive();
+  }
+  void sim_set_tx_sink(std::function<void(const uint8_t *, size_t)> sink){ _tx_sink = sink; }
+  void sim_flush_rx(){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _rx.clear();
+  }
+
+private:
+  int _uart_nr;
+  unsigned long _baud = 115200;
+  std::deque<uint8_t> _rx;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::function<void(const uint8_t *, size_t)> _tx_sink;
+  std::function<void(void)> _on_receive;
+};
+
+inline HardwareSerial Serial(0);
+inline HardwareSerial Serial1(1);
+inline HardwareSerial Serial2(2);
+
+// ---- FreeRTOS, 1 tick == 1 ms like the ESP32 Arduino core ----
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY 0xffffffffUL
+#define tskIDLE_PRIORITY 0
+
+typedef void (*TaskFunction_t)(void *);
+
+inline void vTaskDelay(TickType_t ticks){ delay(ticks); }
+inline TickType_t xTaskGetTickCount(){ return (TickType_t)millis(); }
+
+inline void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment){
+  *previous_wake += increment;
+  TickType_t now = xTaskGetTickCount();
+  if((int32_t)(*previous_wake - now) > 0) delay(*previous_wake - now);
+}
+
+inline std::chrono::steady_clock::time_point sim_ticks_deadline(TickType_t ticks){
+  if(ticks == portMAX_DELAY) return std::chrono::steady_clock::time_point::max();
+  return std::chrono::steady_clock::now() + std::chrono::nanoseconds((uint64_t)(ticks * 1e6 / sim_time_scale()));
+}
+
+// tasks are plain threads, cores and priorities are ignored on the host
+typedef struct _sim_task{
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint32_t notify;
+}*TaskHandle_t;
+
+inline TaskHandle_t &sim_current_task(){
+  thread_local TaskHandle_t task = NULL;
+  if(!task) task = new _sim_task();
+  return task;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle(){ return sim_current_task(); }
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stack, void *params, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core){
+  (void)name; (void)stack; (void)priority; (void)core;
+  TaskHandle_t task = new _sim_task();
+
+  if(handle) *handle = task;
+  std::thread([code, params, task]{
+    sim_current_task() = task;
+    code(params);
+  }).detach();
+  return pdPASS;
+}
+
+inline void vTaskDelete(TaskHandle_t task){
+  if(task == NULL || task == sim_current_task())
+    for(;;) delay(1000000);
+}
+
+#define portYIELD_FROM_ISR(...) do{}while(0)
+
+inline void xTaskNotifyGive(TaskHandle_t task){
+  if(!task) return;
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->notify++;
+  }
+  task->cv.notify_all();
+}
+
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken){
+  xTaskNotifyGive(task);
+  if(woken) *woken = pdTRUE;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks){
+  TaskHandle_t task = sim_current_task();
+  std::unique_lock<std::mutex> lock(task->mutex);
+  uint32_t value;
+
+  task->cv.wait_until(lock, sim_ticks_deadline(ticks), [task]{ return task->notify > 0; });
+  value = task->notify;
+  if(value) task->notify = clear_on_exit ? 0 : value - 1;
+  return value;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack, void *params, UBaseType_t priority, TaskHandle_t *handle){
+  return xTaskCreatePinnedToCore(code, name, stack, params, priority, handle, 0);
+}
+
+typedef struct _sim_queue{
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::string> items;
+  UBaseType_t length;
+  UBaseType_t item_size;
+}*QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size){
+  QueueHandle_t queue = new _sim_queue();
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks){
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  if(!queue->cv.wait_until(lock, sim_ticks_deadline(ticks), [queue]{ return queue->items.size() < queue->length; }))
+    return pdFALSE;
+  queue->items.push_back(item ? std::string((const char *)item, queue->item_size) : std::string());
+  queue->cv.notify_all();
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks){
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  if(!queue->cv.wait_until(lock, sim_ticks_deadline(ticks), [queue]{ return !queue->items.empty(); }))
+    return pdFALSE;
+  if(item) memcpy(item, queue->items.front().data(), queue->item_size);
+  queue->items.pop_front();
+  queue->cv.notify_all();
+  return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue){
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->items.size();
+}
+
+// like FreeRTOS a mutex is a one item queue holding the token while free, no priority inheritance
+typedef QueueHandle_t SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex(){
+  SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+  xQueueSend(mutex, NULL, 0);
+  return mutex;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks){ return xQueueReceive(mutex, NULL, ticks); }
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex){ return xQueueSend(mutex, NULL, 0); }
+
+#endif
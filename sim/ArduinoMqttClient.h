@@ -0,0 +1,87 @@
+#ifndef SIM_ARDUINO_MQTT_CLIENT_H
+#define SIM_ARDUINO_MQTT_CLIENT_H
+
+/*
+* Host stand-in for ArduinoMqttClient. Publishes are counted in SimStats and
+* written to the file named by SIM_MQTT_LOG ("-" for stdout) as
+* "<topic> <length>\n<payload>\n".
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <SimStats.h>
+
+#define MQTT_CONNECTION_TIMEOUT -2
+#define MQTT_SUCCESS 0
+
+class MqttClient : public Client {
+public:
+  MqttClient(Client &client) : _client(&client) {}
+  MqttClient(Client *client) : _client(client) {}
+
+  int connect(const char *host, uint16_t port = 1883){
+    (void)host; (void)port;
+    _connected = sim_net_up();
+    if(!_connected) delay(_connection_timeout); // the TCP connect runs into its timeout
+    return _connected;
+  }
+  void stop(){ _connected = 0; }
+  int connected(){
+    if(!sim_net_up()) _connected = 0; // the session does not survive an outage
+    return _connected;
+  }
+  int connectError(){ return _connected ? MQTT_SUCCESS : MQTT_CONNECTION_TIMEOUT; }
+  void poll(){}
+  void setId(const char *id){ (void)id; }
+  void setKeepAliveInterval(unsigned long interval){ (void)interval; }
+  void setConnectionTimeout(unsigned long timeout){ _connection_timeout = timeout; }
+
+  int beginMessage(const char *topic, bool retain = false, uint8_t qos = 0, bool dup = false){
+    (void)retain; (void)qos; (void)dup;
+    if(!connected()) return 0;
+    _topic = topic;
+    _payload.clear();
+    return 1;
+  }
+  int beginMessage(const char *topic, unsigned long size, bool retain = false, uint8_t qos = 0, bool dup = false){
+    (void)size;
+    return beginMessage(topic, retain, qos, dup);
+  }
+  int endMessage(){
+    if(!connected()) return 0;
+
+    sim_record_publish(_payload.size());
+    if(FILE *log = sim_mqtt_log()){
+      fprintf(log, "%s %zu\n", _topic.c_str(), _payload.size());
+      fwrite(_payload.data(), 1, _payload.size(), log);
+      fputc('\n', log);
+      fflush(log);
+    }
+    return 1;
+  }
+
+  size_t write(uint8_t c) override { _payload.push_back((char)c); return 1; }
+  size_t write(const uint8_t *buffer, size_t size) override { _payload.append((const char *)buffer, size); return size; }
+  using Print::write;
+
+private:
+  static FILE *sim_mqtt_log(){
+    static FILE *log = NULL;
+    static bool opened = false;
+    const char *path = getenv("SIM_MQTT_LOG");
+
+    if(!opened && path){
+      log = strcmp(path, "-") ? fopen(path, "w") : stdout;
+      opened = true;
+    }
+    return log;
+  }
+
+  Client *_client;
+  int _connected = 0;
+  unsigned long _connection_timeout = 30000;
+  std::string _topic;
+  std::string _payload;
+};
+
+#endif
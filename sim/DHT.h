@@ -0,0 +1,23 @@
+#ifndef SIM_DHT_H
+#define SIM_DHT_H
+
+// Host stand-in for the Adafruit DHT library, nothing reads a sensor yet.
+
+#include <Arduino.h>
+
+#define DHT11 11
+#define DHT22 22
+
+class DHT {
+public:
+  DHT(uint8_t pin, uint8_t type) : _pin(pin), _type(type) {}
+  void begin(){}
+  float readTemperature(){ return 20.0f + random(0, 50) / 10.0f; }
+  float readHumidity(){ return 40.0f + random(0, 100) / 10.0f; }
+
+private:
+  uint8_t _pin;
+  uint8_t _type;
+};
+
+#endif
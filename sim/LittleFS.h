@@ -0,0 +1,19 @@
+#ifndef SIM_LITTLEFS_H
+#define SIM_LITTLEFS_H
+
+// Host stand-in for the ESP32 LittleFS library, files live in the working directory.
+
+#include <Arduino.h>
+
+class LittleFSFS {
+public:
+  bool begin(bool formatOnFail = false, const char *basePath = "/littlefs", uint8_t maxOpenFiles = 10, const char *partitionLabel = "spiffs"){
+    (void)formatOnFail; (void)basePath; (void)maxOpenFiles; (void)partitionLabel;
+    return true;
+  }
+  void end(){}
+};
+
+inline LittleFSFS LittleFS;
+
+#endif
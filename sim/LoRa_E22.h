@@ -0,0 +1,785 @@
+#ifndef SIM_LORA_E22_H
+#define SIM_LORA_E22_H
+
+/*
+* Drop-in fake of the EByte LoRa_E22 library for the host build.
+*
+* Every module is a UDP socket on 127.0.0.1, port SIM_PORT_BASE + (ADDH << 8 | ADDL),
+* so a TX and an RX process on the same machine talk to each other exactly like
+* two E22s on the same channel. Frames carry their air start time and airtime,
+* and the receiving module holds each one until it has "finished" in the air,
+* drops frames that overlap (collision), applies the loss model and then
+* streams payload + RSSI byte into its UART (Serial2) at the configured baud
+* while AUX is low.
+*
+* Sending queues the frame in the module: it goes on air once the frames
+* before it are out, and AUX stays low until the last one is. Besides
+* sendFixedMessage(), which returns with the frame off the air, a sketch can
+* write address, channel and payload straight to the UART and carry on while
+* the module sends. The real module cuts frames at a pause on the UART, the
+* sim takes every write() as one frame.
+*
+* Config commands only go through with Serial2 at 9600, like the module's
+* config mode. In normal mode both ends have to be at the module's UART
+* rate: a write at another rate is not sent, a frame received is not passed
+* on.
+*
+* WOR: a module in MODE_1_WOR_TRANSMITTER puts a preamble of one WOR period
+* in front of every frame, one in MODE_2_WOR_RECEIVER only hears frames that
+* have it. Mode 1 receives like mode 0.
+*
+* Environment:
+*   SIM_PORT_BASE       first UDP port, default 30000
+*   SIM_AIRTIME_MS      fixed airtime per frame, default LoRa time on air (Airtime.h)
+*   SIM_LOSS            probability a frame is lost, default 0
+*   SIM_RSSI            mean RSSI byte for a frame sent at 22 dBm, default 200 (-56 dBm);
+*                       lower power lowers it, and frames near the sensitivity of
+*                       their air rate are lost more often
+*   SIM_RSSI_JITTER     +- uniform jitter on SIM_RSSI, default 5
+*   SIM_CORRUPT         probability a frame that makes it arrives with byte errors, default 0;
+*                       only frames of SIM_CORRUPT_MIN_B (64) and up, acks and beacons carry
+*                       no CRC
+*   SIM_CORRUPT_BYTES   most bytes hit in such a frame, default 4; each one of 1 to this many
+*   SIM_E22_FLASH       file that stands in for the module's flash, config saved with
+*                       WRITE_CFG_PWR_DWN_SAVE survives restarts through it
+*   SIM_SEED            seed for the loss, corruption and RSSI models
+*/
+
+#include <Airtime.h>
+#include <Arduino.h>
+#include <SimStats.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <random>
+
+#define DEBUG_PRINTER Serial
+
+#ifdef LoRa_E22_DEBUG
+  #define DEBUG_PRINT(...) { DEBUG_PRINTER.print(__VA_ARGS__); }
+  #define DEBUG_PRINTLN(...) { DEBUG_PRINTER.println(__VA_ARGS__); }
+#else
+  #define DEBUG_PRINT(...) {}
+  #define DEBUG_PRINTLN(...) {}
+#endif
+
+#define MAX_SIZE_TX_PACKET 240
+#define E22_UART_BUFFER_B 1000
+#define BROADCAST_ADDRESS 0xFF
+
+// ---- library enums ----
+
+enum Status {
+  E22_SUCCESS = 1,
+  ERR_E22_UNKNOWN,
+  ERR_E22_NOT_SUPPORT,
+  ERR_E22_NOT_IMPLEMENT,
+  ERR_E22_NOT_INITIAL,
+  ERR_E22_INVALID_PARAM,
+  ERR_E22_DATA_SIZE_NOT_MATCH,
+  ERR_E22_BUF_TOO_SMALL,
+  ERR_E22_TIMEOUT,
+  ERR_E22_HARDWARE,
+  ERR_E22_HEAD_NOT_RECOGNIZED,
+  ERR_E22_NO_RESPONSE_FROM_DEVICE,
+  ERR_E22_WRONG_UART_CONFIG,
+  ERR_E22_WRONG_FORMAT,
+  ERR_E22_PACKET_TOO_BIG
+};
+
+enum MODE_TYPE {
+  MODE_0_NORMAL = 0,
+  MODE_0_TRANSMISSION = 0,
+  MODE_1_WOR_TRANSMITTER = 1,
+  MODE_1_WOR = 1,
+  MODE_2_WOR_RECEIVER = 2,
+  MODE_2_POWER_SAVING = 2,
+  MODE_3_CONFIGURATION = 3,
+  MODE_3_PROGRAM = 3,
+  MODE_3_SLEEP = 3,
+  MODE_INIT = 0xFF
+};
+
+enum PROGRAM_COMMAND {
+  WRITE_CFG_PWR_DWN_SAVE = 0xC0,
+  READ_CONFIGURATION = 0xC1,
+  WRITE_CFG_PWR_DWN_LOSE = 0xC2,
+  WRONG_FORMAT = 0xFF,
+  RETURNED_COMMAND = 0xC1,
+  SPECIAL_WIFI_CONF_COMMAND = 0xCF
+};
+
+enum UART_PARITY { MODE_00_8N1 = 0b00, MODE_01_8O1 = 0b01, MODE_10_8E1 = 0b10, MODE_11_8N1 = 0b11 };
+
+enum UART_BPS_TYPE {
+  UART_BPS_1200 = 0b000,
+  UART_BPS_2400 = 0b001,
+  UART_BPS_4800 = 0b010,
+  UART_BPS_9600 = 0b011,
+  UART_BPS_19200 = 0b100,
+  UART_BPS_38400 = 0b101,
+  UART_BPS_57600 = 0b110,
+  UART_BPS_115200 = 0b111
+};
+
+enum UART_BPS_RATE {
+  UART_BPS_RATE_1200 = 1200,
+  UART_BPS_RATE_2400 = 2400,
+  UART_BPS_RATE_4800 = 4800,
+  UART_BPS_RATE_9600 = 9600,
+  UART_BPS_RATE_19200 = 19200,
+  UART_BPS_RATE_38400 = 38400,
+  UART_BPS_RATE_57600 = 57600,
+  UART_BPS_RATE_115200 = 115200
+};
+
+enum AIR_DATA_RATE {
+  AIR_DATA_RATE_000_03 = 0b000,
+  AIR_DATA_RATE_001_12 = 0b001,
+  AIR_DATA_RATE_010_24 = 0b010,
+  AIR_DATA_RATE_011_48 = 0b011,
+  AIR_DATA_RATE_100_96 = 0b100,
+  AIR_DATA_RATE_101_192 = 0b101,
+  AIR_DATA_RATE_110_384 = 0b110,
+  AIR_DATA_RATE_111_625 = 0b111
+};
+
+enum SUB_PACKET_SETTING { SPS_240_00 = 0b00, SPS_128_01 = 0b01, SPS_064_10 = 0b10, SPS_032_11 = 0b11 };
+enum RSSI_AMBIENT_NOISE_ENABLE { RSSI_AMBIENT_NOISE_ENABLED = 0b1, RSSI_AMBIENT_NOISE_DISABLED = 0b0 };
+enum WOR_TRANSCEIVER_CONTROL { WOR_RECEIVER = 0b0, WOR_TRANSMITTER = 0b1 };
+
+enum WOR_PERIOD {
+  WOR_500_000 = 0b000,
+  WOR_1000_001 = 0b001,
+  WOR_1500_010 = 0b010,
+  WOR_2000_011 = 0b011,
+  WOR_2500_100 = 0b100,
+  WOR_3000_101 = 0b101,
+  WOR_3500_110 = 0b110,
+  WOR_4000_111 = 0b111
+};
+
+enum LBT_ENABLE_BYTE { LBT_ENABLED = 0b1, LBT_DISABLED = 0b0 };
+enum REPEATER_MODE_ENABLE_BYTE { REPEATER_ENABLED = 0b1, REPEATER_DISABLED = 0b0 };
+enum RSSI_ENABLE_BYTE { RSSI_ENABLED = 0b1, RSSI_DISABLED = 0b0 };
+enum FIDEX_TRANSMISSION { FT_TRANSPARENT_TRANSMISSION = 0b0, FT_FIXED_TRANSMISSION = 0b1 };
+enum TRANSMISSION_POWER { POWER_22 = 0b00, POWER_17 = 0b01, POWER_13 = 0b10, POWER_10 = 0b11 };
+
+static const int sim_power_dbm[] = { 22, 17, 13, 10 };
+static const int sim_sensitivity_dbm[] = { -147, -142, -139, -136, -133, -130, -127, -124 }; // per air rate
+static const uint32_t sim_uart_bps[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+static const uint32_t sim_air_bps[] = { 300, 1200, 2400, 4800, 9600, 19200, 38400, 62500 };
+static const uint16_t sim_sub_packet_b[] = { 240, 128, 64, 32 };
+
+inline String getResponseDescriptionByParams(byte status){
+  switch(status){
+    case E22_SUCCESS: return F("Success");
+    case ERR_E22_UNKNOWN: return F("Unknown");
+    case ERR_E22_NOT_SUPPORT: return F("Not support!");
+    case ERR_E22_NOT_IMPLEMENT: return F("Not implement");
+    case ERR_E22_NOT_INITIAL: return F("Not initial!");
+    case ERR_E22_INVALID_PARAM: return F("Invalid param!");
+    case ERR_E22_DATA_SIZE_NOT_MATCH: return F("Data size not match!");
+    case ERR_E22_BUF_TOO_SMALL: return F("Buff too small!");
+    case ERR_E22_TIMEOUT: return F("Timeout!!");
+    case ERR_E22_HARDWARE: return F("Hardware error!");
+    case ERR_E22_HEAD_NOT_RECOGNIZED: return F("Save mode returned not recognized!");
+    case ERR_E22_NO_RESPONSE_FROM_DEVICE: return F("No response from device! (Check wiring)");
+    case ERR_E22_WRONG_UART_CONFIG: return F("Wrong UART configuration! (BPS must be 9600 for configuration)");
+    case ERR_E22_PACKET_TOO_BIG: return F("The device support only 240byte of data transmission!");
+    default: return F("Invalid status!");
+  }
+}
+
+// ---- library structs ----
+
+struct Speed {
+  uint8_t airDataRate : 3;
+  uint8_t uartParity : 2;
+  uint8_t uartBaudRate : 3;
+
+  String getAirDataRateDescription(){ return String(sim_air_bps[airDataRate]) + "bps"; }
+  String getUARTParityDescription(){ return uartParity == MODE_01_8O1 ? F("8O1") : uartParity == MODE_10_8E1 ? F("8E1") : F("8N1 (Default)"); }
+  String getUARTBaudRateDescription(){ return String(sim_uart_bps[uartBaudRate]) + "bps"; }
+};
+
+struct TransmissionMode {
+  byte WORPeriod : 3;
+  byte WORTransceiverControl : 1;
+  byte enableLBT : 1;
+  byte enableRepeater : 1;
+  byte fixedTransmission : 1;
+  byte enableRSSI : 1;
+
+  String getWORPeriodByParamsDescription(){ return String((WORPeriod + 1) * 500) + "ms"; }
+  String getWORTransceiverControlDescription(){ return WORTransceiverControl == WOR_TRANSMITTER ? F("WOR Transmitter") : F("WOR Receiver (Default)"); }
+  String getLBTEnableByteDescription(){ return enableLBT ? F("Enabled") : F("Disabled (Default)"); }
+  String getRSSIEnableByteDescription(){ return enableRSSI ? F("Enabled") : F("Disabled (Default)"); }
+  String getRepeaterModeEnableByteDescription(){ return enableRepeater ? F("Enabled") : F("Disabled (Default)"); }
+  String getFixedTransmissionDescription(){ return fixedTransmission ? F("Fixed transmission") : F("Transparent transmission (default)"); }
+};
+
+struct Option {
+  byte transmissionPower : 2;
+  byte reserved : 3;
+  byte RSSIAmbientNoise : 1;
+  byte subPacketSetting : 2;
+
+  String getTransmissionPowerDescription(){ static const char *power[] = { "22dBm (Default)", "17dBm", "13dBm", "10dBm" }; return power[transmissionPower]; }
+  String getSubPacketSetting(){ return String(sim_sub_packet_b[subPacketSetting]) + "bytes"; }
+  String getRSSIAmbientNoiseEnable(){ return RSSIAmbientNoise ? F("Enabled") : F("Disabled (default)"); }
+};
+
+struct Crypt {
+  byte CRYPT_H = 0;
+  byte CRYPT_L = 0;
+};
+
+struct Configuration {
+  byte COMMAND = 0;
+  byte STARTING_ADDRESS = 0;
+  byte LENGHT = 0;
+
+  byte ADDH = 0;
+  byte ADDL = 0;
+  byte NETID = 0;
+
+  struct Speed SPED;
+  struct Option OPTION;
+
+  byte CHAN = 0;
+
+  struct TransmissionMode TRANSMISSION_MODE;
+  struct Crypt CRYPT;
+
+  String getChannelDescription(){ return String(CHAN + 410) + "MHz"; }
+};
+
+class ResponseStatus {
+public:
+  Status code;
+  String getResponseDescription(){ return getResponseDescriptionByParams(this->code); }
+};
+
+struct ResponseStructContainer {
+  void *data = NULL;
+  byte rssi = 0;
+  ResponseStatus status;
+  void close(){
+    free(this->data);
+    this->data = NULL;
+  }
+};
+
+struct ResponseContainer {
+  String data;
+  byte rssi = 0;
+  ResponseStatus status;
+};
+
+// ---- wire format between fake modules ----
+
+#define SIM_FRAME_MAGIC 0xE22E22E2
+#define SIM_FRAME_MAX_B 1024
+
+typedef struct _sim_frame{
+  uint32_t magic;
+  uint16_t src;
+  uint16_t dest;
+  uint8_t chan;
+  uint8_t air_rate;
+  uint8_t power;
+  uint16_t size;
+  uint8_t wor;           // sent with the WOR preamble
+  uint64_t sent_ns;      // sendFixedMessage() call, for end to end latency
+  uint64_t air_start_ns;
+  uint64_t air_ns;
+  uint8_t payload[SIM_FRAME_MAX_B];
+}SimFrame;
+
+#define SIM_FRAME_HEADER_B (sizeof(SimFrame) - SIM_FRAME_MAX_B)
+
+inline double sim_env(const char *name, double fallback){
+  const char *value = getenv(name);
+  return value ? atof(value) : fallback;
+}
+
+// ---- the module ----
+
+class LoRa_E22 {
+public:
+  LoRa_E22(HardwareSerial *serial, byte auxPin, byte m0Pin, byte m1Pin, UART_BPS_RATE bpsRate = UART_BPS_RATE_9600)
+    : serial(serial), auxPin(auxPin), m0Pin(m0Pin), m1Pin(m1Pin), bpsRate(bpsRate) {}
+
+  LoRa_E22(byte txE22pin, byte rxE22pin, HardwareSerial *serial, byte auxPin, byte m0Pin, byte m1Pin, UART_BPS_RATE bpsRate = UART_BPS_RATE_9600, uint32_t serialConfig = SERIAL_8N1)
+    : LoRa_E22(serial, auxPin, m0Pin, m1Pin, bpsRate) { (void)txE22pin; (void)rxE22pin; (void)serialConfig; }
+
+  ~LoRa_E22(){
+    running = false;
+    if(rx_thread.joinable()) rx_thread.join();
+    if(tx_socket >= 0) close(tx_socket);
+  }
+
+  bool begin(){
+    if(running) return true;
+
+    digitalWrite(auxPin, HIGH);
+    default_configuration();
+    load_flash();
+
+    port_base = (uint16_t)sim_env("SIM_PORT_BASE", 30000);
+    airtime_ms = sim_env("SIM_AIRTIME_MS", -1);
+    loss = sim_env("SIM_LOSS", 0);
+    rssi_mean = sim_env("SIM_RSSI", 200);
+    rssi_jitter = sim_env("SIM_RSSI_JITTER", 5);
+    corrupt = sim_env("SIM_CORRUPT", 0);
+    corrupt_bytes = std::max(1, (int)sim_env("SIM_CORRUPT_BYTES", 4));
+    corrupt_min_b = (size_t)sim_env("SIM_CORRUPT_MIN_B", 64);
+    rng.seed((unsigned)sim_env("SIM_SEED", getpid()));
+
+    tx_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    serial->sim_set_tx_sink([this](const uint8_t *buffer, size_t size){ uart_write(buffer, size); });
+    running = true;
+    rx_thread = std::thread(&LoRa_E22::rx_loop, this);
+
+    setMode(MODE_0_NORMAL);
+    return tx_socket >= 0;
+  }
+
+  Status setMode(MODE_TYPE mode){
+    delay(40); // the library waits for the module to settle after M0/M1 change
+    this->mode = mode;
+    digitalWrite(m0Pin, mode & 0x01);
+    digitalWrite(m1Pin, (mode >> 1) & 0x01);
+    return E22_SUCCESS;
+  }
+  MODE_TYPE getMode(){ return mode; }
+
+  ResponseStructContainer getConfiguration(){
+    ResponseStructContainer rsc;
+    Configuration *copy = (Configuration *)malloc(sizeof(Configuration));
+
+    if(!config_round_trip(3, 3 + 9)){
+      rsc.data = copy;
+      rsc.status.code = ERR_E22_WRONG_UART_CONFIG;
+      return rsc;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      *copy = config;
+    }
+    copy->COMMAND = READ_CONFIGURATION;
+    copy->STARTING_ADDRESS = 0;
+    copy->LENGHT = 9;
+
+    record([](SimStats &stats){ stats.config_reads++; });
+
+    rsc.data = copy;
+    rsc.status.code = E22_SUCCESS;
+    return rsc;
+  }
+
+  ResponseStatus setConfiguration(Configuration configuration, PROGRAM_COMMAND saveType = WRITE_CFG_PWR_DWN_LOSE){
+    ResponseStatus rs;
+
+    if(!config_round_trip(3 + 9, 3 + 9)){
+      rs.code = ERR_E22_WRONG_UART_CONFIG;
+      return rs;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      config = configuration;
+    }
+
+    record([](SimStats &stats){ stats.config_writes++; });
+    if(saveType == WRITE_CFG_PWR_DWN_SAVE){
+      delay(30); // flash write on the module
+      save_flash();
+      record([](SimStats &stats){ stats.config_saves++; });
+    }
+
+    rs.code = E22_SUCCESS;
+    return rs;
+  }
+
+  int available(){ return serial->available(); }
+
+  ResponseStatus sendMessage(const void *message, const uint8_t size){
+    Configuration cfg = current_configuration();
+
+    if(cfg.TRANSMISSION_MODE.fixedTransmission && size > 3){
+      const uint8_t *bytes = (const uint8_t *)message;
+      return sendFixedMessage(bytes[0], bytes[1], bytes[2], bytes + 3, size - 3);
+    }
+    return sendFixedMessage(BROADCAST_ADDRESS, BROADCAST_ADDRESS, cfg.CHAN, message, size);
+  }
+
+  ResponseStatus sendBroadcastFixedMessage(byte CHAN, const void *message, const uint8_t size){
+    return sendFixedMessage(BROADCAST_ADDRESS, BROADCAST_ADDRESS, CHAN, message, size);
+  }
+
+  ResponseStatus sendFixedMessage(byte ADDH, byte ADDL, byte CHAN, const void *message, const uint8_t size){
+    ResponseStatus rs;
+    Configuration cfg = current_configuration();
+    uint64_t air_end_ns;
+
+    if(size > MAX_SIZE_TX_PACKET){
+      rs.code = ERR_E22_PACKET_TOO_BIG;
+      return rs;
+    }
+    if(serial->baudRate() != sim_uart_bps[cfg.SPED.uartBaudRate]){
+      rs.code = ERR_E22_WRONG_UART_CONFIG;
+      return rs;
+    }
+
+    air_end_ns = transmit(ADDH, ADDL, CHAN, (const uint8_t *)message, size);
+    if(air_end_ns > sim_now_ns())
+      std::this_thread::sleep_for(std::chrono::nanoseconds(air_end_ns - sim_now_ns())); // the library waits for AUX
+    aux_release(air_end_ns);
+
+    rs.code = E22_SUCCESS;
+    return rs;
+  }
+
+  ResponseStructContainer receiveMessage(const uint8_t size){ return receiveMessageComplete(size, false); }
+  ResponseStructContainer receiveMessageRSSI(const uint8_t size){ return receiveMessageComplete(size, true); }
+
+  ResponseStructContainer receiveMessageComplete(const uint8_t size, bool enableRSSI){
+    ResponseStructContainer rsc;
+    uint8_t len;
+
+    rsc.data = malloc(size);
+    len = serial->readBytes((uint8_t *)rsc.data, size);
+
+    if(len != size){
+      rsc.status.code = len == 0 ? ERR_E22_NO_RESPONSE_FROM_DEVICE : ERR_E22_DATA_SIZE_NOT_MATCH;
+      return rsc;
+    }
+    if(enableRSSI){
+      uint8_t rssi = 0;
+      serial->readBytes(&rssi, 1);
+      rsc.rssi = rssi;
+    }
+    serial->sim_flush_rx(); // cleanUARTBuffer()
+
+    rsc.status.code = E22_SUCCESS;
+    return rsc;
+  }
+
+private:
+  typedef struct _pending{
+    SimFrame frame;
+    bool collided;
+  }Pending;
+
+  void default_configuration(){
+    config = Configuration();
+    config.SPED.uartBaudRate = UART_BPS_9600;
+    config.SPED.airDataRate = AIR_DATA_RATE_010_24;
+    config.CHAN = 0x12;
+  }
+
+  Configuration current_configuration(){
+    std::lock_guard<std::mutex> lock(mutex);
+    return config;
+  }
+
+  void load_flash(){
+    const char *path = getenv("SIM_E22_FLASH");
+    FILE *file = path ? fopen(path, "rb") : NULL;
+
+    if(!file) return;
+    if(fread(&config, sizeof(Configuration), 1, file) != 1) default_configuration();
+    fclose(file);
+  }
+
+  void save_flash(){
+    const char *path = getenv("SIM_E22_FLASH");
+    FILE *file = path ? fopen(path, "wb") : NULL;
+
+    if(!file) return;
+    Configuration cfg = current_configuration();
+    fwrite(&cfg, sizeof(Configuration), 1, file);
+    fclose(file);
+  }
+
+  /**
+  * Clocks address, channel and payload into the module and queues the frame
+  * on air behind the ones still waiting. Returns when the frame leaves the
+  * air, AUX goes back up at the last one's end (aux_release()).
+  */
+  uint64_t transmit(byte ADDH, byte ADDL, byte CHAN, const uint8_t *message, size_t size){
+    SimFrame frame;
+    Configuration cfg = current_configuration();
+    uint64_t sent_ns = sim_now_ns(), now;
+    size_t queued = 0;
+
+    digitalWrite(auxPin, LOW);
+    sim_sleep_ms(uart_ms(3 + size, cfg));
+
+    frame.magic = SIM_FRAME_MAGIC;
+    frame.src = (cfg.ADDH << 8) | cfg.ADDL;
+    frame.dest = (ADDH << 8) | ADDL;
+    frame.chan = CHAN;
+    frame.air_rate = cfg.SPED.airDataRate;
+    frame.power = cfg.OPTION.transmissionPower;
+    frame.size = size;
+    frame.wor = mode == MODE_1_WOR_TRANSMITTER;
+    frame.sent_ns = sent_ns;
+    frame.air_ns = (uint64_t)((air_ms(size, cfg) + (frame.wor ? wor_ms(cfg) : 0)) * 1e6 / sim_time_scale());
+    memcpy(frame.payload, message, size);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      now = sim_now_ns();
+      while(!tx_queue.empty() && tx_queue.front().first <= now)
+        tx_queue.pop_front();
+      for(const auto &q : tx_queue) queued += q.second;
+
+      if(queued + 3 + size > E22_UART_BUFFER_B){
+        record([size](SimStats &stats){ stats.overflow_bytes += size; });
+        return tx_air_end_ns;
+      }
+      frame.air_start_ns = std::max(now, tx_air_end_ns);
+      tx_air_end_ns = frame.air_start_ns + frame.air_ns;
+      tx_queue.push_back({ frame.air_start_ns, 3 + size });
+    }
+
+    if(frame.dest == 0xFFFF){
+      for(uint16_t addr = 0; addr < (uint16_t)sim_env("SIM_BROADCAST_NODES", 256); addr++)
+        if(addr != frame.src) // a module does not hear itself
+          send_datagram(&frame, addr);
+    }
+    else
+      send_datagram(&frame, frame.dest);
+
+    record([size](SimStats &stats){ stats.tx_frames++; stats.tx_bytes += size; });
+    return frame.air_start_ns + frame.air_ns;
+  }
+
+  // AUX goes up when the frame that ends at air_end_ns is the last one queued
+  void aux_release(uint64_t air_end_ns){
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(tx_air_end_ns != air_end_ns) return;
+    }
+    digitalWrite(auxPin, HIGH);
+  }
+
+  // bytes the sketch wrote to Serial2, a transmission in normal mode
+  void uart_write(const uint8_t *buffer, size_t size){
+    Configuration cfg = current_configuration();
+    uint64_t air_end_ns;
+
+    if((mode != MODE_0_NORMAL && mode != MODE_1_WOR_TRANSMITTER) || !size) return;
+    if(serial->baudRate() != sim_uart_bps[cfg.SPED.uartBaudRate]) return; // garbage to the module
+
+    if(cfg.TRANSMISSION_MODE.fixedTransmission){
+      if(size <= 3 || size - 3 > MAX_SIZE_TX_PACKET) return;
+      air_end_ns = transmit(buffer[0], buffer[1], buffer[2], buffer + 3, size - 3);
+    }
+    else{
+      if(size > MAX_SIZE_TX_PACKET) return;
+      air_end_ns = transmit(BROADCAST_ADDRESS, BROADCAST_ADDRESS, cfg.CHAN, buffer, size);
+    }
+
+    std::thread([this, air_end_ns]{
+      uint64_t now = sim_now_ns();
+      if(air_end_ns > now) std::this_thread::sleep_for(std::chrono::nanoseconds(air_end_ns - now));
+      aux_release(air_end_ns);
+    }).detach();
+  }
+
+  template <typename F> void record(F update){
+    SimStats &stats = sim_stats();
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    update(stats);
+  }
+
+  // mode switch to config and back, then the command and response at 9600 8N1; false when the sketch's UART is not at 9600
+  bool config_round_trip(uint8_t command_b, uint8_t response_b){
+    MODE_TYPE previous = mode;
+    bool ok = serial->baudRate() == 9600;
+
+    setMode(MODE_3_PROGRAM);
+    if(ok)
+      sim_sleep_ms((command_b + response_b) * 10 * 1000.0 / 9600);
+    setMode(previous == MODE_INIT ? MODE_0_NORMAL : previous);
+    return ok;
+  }
+
+  double wor_ms(const Configuration &cfg){ return (cfg.TRANSMISSION_MODE.WORPeriod + 1) * 500.0; }
+
+  double uart_ms(size_t bytes, const Configuration &cfg){ return bytes * 10 * 1000.0 / sim_uart_bps[cfg.SPED.uartBaudRate]; }
+
+  double air_ms(size_t bytes, const Configuration &cfg){
+    if(airtime_ms >= 0) return airtime_ms;
+
+    return airtime_us(bytes, cfg.SPED.airDataRate, sim_sub_packet_b[cfg.OPTION.subPacketSetting]) / 1000.0;
+  }
+
+  void send_datagram(const SimFrame *frame, uint16_t addr){
+    sockaddr_in to;
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port_base + (addr & 0x7FFF));
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(tx_socket, frame, SIM_FRAME_HEADER_B + frame->size, 0, (sockaddr *)&to, sizeof(to));
+  }
+
+  int bind_rx(uint16_t addr){
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in local;
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port_base + (addr & 0x7FFF));
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(bind(fd, (sockaddr *)&local, sizeof(local)) < 0){
+      fprintf(stderr, "sim E22: address 0x%04x (port %u) is taken\n", addr, port_base + (addr & 0x7FFF));
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  void rx_loop(){
+    int fd = -1;
+    int32_t bound = -1;
+    uint64_t last_air_end_ns = 0;
+    std::deque<Pending> pending;
+
+    while(running){
+      Configuration cfg = current_configuration();
+      uint16_t addr = (cfg.ADDH << 8) | cfg.ADDL;
+      int timeout_ms = 20;
+
+      if(bound != addr){
+        if(fd >= 0) close(fd);
+        fd = bind_rx(addr);
+        bound = addr;
+      }
+
+      if(!pending.empty()){
+        uint64_t due = pending.front().frame.air_start_ns + pending.front().frame.air_ns;
+        uint64_t now = sim_now_ns();
+        timeout_ms = due > now ? (int)std::min<uint64_t>((due - now) / 1000000 + 1, 20) : 0;
+      }
+
+      pollfd pfd = { fd, POLLIN, 0 };
+      if(fd >= 0 && poll(&pfd, 1, timeout_ms) > 0){
+        Pending in;
+        ssize_t len = recv(fd, &in.frame, sizeof(SimFrame), 0);
+
+        cfg = current_configuration(); // may have changed while polling
+        in.collided = false;
+        if(len >= (ssize_t)SIM_FRAME_HEADER_B && in.frame.magic == SIM_FRAME_MAGIC
+           && in.frame.src != ((cfg.ADDH << 8) | cfg.ADDL) && in.frame.chan == cfg.CHAN && in.frame.air_rate == cfg.SPED.airDataRate){
+          for(Pending &p : pending)
+            if(in.frame.air_start_ns < p.frame.air_start_ns + p.frame.air_ns && p.frame.air_start_ns < in.frame.air_start_ns + in.frame.air_ns)
+              p.collided = in.collided = true;
+          if(in.frame.air_start_ns < last_air_end_ns)
+            in.collided = true;
+          pending.push_back(in);
+        }
+      }
+      else if(fd < 0)
+        delay(timeout_ms);
+
+      while(!pending.empty() && pending.front().frame.air_start_ns + pending.front().frame.air_ns <= sim_now_ns()){
+        Pending p = pending.front();
+        pending.pop_front();
+        last_air_end_ns = std::max(last_air_end_ns, p.frame.air_start_ns + p.frame.air_ns);
+        deliver(p, cfg);
+      }
+    }
+
+    if(fd >= 0) close(fd);
+  }
+
+  void deliver(const Pending &p, const Configuration &cfg){
+    uint8_t out[SIM_FRAME_MAX_B + 1];
+    size_t size = p.frame.size;
+
+    if(p.collided){
+      record([](SimStats &stats){ stats.collided_frames++; });
+      return;
+    }
+
+    // 50% loss at the sensitivity, ~3% with 5 dB of margin
+    int rssi = (int)rssi_mean - (sim_power_dbm[0] - sim_power_dbm[p.frame.power & 0x03])
+             + (int)std::uniform_int_distribution<int>(-(int)rssi_jitter, (int)rssi_jitter)(rng);
+    double margin = (rssi - 256) - sim_sensitivity_dbm[p.frame.air_rate & 0x07];
+    double p_lost = 1 - (1 - loss) * (1 - 1 / (1 + exp(margin / 1.5)));
+
+    if(std::uniform_real_distribution<double>(0, 1)(rng) < p_lost){
+      record([](SimStats &stats){ stats.lost_frames++; });
+      return;
+    }
+    if(mode == MODE_3_PROGRAM) return; // a module in config/sleep hears nothing
+    if(mode == MODE_2_WOR_RECEIVER && !p.frame.wor){
+      record([](SimStats &stats){ stats.lost_frames++; }); // slept through the short preamble
+      return;
+    }
+
+    memcpy(out, p.frame.payload, size);
+    if(corrupt > 0 && size >= corrupt_min_b && std::uniform_real_distribution<double>(0, 1)(rng) < corrupt){
+      int hits = std::uniform_int_distribution<int>(1, corrupt_bytes)(rng);
+
+      while(hits--)
+        out[std::uniform_int_distribution<size_t>(0, size - 1)(rng)] ^= std::uniform_int_distribution<int>(1, 255)(rng);
+      record([](SimStats &stats){ stats.corrupted_frames++; });
+    }
+    if(cfg.TRANSMISSION_MODE.enableRSSI)
+      out[size++] = (uint8_t)std::max(0, std::min(255, rssi));
+
+    if(serial->available() + size > E22_UART_BUFFER_B){
+      record([size](SimStats &stats){ stats.overflow_bytes += size; });
+      return;
+    }
+    if(serial->baudRate() != sim_uart_bps[cfg.SPED.uartBaudRate]){
+      record([](SimStats &stats){ stats.lost_frames++; }); // garbage to the sketch
+      return;
+    }
+
+    digitalWrite(auxPin, LOW);
+    sim_sleep_ms(uart_ms(size, cfg));
+    serial->sim_feed(out, size);
+    digitalWrite(auxPin, HIGH);
+
+    uint64_t sent_ns = p.frame.sent_ns;
+    record([size, sent_ns](SimStats &stats){ stats.rx_frames++; stats.rx_bytes += size; stats.last_frame_sent_ns = sent_ns; });
+  }
+
+  HardwareSerial *serial;
+  byte auxPin, m0Pin, m1Pin;
+  UART_BPS_RATE bpsRate;
+
+  std::mutex mutex;
+  Configuration config;
+  volatile MODE_TYPE mode = MODE_INIT;
+
+  uint16_t port_base = 30000;
+  double airtime_ms = -1;
+  double loss = 0;
+  double rssi_mean = 200;
+  double rssi_jitter = 5;
+  double corrupt = 0;
+  int corrupt_bytes = 4;
+  size_t corrupt_min_b = 64;
+  std::mt19937 rng;
+
+  int tx_socket = -1;
+  uint64_t tx_air_end_ns = 0; // last queued frame leaves the air
+  std::deque<std::pair<uint64_t, size_t>> tx_queue; // air start and bytes of frames still in the module
+  std::atomic<bool> running{false};
+  std::thread rx_thread;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SIM_STATS_H
+#define SIM_STATS_H
+
+/*
+* Counters shared by the fake radio and the fake MQTT client. A summary line
+* is printed when the process stops so runs can be diffed for regressions:
+*
+*   SIM_STATS role=rx sim_ms=60000 tx_frames=0 ... latency_ms_avg=312.4
+*/
+
+#include <Arduino.h>
+
+#include <algorithm>
+#include <vector>
+
+typedef struct _sim_stats{
+  std::mutex mutex;
+
+  uint32_t tx_frames;
+  uint32_t tx_bytes;
+  uint32_t rx_frames;
+  uint32_t rx_bytes;
+  uint32_t lost_frames;     // dropped by the loss model
+  uint32_t collided_frames; // overlapped another frame in the air
+  uint32_t overflow_bytes;  // did not fit the module's UART buffer
+  uint32_t corrupted_frames; // delivered with byte errors
+  uint32_t config_reads;
+  uint32_t config_writes;
+  uint32_t config_saves;    // writes that would hit the module's flash
+
+  uint32_t publishes;
+  uint32_t publish_bytes;
+
+  uint64_t last_frame_sent_ns; // sendFixedMessage() call time of the last frame delivered
+  std::vector<double> latency_ms; // frame sent -> MQTT publish
+}SimStats;
+
+inline SimStats &sim_stats(){
+  static SimStats stats;
+  return stats;
+}
+
+inline void sim_record_publish(size_t size){
+  SimStats &stats = sim_stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+
+  stats.publishes++;
+  stats.publish_bytes += size;
+
+  if(stats.last_frame_sent_ns){
+    stats.latency_ms.push_back(sim_ns_to_ms(sim_now_ns() - stats.last_frame_sent_ns));
+    stats.last_frame_sent_ns = 0; // one latency sample per delivered frame
+  }
+}
+
+inline void sim_print_stats(const char *role){
+  SimStats &stats = sim_stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  std::vector<double> latency = stats.latency_ms;
+  double sim_ms = sim_ns_to_ms(sim_now_ns() - sim_boot_ns());
+  double avg = 0, p50 = 0, p99 = 0, max = 0;
+
+  std::sort(latency.begin(), latency.end());
+  for(double l : latency) avg += l;
+  if(!latency.empty()){
+    avg /= latency.size();
+    p50 = latency[latency.size() / 2];
+    p99 = latency[(latency.size() * 99) / 100];
+    max = latency.back();
+  }
+
+  printf("SIM_STATS role=%s sim_ms=%.0f tx_frames=%u tx_bytes=%u rx_frames=%u rx_bytes=%u lost=%u collided=%u overflow_bytes=%u corrupted=%u "
+         "config_reads=%u config_writes=%u config_saves=%u publishes=%u publish_bytes=%u "
+         "rx_frames_per_s=%.3f latency_ms_avg=%.1f latency_ms_p50=%.1f latency_ms_p99=%.1f latency_ms_max=%.1f deep_sleeps=%u awake_pct=%.2f\n",
+         role, sim_ms, stats.tx_frames, stats.tx_bytes, stats.rx_frames, stats.rx_bytes, stats.lost_frames, stats.collided_frames, stats.overflow_bytes, stats.corrupted_frames,
+         stats.config_reads, stats.config_writes, stats.config_saves, stats.publishes, stats.publish_bytes,
+         sim_ms > 0 ? stats.rx_frames * 1000.0 / sim_ms : 0.0, avg, p50, p99, max,
+         sim_sleep()->count, sim_ms > 0 ? 100 * (1 - sim_sleep()->slept_ms / sim_ms) : 100.0);
+  fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef SIM_WIFI_H
+#define SIM_WIFI_H
+
+/*
+* Host stand-in for the ESP32 WiFi library. The network is up unless
+* SIM_NET_DOWN lists outages in sim milliseconds, e.g. "60000-180000,300000-310000".
+*/
+
+#include <Arduino.h>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_SCAN_COMPLETED = 2,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+inline bool sim_net_up(){
+  const char *outages = getenv("SIM_NET_DOWN");
+  unsigned long now = millis();
+
+  while(outages && *outages){
+    char *end;
+    unsigned long from = strtoul(outages, &end, 10);
+    unsigned long to = *end == '-' ? strtoul(end + 1, &end, 10) : from;
+
+    if(now >= from && now < to) return false;
+    outages = *end == ',' ? end + 1 : NULL;
+  }
+  return true;
+}
+
+class Client : public Stream {
+public:
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t c) override { (void)c; return 1; }
+  using Print::write;
+};
+
+class WiFiClient : public Client {};
+
+class WiFiClass {
+public:
+  wl_status_t begin(const char *ssid, const char *passphrase = NULL){
+    (void)ssid; (void)passphrase;
+    _status = WL_CONNECTED;
+    return _status;
+  }
+  bool disconnect(){ _status = WL_DISCONNECTED; return true; }
+  wl_status_t status(){
+    if(_status == WL_CONNECTED && !sim_net_up()){
+      if(!_auto_reconnect) _status = WL_CONNECTION_LOST; // stays down until the next begin()
+      return WL_CONNECTION_LOST;
+    }
+    return _status;
+  }
+  bool reconnect(){ _status = WL_CONNECTED; return true; }
+  void setAutoReconnect(bool autoReconnect){ _auto_reconnect = autoReconnect; }
+  bool isConnected(){ return status() == WL_CONNECTED; }
+
+private:
+  wl_status_t _status = WL_IDLE_STATUS;
+  bool _auto_reconnect = true;
+};
+
+inline WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef SIM_DRIVER_RMT_H
+#define SIM_DRIVER_RMT_H
+
+/*
+* Host stand-in for the legacy ESP-IDF RMT receive driver and its ring
+* buffer, with a DHT22 on every channel's pin. rmt_rx_start() has the sensor
+* answer right away: a full pulse train as the RMT would record it, widths
+* jittered by a few us, for a reading that wanders slowly around 21 C / 45 %.
+*
+* Environment:
+*   SIM_DHT_NOISE   probability a capture comes back with one bit's high pulse
+*                   stretched or cut, so the checksum fails, default 0
+*/
+
+#include <Arduino.h>
+
+#include <random>
+#include <vector>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_ARG 0x102
+
+typedef enum {
+  RMT_CHANNEL_0, RMT_CHANNEL_1, RMT_CHANNEL_2, RMT_CHANNEL_3,
+  RMT_CHANNEL_4, RMT_CHANNEL_5, RMT_CHANNEL_6, RMT_CHANNEL_7,
+  RMT_CHANNEL_MAX
+} rmt_channel_t;
+
+typedef enum { RMT_MODE_TX, RMT_MODE_RX } rmt_mode_t;
+
+typedef struct {
+  union {
+    struct {
+      uint32_t duration0 : 15;
+      uint32_t level0 : 1;
+      uint32_t duration1 : 15;
+      uint32_t level1 : 1;
+    };
+    uint32_t val;
+  };
+} rmt_item32_t;
+
+typedef struct {
+  uint16_t idle_threshold;
+  uint8_t filter_ticks_thresh;
+  bool filter_en;
+} rmt_rx_config_t;
+
+typedef struct {
+  rmt_mode_t rmt_mode;
+  rmt_channel_t channel;
+  gpio_num_t gpio_num;
+  uint8_t clk_div;
+  uint8_t mem_block_num;
+  uint32_t flags;
+  rmt_rx_config_t rx_config;
+} rmt_config_t;
+
+#define RMT_DEFAULT_CONFIG_RX(gpio, channel_id) { RMT_MODE_RX, (channel_id), (gpio), 80, 1, 0, { 12000, 100, true } }
+
+// one item at a time, which is all the RMT driver ever puts in
+typedef struct _sim_ringbuf{
+  std::mutex mutex;
+  std::deque<std::vector<rmt_item32_t>> items;
+  std::vector<rmt_item32_t> out; // handed to the caller until returned
+}SimRingbuf;
+
+typedef SimRingbuf *RingbufHandle_t;
+
+typedef struct _sim_rmt{
+  bool installed;
+  bool running;
+  rmt_config_t config;
+  SimRingbuf ring;
+  int16_t temperature; // 0.1 C
+  int16_t humidity; // 0.1 %
+}SimRmt;
+
+inline SimRmt *sim_rmt(){
+  static SimRmt channels[RMT_CHANNEL_MAX];
+  return channels;
+}
+
+inline std::mt19937 &sim_rmt_rng(){
+  static std::mt19937 rng(getenv("SIM_SEED") ? atoi(getenv("SIM_SEED")) : getpid());
+  return rng;
+}
+
+inline esp_err_t rmt_config(const rmt_config_t *config){
+  if(config->channel >= RMT_CHANNEL_MAX) return ESP_ERR_INVALID_ARG;
+  sim_rmt()[config->channel].config = *config;
+  return ESP_OK;
+}
+
+inline esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags){
+  (void)rx_buf_size; (void)intr_alloc_flags;
+  if(channel >= RMT_CHANNEL_MAX) return ESP_ERR_INVALID_ARG;
+  sim_rmt()[channel].installed = true;
+  sim_rmt()[channel].temperature = 210;
+  sim_rmt()[channel].humidity = 450;
+  return ESP_OK;
+}
+
+inline esp_err_t rmt_get_ringbuf_handle(rmt_channel_t channel, RingbufHandle_t *handle){
+  if(channel >= RMT_CHANNEL_MAX || !sim_rmt()[channel].installed) return ESP_ERR_INVALID_ARG;
+  *handle = &sim_rmt()[channel].ring;
+  return ESP_OK;
+}
+
+// the sensor's answer as RMT items of 1 us ticks, ending in a zero duration
+inline std::vector<rmt_item32_t> sim_dht_capture(SimRmt *rmt){
+  std::mt19937 &rng = sim_rmt_rng();
+  std::uniform_int_distribution<int> jitter(-4, 4), step(-1, 1);
+  double noise = getenv("SIM_DHT_NOISE") ? atof(getenv("SIM_DHT_NOISE")) : 0;
+  std::vector<uint16_t> widths = { 80, 80 }; // low, high, low, high...
+  uint8_t bytes[5];
+  uint16_t raw;
+  int noisy = std::uniform_real_distribution<double>(0, 1)(rng) < noise ? (int)(rng() % 40) : -1;
+  std::vector<rmt_item32_t> items;
+
+  rmt->temperature = std::max(-400, std::min(800, rmt->temperature + step(rng)));
+  rmt->humidity = std::max(0, std::min(1000, rmt->humidity + step(rng)));
+  raw = rmt->temperature < 0 ? (0x8000 | -rmt->temperature) : rmt->temperature;
+  bytes[0] = rmt->humidity >> 8;
+  bytes[1] = rmt->humidity & 0xFF;
+  bytes[2] = raw >> 8;
+  bytes[3] = raw & 0xFF;
+  bytes[4] = bytes[0] + bytes[1] + bytes[2] + bytes[3];
+
+  for(int b = 0; b < 40; b++){
+    bool one = (bytes[b >> 3] >> (7 - (b & 7))) & 1;
+
+    if(b == noisy) one = !one;
+    widths.push_back(50);
+    widths.push_back(one ? 70 : 26);
+  }
+  widths.push_back(50); // the end, then the line idles high
+
+  for(size_t i = 0; i < widths.size(); i += 2){
+    rmt_item32_t item;
+
+    item.val = 0;
+    item.duration0 = widths[i] + jitter(rng);
+    item.level0 = 0;
+    if(i + 1 < widths.size()){
+      item.duration1 = widths[i + 1] + jitter(rng);
+      item.level1 = 1;
+    }
+    items.push_back(item);
+  }
+  return items;
+}
+
+inline esp_err_t rmt_rx_start(rmt_channel_t channel, bool rx_idx_rst){
+  (void)rx_idx_rst;
+  if(channel >= RMT_CHANNEL_MAX || !sim_rmt()[channel].installed) return ESP_ERR_INVALID_ARG;
+
+  SimRmt *rmt = &sim_rmt()[channel];
+  std::lock_guard<std::mutex> lock(rmt->ring.mutex);
+  rmt->running = true;
+  rmt->ring.items.push_back(sim_dht_capture(rmt));
+  return ESP_OK;
+}
+
+inline esp_err_t rmt_rx_stop(rmt_channel_t channel){
+  if(channel >= RMT_CHANNEL_MAX) return ESP_ERR_INVALID_ARG;
+  sim_rmt()[channel].running = false;
+  return ESP_OK;
+}
+
+inline void *xRingbufferReceive(RingbufHandle_t ring, size_t *size, TickType_t ticks){
+  (void)ticks; // the capture is in by the time anyone asks
+  std::lock_guard<std::mutex> lock(ring->mutex);
+
+  if(ring->items.empty()) return NULL;
+  ring->out = ring->items.front();
+  ring->items.pop_front();
+  *size = ring->out.size() * sizeof(rmt_item32_t);
+  return ring->out.data();
+}
+
+inline void vRingbufferReturnItem(RingbufHandle_t ring, void *item){ (void)ring; (void)item; }
+
+#endif
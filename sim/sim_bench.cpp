@@ -0,0 +1,206 @@
+/*
+* Sweeps air data rate, sub-packet size, UART baud and payload codec and
+* prints one CSV row per combination on stdout, what the link can carry with
+* PACKET_MAX_B frames and the sample rate the sketches run at:
+*
+*   g++ -std=gnu++17 -O2 -Isim -I. sim/sim_bench.cpp -o sim_bench -pthread
+*   ./sim_bench > bench.csv
+*
+*   samples_per_packet  messages the codec fits in a frame of simulated DHT22 readings
+*   uart_ms air_ms      one frame into the module, and on air (Airtime.h)
+*   latency_ms          write to the sender's UART until the frame is out of the receiver's
+*   pkt_per_s           frames back to back, the slowest of UART in, air and UART out
+*   samples_per_s       pkt_per_s * samples_per_packet
+*   fill_ms duty_pct    one node sampling every SENSOR_INTERVAL: time to fill a frame,
+*                       and the share of it on air
+*   tdma_slot_ms        slot the receiver schedules for a frame and its ack, which
+*   tdma_nodes          assumes 240 byte sub-packets, and the nodes whose frames fit
+*                       a superframe of fill_ms
+*   sim_*               the same frames through two sim modules: latency of the
+*                       first, rate of the rest, frames lost on the way
+*
+* Every radio setting runs a burst of as many frames as fit the module's
+* buffer, SIM_BENCH_RUN=0 skips that and prints the model alone. The sim
+* clock runs at SIM_TIME_SCALE=20 unless set.
+*/
+
+#include <Arduino.h>
+#include <LoRa_E22.h>
+
+#include <Airtime.h>
+#include <LinkLayer.h>
+#include <PacketSchema.h>
+
+#include <random>
+
+#define BENCH_ADDR_TX 0x0B01
+#define BENCH_ADDR_RX 0x0B00
+#define BENCH_CHAN 0x12
+#define BENCH_FRAMES (E22_UART_BUFFER_B / (3 + PACKET_SIZE_B))
+#define BENCH_FILL_PACKETS 8 // samples_per_packet is averaged over these
+
+static const uint8_t bench_uarts[] = { UART_BPS_9600, UART_BPS_19200, UART_BPS_38400, UART_BPS_57600, UART_BPS_115200 };
+static const uint8_t bench_codecs[] = { CODEC_RAW, CODEC_DELTA_VLB };
+static const char *bench_codec_names[] = { "raw", "delta_vlb" };
+
+typedef struct _bench_run{
+  double latency_ms;
+  double pkt_per_s;
+  uint32_t lost;
+}BenchRun;
+
+LoRa_E22 bench_tx(&Serial1, 10, 11, 12);
+LoRa_E22 bench_rx(&Serial2, 20, 21, 22);
+
+/**
+* Fills packets with a random walk around indoor readings, steps the size of
+* the DHT22's noise, and returns the mean number of messages per packet.
+*/
+static double bench_fill(uint8_t codec, Packet *last){
+  std::mt19937 rng(1);
+  std::normal_distribution<float> step(0, 0.1);
+  Message msg = { 21.0, 45.0 };
+  CodecState state;
+  uint32_t total = 0;
+
+  for(uint8_t i = 0; i < BENCH_FILL_PACKETS; i++){
+    clear_packet_messages(last, &state);
+    last->packetData.codec = codec;
+    while(!packet_full(last)){
+      msg.temperature += step(rng);
+      msg.humidity += 2 * step(rng);
+      if(!append_packet_message(last, &state, msg)) break;
+    }
+    total += last->packetData._msg_index;
+  }
+  return (double)total / BENCH_FILL_PACKETS;
+}
+
+// config commands at 9600, then the UART at the swept rate for data, like E22_UART_FAST in the sketches
+static void bench_configure(LoRa_E22 *e22, HardwareSerial *serial, uint16_t addr, uint8_t rate, uint8_t sps, uint8_t uart){
+  ResponseStructContainer rc;
+  Configuration config;
+
+  serial->updateBaudRate(9600);
+  rc = e22->getConfiguration();
+  config = *(Configuration *)rc.data;
+
+  rc.close();
+  config.ADDH = addr >> 8;
+  config.ADDL = addr & 0xFF;
+  config.CHAN = BENCH_CHAN;
+  config.SPED.airDataRate = rate;
+  config.SPED.uartBaudRate = uart;
+  config.OPTION.subPacketSetting = sps;
+  config.TRANSMISSION_MODE.enableRSSI = RSSI_ENABLED;
+  config.TRANSMISSION_MODE.fixedTransmission = FT_FIXED_TRANSMISSION;
+  e22->setConfiguration(config, WRITE_CFG_PWR_DWN_LOSE);
+  serial->updateBaudRate(sim_uart_bps[uart]);
+  serial->sim_flush_rx();
+}
+
+// a burst of BENCH_FRAMES through the sim modules, timed on the sim clock
+static BenchRun bench_run(const Packet *packet, double expect_ms){
+  uint8_t frame[3 + PACKET_SIZE_B];
+  unsigned long arrived[BENCH_FRAMES], t0;
+  uint8_t received = 0;
+  uint32_t lost_before;
+  BenchRun run = { 0, 0, 0 };
+
+  {
+    std::lock_guard<std::mutex> lock(sim_stats().mutex);
+    lost_before = sim_stats().lost_frames + sim_stats().collided_frames + sim_stats().overflow_bytes;
+  }
+
+  frame[0] = BENCH_ADDR_RX >> 8;
+  frame[1] = BENCH_ADDR_RX & 0xFF;
+  frame[2] = BENCH_CHAN;
+  memcpy(frame + 3, packet, PACKET_SIZE_B);
+
+  Serial2.setTimeout((unsigned long)(expect_ms * BENCH_FRAMES) + 2000);
+  std::thread reader([&]{
+    uint8_t in[PACKET_SIZE_B + 1];
+
+    for(; received < BENCH_FRAMES; received++){
+      if(Serial2.readBytes(in, sizeof(in)) != sizeof(in)) break;
+      arrived[received] = millis();
+    }
+  });
+
+  t0 = millis();
+  for(uint8_t i = 0; i < BENCH_FRAMES; i++)
+    Serial1.write(frame, sizeof(frame)); // returns once clocked into the module, like the ESP32's
+  reader.join();
+
+  {
+    std::lock_guard<std::mutex> lock(sim_stats().mutex);
+    run.lost = sim_stats().lost_frames + sim_stats().collided_frames + sim_stats().overflow_bytes - lost_before;
+  }
+  run.lost += BENCH_FRAMES - received;
+  if(received)
+    run.latency_ms = arrived[0] - t0;
+  if(received > 1)
+    run.pkt_per_s = (received - 1) * 1000.0 / (arrived[received - 1] - arrived[0]);
+  return run;
+}
+
+int main(){
+  uint8_t simulate = sim_env("SIM_BENCH_RUN", 1) != 0;
+  double samples[sizeof(bench_codecs)];
+  Packet packet;
+
+  setenv("SIM_TIME_SCALE", "20", 0);
+  sim_boot_ns();
+
+  for(uint8_t c = 0; c < sizeof(bench_codecs); c++)
+    samples[c] = bench_fill(bench_codecs[c], &packet);
+
+  if(simulate){
+    Serial1.begin(9600);
+    Serial2.begin(9600);
+    bench_tx.begin();
+    bench_rx.begin();
+  }
+
+  printf("air_rate,sf,bw_khz,lora_bps,sub_packet_b,uart_bps,codec,samples_per_packet,uart_ms,air_ms,latency_ms,pkt_per_s,samples_per_s,"
+         "fill_ms,duty_pct,tdma_slot_ms,tdma_nodes,sim_latency_ms,sim_pkt_per_s,sim_lost\n");
+
+  for(uint8_t rate = 0; rate < 8; rate++)
+    for(uint8_t sps = 0; sps < 4; sps++)
+      for(uint8_t u = 0; u < sizeof(bench_uarts); u++){
+        uint32_t uart_bps = sim_uart_bps[bench_uarts[u]];
+        double uart_in_ms = link_uart_ms(3 + PACKET_SIZE_B, uart_bps), uart_out_ms = link_uart_ms(PACKET_SIZE_B + 1, uart_bps);
+        double air_ms = airtime_us(PACKET_SIZE_B, rate, airtime_sub_packet_b[sps]) / 1000.0;
+        double latency_ms = uart_in_ms + air_ms + uart_out_ms;
+        double pkt_per_s = 1000.0 / std::max(air_ms, std::max(uart_in_ms, uart_out_ms));
+        uint32_t slot_ms = tdma_slot_ms(PACKET_SIZE_B, rate, uart_bps), beacon_ms = tdma_beacon_ms(rate, uart_bps);
+        BenchRun run = { 0, 0, 0 };
+
+        fprintf(stderr, "air rate %u sub-packet %u uart %u\n", rate, airtime_sub_packet_b[sps], uart_bps);
+        if(simulate){
+          bench_configure(&bench_tx, &Serial1, BENCH_ADDR_TX, rate, sps, bench_uarts[u]);
+          bench_configure(&bench_rx, &Serial2, BENCH_ADDR_RX, rate, sps, bench_uarts[u]);
+          run = bench_run(&packet, latency_ms);
+        }
+
+        for(uint8_t c = 0; c < sizeof(bench_codecs); c++){
+          double fill_ms = samples[c] * SENSOR_INTERVAL;
+          uint16_t nodes = 0;
+
+          while(nodes < TDMA_MAX_SLOTS && tdma_frame_ms(slot_ms, nodes + 1, beacon_ms) <= fill_ms)
+            nodes++;
+
+          printf("%u,%u,%u,%u,%u,%u,%s,%.1f,%.1f,%.1f,%.1f,%.3f,%.1f,%.0f,%.3f,%u,%u,",
+                 rate, airtime_rates[rate].sf, airtime_rates[rate].bw_khz, airtime_bps(rate), airtime_sub_packet_b[sps], uart_bps,
+                 bench_codec_names[c], samples[c], uart_in_ms, air_ms, latency_ms, pkt_per_s, pkt_per_s * samples[c],
+                 fill_ms, 100 * air_ms / fill_ms, slot_ms, nodes);
+          if(simulate)
+            printf("%.0f,%.3f,%u\n", run.latency_ms, run.pkt_per_s, run.lost);
+          else
+            printf(",,\n");
+        }
+        fflush(stdout);
+      }
+
+  _exit(0); // the sim modules' threads are still running
+}
@@ -0,0 +1,47 @@
+#ifndef SIM_MAIN_H
+#define SIM_MAIN_H
+
+/*
+* Runs a sketch's setup()/loop() as a Linux process. Stops on SIGINT/SIGTERM
+* or after SIM_DURATION_MS of sim time and prints the SIM_STATS line. A deep
+* sleep ends in another setup().
+*/
+
+#include <Arduino.h>
+#include <SimStats.h>
+
+#include <signal.h>
+
+#ifndef SIM_ROLE
+  #define SIM_ROLE "node"
+#endif
+
+static volatile sig_atomic_t sim_stop = 0;
+
+static void sim_on_signal(int signal){ (void)signal; sim_stop = 1; }
+
+int main(){
+  unsigned long duration = (unsigned long)sim_env("SIM_DURATION_MS", 0);
+
+  signal(SIGINT, sim_on_signal);
+  signal(SIGTERM, sim_on_signal);
+  sim_boot_ns();
+  srand((unsigned)sim_env("SIM_SEED", getpid())); // random() is the hardware RNG on the ESP32
+
+  for(;;){
+    try{
+      setup();
+      while(!sim_stop && (!duration || millis() < duration))
+        loop();
+      break;
+    }
+    catch(const SimDeepSleep &){ // woken up, boot again
+      if(sim_stop || (duration && millis() >= duration)) break;
+    }
+  }
+
+  sim_print_stats(SIM_ROLE);
+  _exit(0); // radio threads may still be blocked, skip static destructors
+}
+
+#endif
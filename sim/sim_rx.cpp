@@ -0,0 +1,4 @@
+#define SIM_ROLE "rx"
+
+#include "../ESP32_rx/ESP32_rx.ino"
+#include "sim_main.h"
@@ -0,0 +1,4 @@
+#define SIM_ROLE "tx"
+
+#include "../ESP32_tx/ESP32_tx.ino"
+#include "sim_main.h"
@@ -0,0 +1,317 @@
+/*
+* Round trips of the message codecs (MessageCodec.h) through whole packets
+* on the host. Every trace is packed into packets with CODEC_RAW and with
+* CODEC_DELTA_VLB, unpacked again and compared field by field, which has to
+* be exact. Then the edges: each VLB bucket boundary, escapes, readings
+* clamped to int16, a packet that ends exactly on its last bit, a message
+* that no longer fits, and a truncated payload. Prints messages per packet
+* for each trace next to RAW_MESSAGE_COUNT, exits non-zero on any mismatch.
+*
+*   g++ -std=gnu++17 -O2 -I. tools/codec_test.cpp -o codec_test
+*   ./codec_test [trace.csv...]
+*
+* The built-in traces are generated with a fixed seed in the shape of DHT22
+* readings. Recorded ones are given as CSV, one "temperature,humidity" line
+* per sample in C and %; lines that do not start with a number are skipped.
+*/
+
+#include <PacketSchema.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <math.h>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef struct _trace{
+  std::string name;
+  std::vector<Message> samples;
+}Trace;
+
+static uint32_t failures = 0;
+
+#define CHECK(cond, ...) do{ if(!(cond)){ failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } }while(0)
+
+static Message sample(float temperature, float humidity){
+  Message msg = { temperature, humidity };
+  return msg;
+}
+
+// ---- traces ----
+
+// a room: 0.1 steps now and then around a slow drift
+static Trace trace_indoor(std::mt19937 &rng){
+  Trace t = { "indoor", {} };
+  int temperature = 213, humidity = 455;
+
+  for(int i = 0; i < 2000; i++){
+    if(rng() % 5 == 0) temperature += rng() % 2 ? 1 : -1;
+    if(rng() % 3 == 0) humidity += (int)(rng() % 3) - 1;
+    t.samples.push_back(sample(temperature / 10.0f, humidity / 10.0f));
+  }
+  return t;
+}
+
+// outdoors over two days, a sun that moves both fields by whole degrees and percent
+static Trace trace_outdoor(std::mt19937 &rng){
+  Trace t = { "outdoor", {} };
+  std::normal_distribution<float> noise(0, 0.15f);
+
+  for(int i = 0; i < 2 * 24 * 60; i++){
+    float day = sinf(i * 2 * (float)M_PI / (24 * 60));
+    t.samples.push_back(sample(roundf((8 + 9 * day + noise(rng)) * 10) / 10, roundf((70 - 25 * day + 2 * noise(rng)) * 10) / 10));
+  }
+  return t;
+}
+
+// a door opening into the cold and the odd bad read the sensor reports as 0
+static Trace trace_glitches(std::mt19937 &rng){
+  Trace t = { "glitches", {} };
+
+  for(int i = 0; i < 1500; i++){
+    float temperature = i % 300 < 40 ? -12.5f + (i % 300) * 0.1f : 21.0f + (rng() % 3) * 0.1f;
+    float humidity = i % 300 < 40 ? 85.0f : 40.0f + (rng() % 5) * 0.1f;
+
+    if(rng() % 97 == 0) temperature = humidity = 0;
+    t.samples.push_back(sample(temperature, humidity));
+  }
+  return t;
+}
+
+static uint8_t trace_load(const char *path, Trace *t){
+  FILE *f = fopen(path, "r");
+  char line[128];
+
+  if(!f) return 0;
+  t->name = path;
+  while(fgets(line, sizeof(line), f)){
+    float temperature, humidity;
+
+    if(sscanf(line, "%f,%f", &temperature, &humidity) == 2)
+      t->samples.push_back(sample(temperature, humidity));
+  }
+  fclose(f);
+  return 1;
+}
+
+// ---- round trips ----
+
+/**
+* Packs the trace into as many packets as it takes, unpacks each and checks
+* the fields against what went in. Prints messages per packet.
+*/
+static void round_trip(const Trace *t, uint8_t codec){
+  Packet packet;
+  CodecState state;
+  int16_t fields[MESSAGE_COUNT * MESSAGE_FIELDS], got[MESSAGE_COUNT * MESSAGE_FIELDS];
+  size_t next = 0, packets = 0, least = MESSAGE_COUNT, messages = 0;
+
+  while(next < t->samples.size()){
+    size_t first = next;
+    uint8_t n;
+
+    clear_packet_messages(&packet, &state);
+    packet.packetData.codec = codec;
+    while(next < t->samples.size() && !packet_full(&packet)){
+      const Message *msg = &t->samples[next];
+      size_t m = next - first;
+
+      if(!append_packet_message(&packet, &state, *msg)) break;
+      fields[m * MESSAGE_FIELDS] = codec_to_fixed(msg->temperature, TEMP_SCALE);
+      fields[m * MESSAGE_FIELDS + 1] = codec_to_fixed(msg->humidity, HUM_SCALE);
+      next++;
+    }
+    CHECK(next > first, "%s: nothing fit an empty packet", t->name.c_str());
+    if(next == first) return;
+
+    n = unpack_packet_fields(&packet, got, MESSAGE_COUNT);
+    CHECK(n == next - first, "%s codec %u packet %zu: %u of %zu messages back", t->name.c_str(), codec, packets, n, next - first);
+    for(size_t i = 0; i < (size_t)n * MESSAGE_FIELDS; i++)
+      if(got[i] != fields[i]){
+        CHECK(0, "%s codec %u packet %zu message %zu field %zu: %d back for %d", t->name.c_str(), codec, packets, i / MESSAGE_FIELDS,
+              i % MESSAGE_FIELDS, got[i], fields[i]);
+        break;
+      }
+
+    packets++;
+    messages += next - first;
+    if(next < t->samples.size() && (size_t)(next - first) < least) least = next - first; // the last packet is short
+  }
+
+  printf("%-24s %-5s %7zu %8zu %9.1f %5zu %9.2fx\n", t->name.c_str(), codec == CODEC_RAW ? "raw" : "vlb", t->samples.size(), packets,
+         (double)messages / packets, packets > 1 ? least : messages, (double)messages / packets / RAW_MESSAGE_COUNT);
+}
+
+// ---- edges ----
+
+static uint16_t message_bits(const int16_t *last, const int16_t *fields){
+  CodecState state;
+
+  codec_reset(&state);
+  memcpy(state.last, last, MESSAGE_FIELDS * sizeof(int16_t));
+  return codec_message_bits(CODEC_DELTA_VLB, &state, fields, MESSAGE_FIELDS);
+}
+
+// deltas either side of every bucket boundary take the bits the table says and come back exact
+static void test_buckets(){
+  static const struct { int32_t delta; uint8_t bits; } cases[] = {
+    { 0, 1 }, { 1, 5 }, { -1, 5 }, { -4, 5 }, { 4, 9 }, { -32, 9 }, { 32, 14 }, { -512, 14 }, { 512, 20 },
+    { 20000, 20 }, { -20000, 20 }, { 65535, 20 }, { -65535, 20 },
+  };
+  uint8_t buffer[16];
+
+  for(const auto &c : cases){
+    int16_t last[MESSAGE_FIELDS] = { c.delta > 32767 ? (int16_t)-32768 : c.delta < -32768 ? (int16_t)32767 : (int16_t)0, 0 };
+    int16_t fields[MESSAGE_FIELDS] = { (int16_t)(last[0] + c.delta), 0 }, got[MESSAGE_FIELDS];
+    BitStream out = { buffer, 0, sizeof(buffer) * 8 }, in = { buffer, 0, 0 };
+    CodecState enc, dec;
+
+    CHECK(message_bits(last, fields) == c.bits + 1, "delta %d: %u bits, expected %u", c.delta, message_bits(last, fields) - 1, c.bits);
+
+    codec_reset(&enc);
+    codec_reset(&dec);
+    memcpy(enc.last, last, sizeof(last));
+    memcpy(dec.last, last, sizeof(last));
+    CHECK(codec_encode(CODEC_DELTA_VLB, &enc, &out, fields, MESSAGE_FIELDS), "delta %d: not encoded", c.delta);
+    in.bit_capacity = out.bit_index;
+    CHECK(codec_decode(CODEC_DELTA_VLB, &dec, &in, got, MESSAGE_FIELDS) && got[0] == fields[0] && got[1] == fields[1],
+          "delta %d: %d back for %d", c.delta, got[0], fields[0]);
+    CHECK(in.bit_index == out.bit_index, "delta %d: read %u bits of %u", c.delta, in.bit_index, out.bit_index);
+  }
+}
+
+// readings past what a scaled int16 holds are clamped, not wrapped
+static void test_clamp(){
+  Packet packet;
+  CodecState state;
+  int16_t got[2 * MESSAGE_FIELDS];
+
+  clear_packet_messages(&packet, &state);
+  append_packet_message(&packet, &state, sample(5000.0f, -5000.0f));
+  append_packet_message(&packet, &state, sample(-5000.0f, 5000.0f));
+  CHECK(unpack_packet_fields(&packet, got, 2) == 2, "clamped messages not decoded");
+  CHECK(got[0] == INT16_MAX && got[1] == INT16_MIN && got[2] == INT16_MIN && got[3] == INT16_MAX, "clamped to %d %d %d %d", got[0], got[1],
+        got[2], got[3]);
+}
+
+/**
+* Escapes only, MESSAGE_MAX_BITS a message, end exactly on the payload's last
+* bit for VLB. packet_full() has to wait for that bit, and a message on top of
+* it has to be refused without touching the packet.
+*/
+static void test_exactly_full(){
+  Packet packet, before;
+  CodecState state, state_before;
+  int16_t fields[MESSAGE_COUNT * MESSAGE_FIELDS];
+  size_t n = 0;
+
+  static_assert(PACKET_PAYLOAD_SIZE_B * 8 % MESSAGE_MAX_BITS == 0, "pick values that end on the last bit for this payload size");
+
+  clear_packet_messages(&packet, &state);
+  packet.packetData.codec = CODEC_DELTA_VLB;
+  while(!packet_full(&packet)){
+    Message msg = n % 2 ? sample(-3000.0f, 3000.0f) : sample(3000.0f, -3000.0f); // every delta an escape
+
+    CHECK(append_packet_message(&packet, &state, msg), "message %zu refused before the packet was full", n);
+    fields[n * MESSAGE_FIELDS] = codec_to_fixed(msg.temperature, TEMP_SCALE);
+    fields[n * MESSAGE_FIELDS + 1] = codec_to_fixed(msg.humidity, HUM_SCALE);
+    n++;
+  }
+  CHECK(packet.packetData._bit_index == PACKET_PAYLOAD_SIZE_B * 8, "full at bit %u of %zu", packet.packetData._bit_index,
+        PACKET_PAYLOAD_SIZE_B * 8);
+  CHECK(n == PACKET_PAYLOAD_SIZE_B * 8 / MESSAGE_MAX_BITS, "%zu messages in a full packet", n);
+
+  before = packet;
+  state_before = state;
+  CHECK(!append_packet_message(&packet, &state, sample(30.0f, -30.0f)), "a message past the last bit was taken");
+  CHECK(!memcmp(&before, &packet, sizeof(Packet)) && !memcmp(&state_before, &state, sizeof(CodecState)),
+        "a refused message changed the packet");
+
+  int16_t got[MESSAGE_COUNT * MESSAGE_FIELDS];
+  CHECK(unpack_packet_fields(&packet, got, MESSAGE_COUNT) == n && !memcmp(got, fields, n * MESSAGE_FIELDS * sizeof(int16_t)),
+        "full packet does not round trip");
+}
+
+// RAW messages are fixed size, a stream of exactly n of them takes n and refuses one more
+static void test_raw_exactly_full(){
+  const uint16_t n = 7;
+  uint8_t buffer[n * MESSAGE_FIELDS * CODEC_FIELD_BITS / 8];
+  BitStream out = { buffer, 0, sizeof(buffer) * 8 }, in = { buffer, 0, sizeof(buffer) * 8 };
+  CodecState enc, dec;
+  int16_t fields[MESSAGE_FIELDS], got[MESSAGE_FIELDS];
+
+  codec_reset(&enc);
+  codec_reset(&dec);
+  for(uint16_t i = 0; i < n; i++){
+    fields[0] = (int16_t)(i * 9001 - 32768);
+    fields[1] = (int16_t)(32767 - i * 4099);
+    CHECK(codec_encode(CODEC_RAW, &enc, &out, fields, MESSAGE_FIELDS), "raw message %u refused", i);
+  }
+  CHECK(out.bit_index == out.bit_capacity, "raw full at bit %u of %u", out.bit_index, out.bit_capacity);
+  CHECK(!codec_encode(CODEC_RAW, &enc, &out, fields, MESSAGE_FIELDS) && out.bit_index == out.bit_capacity, "raw message past the end taken");
+
+  for(uint16_t i = 0; i < n; i++){
+    CHECK(codec_decode(CODEC_RAW, &dec, &in, got, MESSAGE_FIELDS), "raw message %u not decoded", i);
+    CHECK(got[0] == (int16_t)(i * 9001 - 32768) && got[1] == (int16_t)(32767 - i * 4099), "raw message %u: %d %d", i, got[0], got[1]);
+  }
+  CHECK(!codec_decode(CODEC_RAW, &dec, &in, got, MESSAGE_FIELDS), "raw decode read past the end");
+}
+
+// a payload cut short decodes the messages that are whole and stops
+static void test_truncated(const Trace *t){
+  Packet packet;
+  CodecState state;
+  int16_t got[MESSAGE_COUNT * MESSAGE_FIELDS];
+  uint16_t bits[MESSAGE_COUNT + 1];
+  uint8_t n = 0;
+
+  clear_packet_messages(&packet, &state);
+  bits[0] = 0;
+  while(n < t->samples.size() && !packet_full(&packet) && append_packet_message(&packet, &state, t->samples[n]))
+    bits[++n] = packet.packetData._bit_index;
+
+  for(uint8_t cut = 1; cut < n; cut++){
+    Packet short_packet = packet;
+
+    short_packet.packetData._bit_index = bits[cut] + (bits[cut + 1] - bits[cut]) / 2; // in the middle of message cut
+    CHECK(unpack_packet_fields(&short_packet, got, MESSAGE_COUNT) == cut, "cut in message %u: %u decoded", cut,
+          unpack_packet_fields(&short_packet, got, MESSAGE_COUNT));
+  }
+}
+
+int main(int argc, char **argv){
+  std::mt19937 rng(1);
+  std::vector<Trace> traces;
+
+  traces.push_back(trace_indoor(rng));
+  traces.push_back(trace_outdoor(rng));
+  traces.push_back(trace_glitches(rng));
+  for(int i = 1; i < argc; i++){
+    Trace t;
+
+    if(!trace_load(argv[i], &t) || t.samples.empty()){
+      fprintf(stderr, "no samples in %s\n", argv[i]);
+      return 2;
+    }
+    traces.push_back(t);
+  }
+
+  printf("payload %zu B, %zu messages as structs (RAW_MESSAGE_COUNT), target %zu\n\n", PACKET_PAYLOAD_SIZE_B, RAW_MESSAGE_COUNT, MESSAGE_COUNT);
+  printf("%-24s %-5s %7s %8s %9s %5s %10s\n", "trace", "codec", "samples", "packets", "msgs/pkt", "min", "vs structs");
+  for(const Trace &t : traces){
+    round_trip(&t, CODEC_RAW);
+    round_trip(&t, CODEC_DELTA_VLB);
+  }
+
+  test_buckets();
+  test_clamp();
+  test_exactly_full();
+  test_raw_exactly_full();
+  for(const Trace &t : traces)
+    test_truncated(&t);
+
+  printf("\n%s, %u failures\n", failures ? "FAILED" : "passed", failures);
+  return failures != 0;
+}
@@ -0,0 +1,154 @@
+/*
+* dht_decode() (Dht22.h) on the host, against pulse trains the way the RMT
+* hands them over: what the line did after the host let go, the sensor's
+* response, 40 bits and the end pulse, widths off by a few us like a real
+* sensor's. Each case has the status it has to decode to and, for good
+* ones, the reading. The widths are literal rather than taken from the
+* decoder's limits, so moving a limit shows up here. Exits non-zero on any
+* mismatch.
+*
+*   g++ -std=gnu++17 -O2 -I. tools/dht_test.cpp -o dht_test
+*   ./dht_test [capture...]
+*
+* Captures from a logic analyzer are given as text, one "level us" pair per
+* pulse; they are decoded and printed, there is nothing to check them against.
+*/
+
+#define DHT22_NO_DRIVER
+#include <Dht22.h>
+
+#include <stdio.h>
+
+#include <vector>
+
+typedef std::vector<DhtPulse> Train;
+
+static uint32_t failures = 0;
+
+#define CHECK(cond, ...) do{ if(!(cond)){ failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } }while(0)
+
+static const char *status_names[] = { "ok", "no response", "short", "timing", "checksum", "range" };
+
+// a sensor's spread, cycled through so every run sees the same widths
+static const int8_t jitter[] = { 2, -3, 0, 4, -1, -4, 3, 1, -2, 0, 4, -3 };
+
+/**
+* The train for humidity and raw temperature as the sensor sends them, the
+* checksum worked out unless one is given. bits cuts it short.
+*/
+static Train train(uint16_t humidity, uint16_t temperature, int checksum = -1, uint8_t bits = DHT_BITS){
+  uint8_t bytes[5] = { (uint8_t)(humidity >> 8), (uint8_t)humidity, (uint8_t)(temperature >> 8), (uint8_t)temperature, 0 };
+  Train t;
+  size_t j = 0;
+
+  bytes[4] = checksum < 0 ? (uint8_t)(bytes[0] + bytes[1] + bytes[2] + bytes[3]) : (uint8_t)checksum;
+  t.push_back({ 1, 31 }); // released by the host, pulled up until the sensor answers
+  t.push_back({ 0, (uint16_t)(81 + jitter[j++ % sizeof(jitter)]) });
+  t.push_back({ 1, (uint16_t)(79 + jitter[j++ % sizeof(jitter)]) });
+  for(uint8_t b = 0; b < bits; b++){
+    uint8_t one = (bytes[b >> 3] >> (7 - (b & 7))) & 1;
+
+    t.push_back({ 0, (uint16_t)(52 + jitter[j++ % sizeof(jitter)]) });
+    t.push_back({ 1, (uint16_t)((one ? 71 : 26) + jitter[j++ % sizeof(jitter)]) });
+  }
+  t.push_back({ 0, 53 });
+  return t;
+}
+
+// the pulse of bit b, its low or its high half
+static DhtPulse *bit_pulse(Train &t, uint8_t b, uint8_t high){ return &t[3 + 2 * b + high]; }
+
+static void expect(const char *name, const Train &t, uint8_t status, int16_t humidity = 0, int16_t temperature = 0){
+  DhtReading reading = { 12345, 12345 }; // left alone unless the decode is good
+  uint8_t got = dht_decode(t.data(), t.size(), &reading);
+
+  CHECK(got == status, "%s: %s, expected %s", name, status_names[got], status_names[status]);
+  if(status == DHT_OK)
+    CHECK(reading.humidity == humidity && reading.temperature == temperature, "%s: %.1f %% %.1f C, expected %.1f %% %.1f C", name,
+          reading.humidity / 10.0, reading.temperature / 10.0, humidity / 10.0, temperature / 10.0);
+  else
+    CHECK(reading.humidity == 12345 && reading.temperature == 12345, "%s: reading written on %s", name, status_names[got]);
+  printf("%-28s %s\n", name, status_names[got]);
+}
+
+static uint8_t capture_load(const char *path, Train *t){
+  FILE *f = fopen(path, "r");
+  unsigned level, us;
+
+  if(!f) return 0;
+  while(fscanf(f, "%u %u", &level, &us) == 2)
+    t->push_back({ (uint8_t)(level != 0), (uint16_t)us });
+  fclose(f);
+  return 1;
+}
+
+int main(int argc, char **argv){
+  Train t;
+
+  expect("room", train(455, 213), DHT_OK, 455, 213);
+  expect("below freezing", train(652, 0x8000 | 101), DHT_OK, 652, -101); // bit 15 is the sign, not two's complement
+  expect("limits", train(1000, 800), DHT_OK, 1000, 800);
+  expect("coldest", train(0, 0x8000 | 400), DHT_OK, 0, -400);
+
+  t = train(455, 213);
+  t.erase(t.begin()); // no pull up seen before the response
+  expect("no lead in", t, DHT_OK, 455, 213);
+
+  t = train(455, 213);
+  bit_pulse(t, 39, 1)->us = 45; // last bit, checksum 0x9D has it set
+  expect("one just too short", t, DHT_ERR_CHECKSUM);
+  t = train(455, 213);
+  bit_pulse(t, 38, 1)->us = 50; // a 0 in the checksum
+  expect("zero just too long", t, DHT_ERR_CHECKSUM);
+
+  expect("bad checksum", train(455, 213, 0x00), DHT_ERR_CHECKSUM);
+  t = train(455, 213);
+  bit_pulse(t, 20, 1)->us = 70; // a 0 of the temperature stretched
+  expect("flipped bit", t, DHT_ERR_CHECKSUM);
+
+  t = train(455, 213);
+  bit_pulse(t, 5, 0)->us = 95;
+  expect("long bit low", t, DHT_ERR_TIMING);
+  t = train(455, 213);
+  bit_pulse(t, 12, 1)->us = 105;
+  expect("long bit high", t, DHT_ERR_TIMING);
+  t = train(455, 213);
+  bit_pulse(t, 30, 1)->us = 8; // a glitch the filter let through
+  expect("glitch", t, DHT_ERR_TIMING);
+  t = train(455, 213);
+  bit_pulse(t, 7, 1)->level = 0;
+  expect("levels out of step", t, DHT_ERR_TIMING);
+
+  expect("cut after 30 bits", train(455, 213, -1, 30), DHT_ERR_SHORT);
+  expect("cut after 39 bits", train(455, 213, -1, 39), DHT_ERR_SHORT);
+
+  expect("nothing", Train(), DHT_ERR_NO_RESPONSE);
+  expect("line stays high", Train(1, { 1, 5000 }), DHT_ERR_NO_RESPONSE);
+  t = train(455, 213);
+  t[1].us = 130;
+  t.erase(t.begin() + 3, t.end()); // the bits would look like a response of their own
+  expect("response too long", t, DHT_ERR_NO_RESPONSE);
+
+  expect("humidity over 100 %", train(1001, 213), DHT_ERR_RANGE);
+  expect("humidity negative", train(0x8000 | 455, 213), DHT_ERR_RANGE); // humidity has no sign bit, bytes[0] >= 0x80 is garbage
+  expect("temperature over 80 C", train(455, 801), DHT_ERR_RANGE);
+  expect("temperature under -40 C", train(455, 0x8000 | 401), DHT_ERR_RANGE);
+
+  for(int i = 1; i < argc; i++){
+    Train capture;
+    DhtReading reading = { 0, 0 };
+    uint8_t status;
+
+    if(!capture_load(argv[i], &capture)){
+      fprintf(stderr, "cannot read %s\n", argv[i]);
+      return 2;
+    }
+    status = dht_decode(capture.data(), capture.size(), &reading);
+    printf("%s: %zu pulses, %s", argv[i], capture.size(), status_names[status]);
+    if(status == DHT_OK) printf(", %.1f %% %.1f C", reading.humidity / 10.0, reading.temperature / 10.0);
+    printf("\n");
+  }
+
+  printf("\n%s, %u failures\n", failures ? "FAILED" : "passed", failures);
+  return failures != 0;
+}
@@ -0,0 +1,122 @@
+/*
+* Turns the binary log of a LOG_BINARY build back into text. Formats are
+* looked up by hash in the sources given on the command line, which have to
+* be the ones the firmware was built from:
+*
+*   g++ -std=gnu++17 -O2 -I. tools/log_decode.cpp -o log_decode
+*   ./log_decode Log.h E22Config.h ESP32_rx/Helper.h ESP32_rx/ESP32_rx.ino < /dev/ttyUSB0
+*   ./log_decode Log.h E22Config.h ESP32_tx/Helper.h ESP32_tx/ESP32_tx.ino < /dev/ttyUSB1
+*
+* Bytes outside of frames, boot messages from the ROM and the like, are passed
+* through as they are.
+*/
+
+#define LOG_NO_RUNTIME
+#include "Log.h"
+
+#include <fstream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+
+static std::map<uint32_t, std::string> formats;
+
+// the literal as the compiler sees it, only the escapes formats use
+static std::string unescape(const std::string &s){
+  std::string out;
+
+  for(size_t i = 0; i < s.size(); i++){
+    if(s[i] != '\\' || i + 1 == s.size()) { out += s[i]; continue; }
+    switch(s[++i]){
+      case 'n': out += '\n'; break;
+      case 'r': out += '\r'; break;
+      case 't': out += '\t'; break;
+      default: out += s[i]; break;
+    }
+  }
+  return out;
+}
+
+static void load_formats(const char *path){
+  static const std::regex call("LOG_(ERROR|WARN|INFO|DEBUG|TRACE)\\(\\s*\"((?:[^\"\\\\]|\\\\.)*)\"");
+  std::ifstream in(path);
+  std::stringstream text;
+
+  if(!in) { fprintf(stderr, "log_decode: cannot read %s\n", path); return; }
+  text << in.rdbuf();
+
+  std::string src = text.str();
+  for(std::sregex_iterator it(src.begin(), src.end(), call), end; it != end; ++it){
+    std::string fmt = unescape((*it)[2]);
+    uint32_t id = log_hash(fmt.c_str());
+
+    if(formats.count(id) && formats[id] != fmt)
+      fprintf(stderr, "log_decode: hash clash \"%s\" \"%s\"\n", formats[id].c_str(), fmt.c_str());
+    formats[id] = fmt;
+  }
+}
+
+// prints the frame at buf, 0 when the checksum does not match
+static uint8_t decode_frame(const uint8_t *buf){
+  uint8_t length = buf[2], check = 0, level;
+  uint32_t id, ms;
+  char text[512];
+
+  for(uint8_t i = 0; i < length; i++) check ^= buf[3 + i];
+  if(check != buf[3 + length]) return 0;
+
+  memcpy(&id, buf + 3, 4);
+  memcpy(&ms, buf + 7, 4);
+  level = buf[11];
+
+  auto fmt = formats.find(id);
+  if(fmt != formats.end())
+    log_format(fmt->second.c_str(), buf + 3 + LOG_HEADER_B, length - LOG_HEADER_B, text, sizeof(text));
+  else
+    snprintf(text, sizeof(text), "<unknown format %08x>", (unsigned)id);
+
+  printf("%lu %s %s\n", (unsigned long)ms, level <= LOG_LEVEL_TRACE ? log_level_names[level] : "?", text);
+  return 1;
+}
+
+/**
+* Takes frames off the front of pending, returns when it needs more bytes.
+* A byte that does not start a valid frame is plain output.
+*/
+static void scan(std::string &pending){
+  while(!pending.empty()){
+    const uint8_t *buf = (const uint8_t *)pending.data();
+    size_t n = pending.size(), length;
+
+    if(buf[0] == LOG_SYNC0){
+      if(n < 2) return;
+      if(buf[1] == LOG_SYNC1){
+        if(n < 3) return;
+        length = buf[2];
+        if(length >= LOG_HEADER_B && length <= LOG_HEADER_B + LOG_DATA_B){
+          if(n < length + 4) return;
+          if(decode_frame(buf)) { pending.erase(0, length + 4); continue; }
+        }
+      }
+    }
+    putchar(buf[0]);
+    pending.erase(0, 1);
+  }
+}
+
+int main(int argc, char **argv){
+  std::string pending;
+  int c;
+
+  if(argc < 2) { fprintf(stderr, "usage: %s <sources>... < log\n", argv[0]); return 1; }
+  for(int i = 1; i < argc; i++) load_formats(argv[i]);
+
+  while((c = getchar()) != EOF){
+    pending += (char)c;
+    scan(pending);
+    if(pending.empty()) fflush(stdout);
+  }
+  fwrite(pending.data(), 1, pending.size(), stdout);
+  return 0;
+}